@@ -0,0 +1,122 @@
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "postings_codec.hpp"
+
+// Compares postings size and decode throughput of every codec on the lists of an existing index.
+
+static volatile uint64_t g_sink = 0;
+
+struct List {
+    uint32_t df = 0;
+    std::vector<uint32_t> docs;
+};
+
+static std::vector<List> load_lists(const std::string& dict_path, const std::string& postings_path) {
+    std::ifstream dict(dict_path, std::ios::binary);
+    if (!dict) throw std::runtime_error("Cannot open dict: " + dict_path);
+    std::ifstream bin(postings_path, std::ios::binary);
+    if (!bin) throw std::runtime_error("Cannot open postings: " + postings_path);
+
+    std::vector<List> lists;
+    std::vector<uint8_t> buf;
+    std::string line;
+    std::getline(dict, line); // header
+
+    while (std::getline(dict, line)) {
+        if (line.empty()) continue;
+        std::istringstream ss(line);
+        std::string term, df_s, off_s, len_s, codec_s;
+        if (!std::getline(ss, term, '\t')) continue;
+        if (!std::getline(ss, df_s, '\t')) continue;
+        if (!std::getline(ss, off_s, '\t')) continue;
+        if (!std::getline(ss, len_s, '\t')) continue;
+
+        Codec codec = Codec::Raw;
+        if (std::getline(ss, codec_s, '\t') && !parse_codec(codec_s, codec)) {
+            throw std::runtime_error("Unknown codec: " + codec_s);
+        }
+
+        List l;
+        l.df = (uint32_t)std::stoul(df_s);
+        buf.resize((size_t)std::stoull(len_s));
+        bin.seekg((std::streamoff)std::stoull(off_s), std::ios::beg);
+        bin.read(reinterpret_cast<char*>(buf.data()), (std::streamsize)buf.size());
+        decode_postings(codec, buf.data(), buf.size(), l.df, l.docs);
+        lists.push_back(std::move(l));
+    }
+    return lists;
+}
+
+static void bench(Codec codec, const std::vector<List>& lists, uint64_t total_docs) {
+    std::vector<uint8_t> data;
+    std::vector<size_t> offs;
+    for (const auto& l : lists) {
+        offs.push_back(data.size());
+        encode_postings(codec, l.docs, data);
+    }
+    offs.push_back(data.size());
+
+    std::vector<uint32_t> out;
+    uint64_t checksum = 0;
+    int rounds = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    double secs = 0;
+    do {
+        for (size_t i = 0; i < lists.size(); i++) {
+            decode_postings(codec, data.data() + offs[i], offs[i + 1] - offs[i], lists[i].df, out);
+            if (!out.empty()) checksum += out.back();
+        }
+        rounds++;
+        secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    } while (secs < 1.0);
+
+    double mints = (double)total_docs * rounds / secs / 1e6;
+    std::cout << codec_name(codec) << "\t" << data.size() << "\t"
+              << (double)data.size() * 8.0 / (double)total_docs << "\t"
+              << mints << "\n";
+    g_sink = checksum;
+}
+
+int main(int argc, char** argv) {
+    std::string dict_path, postings_path;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--dict" && i + 1 < argc) dict_path = argv[++i];
+        else if (a == "--postings" && i + 1 < argc) postings_path = argv[++i];
+        else if (a == "--help" || a == "-h") {
+            std::cerr << "Usage: bench_codec --dict index/dict.tsv --postings index/postings.bin\n";
+            return 0;
+        } else {
+            std::cerr << "Unknown arg: " << a << "\n";
+            return 2;
+        }
+    }
+    if (dict_path.empty() || postings_path.empty()) {
+        std::cerr << "Usage: bench_codec --dict index/dict.tsv --postings index/postings.bin\n";
+        return 2;
+    }
+
+    std::vector<List> lists;
+    try {
+        lists = load_lists(dict_path, postings_path);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    uint64_t total_docs = 0;
+    for (const auto& l : lists) total_docs += l.df;
+    std::cerr << "Lists: " << lists.size() << ", postings: " << total_docs << "\n";
+
+    std::cout << "codec\tbytes\tbits_per_posting\tdecode_Mints_per_s\n";
+    bench(Codec::Raw, lists, total_docs);
+    bench(Codec::StreamVByte, lists, total_docs);
+    bench(Codec::Roaring, lists, total_docs);
+    return 0;
+}
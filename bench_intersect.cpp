@@ -0,0 +1,112 @@
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "setops.hpp"
+
+// Micro-benchmark of AND over synthetic sorted lists with a growing df ratio.
+// "merge" is the linear two-pointer loop boolean_search used before the adaptive engine.
+
+static volatile uint64_t g_sink = 0;
+
+static std::vector<uint32_t> random_list(std::mt19937& rng, size_t n, uint32_t universe) {
+    std::vector<uint32_t> v;
+    v.reserve(n * 2);
+    std::uniform_int_distribution<uint32_t> dist(1, universe);
+    for (size_t i = 0; i < n * 11 / 10 + 16; i++) v.push_back(dist(rng));
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+    std::shuffle(v.begin(), v.end(), rng);
+    v.resize(std::min(n, v.size()));
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+template <class F>
+static double time_ns(F&& f) {
+    int rounds = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    double secs = 0;
+    do {
+        f();
+        rounds++;
+        secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    } while (secs < 0.2);
+    return secs * 1e9 / rounds;
+}
+
+int main(int argc, char** argv) {
+    size_t large_n = 1'000'000;
+    uint32_t universe = 8'000'000;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--large" && i + 1 < argc) large_n = (size_t)std::stoull(argv[++i]);
+        else if (a == "--universe" && i + 1 < argc) universe = (uint32_t)std::stoul(argv[++i]);
+        else if (a == "--help" || a == "-h") {
+            std::cerr << "Usage: bench_intersect [--large N] [--universe U]\n";
+            return 0;
+        } else {
+            std::cerr << "Unknown arg: " << a << "\n";
+            return 2;
+        }
+    }
+
+    std::mt19937 rng(42);
+    std::vector<uint32_t> large = random_list(rng, large_n, universe);
+    std::vector<uint8_t> packed;
+    encode_postings(Codec::StreamVByte, large, packed);
+
+    std::vector<uint32_t> large_decoded;
+    std::vector<uint32_t> out;
+    out.reserve(large.size());
+
+    std::cout << "ratio\tsmall\tlarge\tmerge_us\tgallop_us\tsimd_us\tadaptive_us\tdecode+adaptive_us\tpacked_us\tspeedup\n";
+    for (size_t ratio : {1, 2, 4, 16, 64, 256, 1024, 8192}) {
+        size_t small_n = std::max<size_t>(1, large.size() / ratio);
+        std::vector<uint32_t> small = random_list(rng, small_n, universe);
+        // half of the small list is guaranteed to hit
+        for (size_t i = 0; i < small.size(); i += 2) small[i] = large[(size_t)rng() % large.size()];
+        std::sort(small.begin(), small.end());
+        small.erase(std::unique(small.begin(), small.end()), small.end());
+
+        const uint32_t* a = small.data();
+        const uint32_t* b = large.data();
+        size_t na = small.size(), nb = large.size();
+
+        std::vector<uint32_t> expect;
+        intersect_merge(a, na, b, nb, expect);
+        auto check = [&](const char* name) {
+            if (out != expect) std::cerr << "MISMATCH in " << name << " at ratio " << ratio << "\n";
+        };
+
+        double merge = time_ns([&] { out.clear(); intersect_merge(a, na, b, nb, out); g_sink = out.size(); });
+        double gallop = time_ns([&] { out.clear(); intersect_gallop(a, na, b, nb, out); g_sink = out.size(); });
+        check("gallop");
+        double simd = time_ns([&] { out.clear(); intersect_simd(a, na, b, nb, out); g_sink = out.size(); });
+        check("simd");
+        double adaptive = time_ns([&] { out.clear(); intersect_adaptive(a, na, b, nb, out); g_sink = out.size(); });
+        check("adaptive");
+        double decoded = time_ns([&] {
+            decode_postings(Codec::StreamVByte, packed.data(), packed.size(), (uint32_t)nb, large_decoded);
+            out.clear();
+            intersect_adaptive(a, na, large_decoded.data(), nb, out);
+            g_sink = out.size();
+        });
+        check("decode+adaptive");
+        double skip = time_ns([&] {
+            out.clear();
+            intersect_packed(a, na, packed.data(), packed.size(), (uint32_t)nb, out);
+            g_sink = out.size();
+        });
+        check("packed");
+
+        std::cout << ratio << "\t" << na << "\t" << nb << "\t"
+                  << merge / 1e3 << "\t" << gallop / 1e3 << "\t" << simd / 1e3 << "\t"
+                  << adaptive / 1e3 << "\t" << decoded / 1e3 << "\t" << skip / 1e3 << "\t"
+                  << merge / adaptive << "x\n";
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "index_format.hpp"
+#include "ranking.hpp"
+
+// Top-k BM25 latency of exhaustive scoring, WAND and block-max WAND on the same
+// OR queries over an existing index (index.bin + tf.bin). Every pruned result is
+// checked against the exhaustive one.
+
+struct Query {
+    std::string text;
+    std::vector<uint32_t> terms; // ordinals
+};
+
+static std::vector<Query> load_queries(const std::string& path, const Index& index) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open queries: " + path);
+    std::vector<Query> qs;
+    std::string line;
+    while (std::getline(in, line)) {
+        Query q;
+        q.text = line;
+        std::istringstream ss(line);
+        std::string w;
+        while (ss >> w) {
+            if (w == "OR" || w == "or") continue;
+            int64_t id = index.find(w);
+            if (id >= 0 && std::find(q.terms.begin(), q.terms.end(), (uint32_t)id) == q.terms.end()) {
+                q.terms.push_back((uint32_t)id);
+            }
+        }
+        if (!q.terms.empty()) qs.push_back(q);
+    }
+    return qs;
+}
+
+// Random OR queries of `nterms` terms with df >= min_df, sampled by term (not by
+// posting), so rare and frequent terms are mixed.
+static std::vector<Query> random_queries(const Index& index, size_t n, size_t nterms, uint32_t min_df) {
+    std::vector<uint32_t> pool;
+    for (uint32_t i = 0; i < index.size(); i++) {
+        if (index.entry(i).df >= min_df) pool.push_back(i);
+    }
+    if (pool.size() < nterms) throw std::runtime_error("Not enough terms with df >= " + std::to_string(min_df));
+    std::mt19937 rng(42);
+    std::vector<Query> qs;
+    std::string buf;
+    for (size_t i = 0; i < n; i++) {
+        Query q;
+        while (q.terms.size() < nterms) {
+            uint32_t t = pool[rng() % pool.size()];
+            if (std::find(q.terms.begin(), q.terms.end(), t) != q.terms.end()) continue;
+            q.terms.push_back(t);
+            q.text += (q.text.empty() ? "" : " OR ") + std::string(index.term(t, buf));
+        }
+        qs.push_back(q);
+    }
+    return qs;
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p * (double)v.size()))];
+}
+
+int main(int argc, char** argv) {
+    std::string index_path = "index/index.bin", queries_path;
+    size_t k = 10, nrandom = 200, nterms = 4;
+    uint32_t min_df = 20;
+    int rounds = 3;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--index" && i + 1 < argc) index_path = argv[++i];
+        else if (a == "--queries" && i + 1 < argc) queries_path = argv[++i];
+        else if (a == "--k" && i + 1 < argc) k = (size_t)std::stoul(argv[++i]);
+        else if (a == "--random" && i + 1 < argc) nrandom = (size_t)std::stoul(argv[++i]);
+        else if (a == "--terms" && i + 1 < argc) nterms = (size_t)std::stoul(argv[++i]);
+        else if (a == "--min-df" && i + 1 < argc) min_df = (uint32_t)std::stoul(argv[++i]);
+        else if (a == "--rounds" && i + 1 < argc) rounds = std::max(1, std::stoi(argv[++i]));
+        else if (a == "--help" || a == "-h") {
+            std::cerr << "Usage: bench_rank --index index/index.bin [--queries file | --random N --terms T --min-df D]\n"
+                      << "                  [--k 10] [--rounds R]\n"
+                      << "Queries are terms separated by spaces or OR, one query per line.\n";
+            return 0;
+        } else {
+            std::cerr << "Unknown arg: " << a << "\n";
+            return 2;
+        }
+    }
+
+    Index index;
+    TfIndex tf;
+    std::vector<Query> qs;
+    try {
+        index.open_bin(index_path);
+        size_t slash = index_path.rfind('/');
+        tf.open((slash == std::string::npos ? "" : index_path.substr(0, slash + 1)) + "tf.bin");
+        qs = queries_path.empty() ? random_queries(index, nrandom, nterms, min_df) : load_queries(queries_path, index);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    Bm25 bm(tf.docs(), tf.total_len());
+    std::cerr << "Queries: " << qs.size() << ", k=" << k << ", docs " << tf.docs() << ", avgdl " << bm.avgdl << "\n";
+
+    const RankAlgo algos[] = {RankAlgo::Exhaustive, RankAlgo::Wand, RankAlgo::BlockMaxWand};
+    std::vector<std::vector<double>> lat(3);
+    std::vector<uint64_t> scored(3, 0);
+    uint64_t postings = 0;
+    size_t mismatches = 0;
+
+    for (const Query& q : qs) {
+        std::vector<ScoredDoc> expect;
+        for (int a = 0; a < 3; a++) {
+            double best = 0;
+            std::vector<ScoredDoc> got;
+            RankStats st;
+            for (int r = 0; r < rounds; r++) {
+                st = RankStats();
+                auto t0 = std::chrono::steady_clock::now();
+                std::vector<TermCursor> cur;
+                cur.reserve(q.terms.size());
+                for (uint32_t t : q.terms) cur.emplace_back(index, tf, t, bm.idf(index.entry(t).df), bm);
+                TopK top(k);
+                rank_top_k(algos[a], cur, top, nullptr, st);
+                got = top.sorted();
+                double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+                if (r == 0 || us < best) best = us;
+            }
+            lat[a].push_back(best);
+            scored[a] += st.scored;
+            if (a == 0) {
+                expect = got;
+                postings += st.postings;
+                continue;
+            }
+            bool same = got.size() == expect.size();
+            for (size_t i = 0; same && i < got.size(); i++) {
+                same = got[i].doc == expect[i].doc && got[i].score == expect[i].score;
+            }
+            if (!same) {
+                mismatches++;
+                std::cerr << "MISMATCH " << rank_algo_name(algos[a]) << ": " << q.text << "\n";
+            }
+        }
+    }
+
+    double base = 0;
+    for (double x : lat[0]) base += x;
+    std::cout << "algo\tmean_us\tp50_us\tp95_us\tp99_us\tscored_docs\tscored_%postings\tspeedup\n";
+    for (int a = 0; a < 3; a++) {
+        double sum = 0;
+        for (double x : lat[a]) sum += x;
+        double n = qs.empty() ? 1 : (double)qs.size();
+        std::cout << rank_algo_name(algos[a]) << "\t" << sum / n << "\t" << percentile(lat[a], 0.5) << "\t"
+                  << percentile(lat[a], 0.95) << "\t" << percentile(lat[a], 0.99) << "\t" << (double)scored[a] / n << "\t"
+                  << (postings ? 100.0 * (double)scored[a] / (double)postings : 0.0) << "\t"
+                  << (sum > 0 ? base / sum : 0.0) << "x\n";
+    }
+    if (mismatches) std::cerr << "Mismatching queries: " << mismatches << "\n";
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+#include "index_format.hpp"
+#include "query_engine.hpp"
+
+// Query replay benchmark: loads an index once, replays a query log through the
+// same code path as boolean_search (answer_index, reply formatted into a buffer)
+// and reports throughput and latency percentiles, overall and by query shape.
+//
+// Query log: one query per line, or JSONL with the query in a "query" (or "q")
+// string field. Without a log, --generate N synthesizes queries from dict.tsv:
+// every term is drawn from a df band (1-9, 10-99, 100-999, ...) picked uniformly,
+// so rare and frequent terms are equally represented, and the shape (term, AND,
+// OR, NOT, nested) is picked uniformly as well. The same --seed gives the same queries.
+//
+// --threads T runs a closed loop: T workers, each sending its next query as soon
+// as the previous one is answered, until every query was replayed --rounds times.
+// --shards N splits heavy boolean queries into doc ranges as boolean_search does,
+// so single-query latency of sharding can be compared with T workers' throughput.
+
+enum class Shape { Term, And, Or, Not, Phrase, Nested, Error };
+static constexpr int NSHAPES = 7;
+
+static const char* shape_name(Shape s) {
+    switch (s) {
+        case Shape::Term: return "term";
+        case Shape::And: return "and";
+        case Shape::Or: return "or";
+        case Shape::Not: return "not";
+        case Shape::Phrase: return "phrase";
+        case Shape::Nested: return "nested";
+        case Shape::Error: return "error";
+    }
+    return "?";
+}
+
+// Shape of a planned tree (AND/OR already flattened).
+static Shape shape_of(const Node& n) {
+    auto term = [](const Node& k) { return k.kind == Node::Kind::Term; };
+    auto neg_term = [&](const Node& k) { return k.kind == Node::Kind::Not && term(k.kids[0]); };
+    switch (n.kind) {
+        case Node::Kind::Term: return Shape::Term;
+        case Node::Kind::Pattern:
+        case Node::Kind::Fuzzy: return Shape::Or; // a union of the matching terms
+        case Node::Kind::Phrase:
+        case Node::Kind::Near: return Shape::Phrase;
+        case Node::Kind::Not: return term(n.kids[0]) ? Shape::Not : Shape::Nested;
+        case Node::Kind::Or: return std::all_of(n.kids.begin(), n.kids.end(), term) ? Shape::Or : Shape::Nested;
+        case Node::Kind::And: {
+            bool neg = false;
+            for (const auto& k : n.kids) {
+                if (neg_term(k)) neg = true;
+                else if (!term(k)) return Shape::Nested;
+            }
+            return neg ? Shape::Not : Shape::And;
+        }
+    }
+    return Shape::Nested;
+}
+
+// Value of the string field `key` of a JSON object line; false when absent.
+static bool json_string_field(const std::string& line, const std::string& key, std::string& out) {
+    std::string pat = "\"" + key + "\"";
+    size_t p = line.find(pat);
+    while (p != std::string::npos) {
+        size_t i = p + pat.size();
+        while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) i++;
+        if (i < line.size() && line[i] == ':') {
+            i++;
+            while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) i++;
+            if (i >= line.size() || line[i] != '"') return false;
+            out.clear();
+            for (i++; i < line.size() && line[i] != '"'; i++) {
+                char c = line[i];
+                if (c != '\\' || i + 1 >= line.size()) {
+                    out.push_back(c);
+                    continue;
+                }
+                c = line[++i];
+                if (c == 'n' || c == 't' || c == 'r') out.push_back(' ');
+                else if (c == 'u' && i + 4 < line.size()) {
+                    unsigned cp = (unsigned)std::stoul(line.substr(i + 1, 4), nullptr, 16);
+                    i += 4;
+                    // UTF-8 of a BMP code point; surrogate pairs are not expected in queries
+                    if (cp < 0x80) out.push_back((char)cp);
+                    else if (cp < 0x800) {
+                        out.push_back((char)(0xC0 | (cp >> 6)));
+                        out.push_back((char)(0x80 | (cp & 0x3F)));
+                    } else {
+                        out.push_back((char)(0xE0 | (cp >> 12)));
+                        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                        out.push_back((char)(0x80 | (cp & 0x3F)));
+                    }
+                } else out.push_back(c); // \" \\ \/
+            }
+            return true;
+        }
+        p = line.find(pat, p + 1);
+    }
+    return false;
+}
+
+static std::vector<std::string> load_queries(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open queries: " + path);
+    std::vector<std::string> qs;
+    std::string line, q;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos) continue;
+        if (line[first] == '{') {
+            if (json_string_field(line, "query", q) || json_string_field(line, "q", q)) {
+                if (!q.empty()) qs.push_back(q);
+            }
+        } else {
+            qs.push_back(line);
+        }
+    }
+    return qs;
+}
+
+// Terms of dict.tsv grouped by df decade.
+static std::vector<std::vector<std::string>> df_bands(const std::string& dict_path) {
+    std::ifstream in(dict_path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open dict: " + dict_path);
+    std::vector<std::vector<std::string>> bands;
+    std::string line;
+    std::getline(in, line); // header
+    while (std::getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0) continue;
+        uint64_t df = std::stoull(line.substr(tab + 1));
+        if (df == 0) continue;
+        size_t band = 0;
+        for (uint64_t x = df; x >= 10; x /= 10) band++;
+        if (bands.size() <= band) bands.resize(band + 1);
+        bands[band].push_back(line.substr(0, tab));
+    }
+    bands.erase(std::remove_if(bands.begin(), bands.end(), [](const std::vector<std::string>& b) { return b.empty(); }),
+                bands.end());
+    if (bands.empty()) throw std::runtime_error("No terms in " + dict_path);
+    return bands;
+}
+
+static std::vector<std::string> generate_queries(const std::vector<std::vector<std::string>>& bands, size_t n,
+                                                 uint32_t seed) {
+    std::mt19937 rng(seed);
+    auto pick = [&](size_t m) { return (size_t)(rng() % m); };
+    auto term = [&] {
+        const auto& b = bands[pick(bands.size())];
+        return b[pick(b.size())];
+    };
+    auto chain = [&](size_t k, const char* op) {
+        std::string q = term();
+        for (size_t i = 1; i < k; i++) q += std::string(" ") + op + " " + term();
+        return q;
+    };
+    std::vector<std::string> qs;
+    for (size_t i = 0; i < n; i++) {
+        switch (pick(5)) {
+            case 0: qs.push_back(term()); break;
+            case 1: qs.push_back(chain(2 + pick(3), "AND")); break;
+            case 2: qs.push_back(chain(2 + pick(3), "OR")); break;
+            case 3: qs.push_back(term() + " AND NOT " + term()); break;
+            default: qs.push_back("(" + chain(2, "OR") + ") AND " + term() + " AND NOT (" + chain(2, "OR") + ")"); break;
+        }
+    }
+    return qs;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = (size_t)std::ceil(p * (double)sorted.size());
+    return sorted[std::min(sorted.size() - 1, i == 0 ? 0 : i - 1)];
+}
+
+static void usage() {
+    std::cerr << "Usage: bench_search --index index/index.bin (--queries log | --generate N [--dict dict.tsv])\n"
+              << "                    [--threads T] [--rounds R] [--no-warmup] [--seed S] [--save file]\n"
+              << "                    [--top K] [--rank bmw|wand|exhaustive] [--postings-cache MB] [--result-cache MB]\n"
+              << "                    [--shards N] [--shard-min-work N] [--max-results N] [--show ids|titles|snippets]\n"
+              << "The log is one query per line or JSONL with a \"query\" field. Caches are off by default.\n";
+}
+
+int main(int argc, char** argv) {
+    std::string index_path = "index/index.bin", queries_path, dict_path, save_path;
+    size_t ngenerate = 0;
+    unsigned threads = 1;
+    int rounds = 1;
+    bool warmup = true;
+    uint32_t seed = 42;
+    uint64_t postings_cache_mb = 0, result_cache_mb = 0;
+    RankOptions ro;
+    ShardOptions shard;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--index" && i + 1 < argc) index_path = argv[++i];
+        else if (a == "--queries" && i + 1 < argc) queries_path = argv[++i];
+        else if (a == "--generate" && i + 1 < argc) ngenerate = (size_t)std::stoul(argv[++i]);
+        else if (a == "--dict" && i + 1 < argc) dict_path = argv[++i];
+        else if (a == "--save" && i + 1 < argc) save_path = argv[++i];
+        else if (a == "--seed" && i + 1 < argc) seed = (uint32_t)std::stoul(argv[++i]);
+        else if (a == "--threads" && i + 1 < argc) threads = std::max(1u, (unsigned)std::stoul(argv[++i]));
+        else if (a == "--rounds" && i + 1 < argc) rounds = std::max(1, std::stoi(argv[++i]));
+        else if (a == "--no-warmup") warmup = false;
+        else if (a == "--top" && i + 1 < argc) ro.k = (size_t)std::stoul(argv[++i]);
+        else if (a == "--rank" && i + 1 < argc) {
+            if (!parse_rank_algo(argv[++i], ro.algo)) {
+                std::cerr << "Unknown rank algorithm: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--postings-cache" && i + 1 < argc) postings_cache_mb = std::stoull(argv[++i]);
+        else if (a == "--result-cache" && i + 1 < argc) result_cache_mb = std::stoull(argv[++i]);
+        else if (a == "--max-results" && i + 1 < argc) ro.max_results = std::stoull(argv[++i]);
+        else if (a == "--show" && i + 1 < argc) {
+            if (!parse_show(argv[++i], ro.show)) {
+                std::cerr << "Unknown --show: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--shards" && i + 1 < argc) shard.shards = (unsigned)std::stoul(argv[++i]);
+        else if (a == "--shard-min-work" && i + 1 < argc) shard.min_work = std::stoull(argv[++i]);
+        else if (a == "--help" || a == "-h") { usage(); return 0; }
+        else { std::cerr << "Unknown arg: " << a << "\n"; usage(); return 2; }
+    }
+    if (queries_path.empty() == (ngenerate == 0)) {
+        usage();
+        return 2;
+    }
+
+    Index index;
+    Positions positions;
+    TfIndex tf;
+    DocStore store;
+    std::vector<std::string> qs;
+    try {
+        index.open_bin(index_path);
+        std::string path = sibling_file(index_path, "positions.bin");
+        if (!path.empty()) positions.open(path);
+        path = sibling_file(index_path, "tf.bin");
+        if (!path.empty()) tf.open(path);
+        path = sibling_file(index_path, "docmap.bin");
+        if (!path.empty()) index.open_docmap(path);
+        if (ro.show != Show::Ids) {
+            path = sibling_file(index_path, "store.bin");
+            if (path.empty()) throw std::runtime_error("--show needs store.bin next to the index (build_index --store)");
+            store.open(path);
+            ro.store = &store;
+        }
+        if (!queries_path.empty()) {
+            qs = load_queries(queries_path);
+        } else {
+            if (dict_path.empty()) dict_path = sibling_file(index_path, "dict.tsv");
+            if (dict_path.empty()) throw std::runtime_error("--generate needs dict.tsv (next to the index or --dict)");
+            qs = generate_queries(df_bands(dict_path), ngenerate, seed);
+        }
+        if (!save_path.empty()) {
+            std::ofstream out(save_path, std::ios::binary);
+            for (const auto& q : qs) out << q << "\n";
+            if (!out) throw std::runtime_error("Cannot write: " + save_path);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    if (qs.empty()) {
+        std::cerr << "No queries\n";
+        return 1;
+    }
+
+    std::vector<Shape> shapes(qs.size());
+    for (size_t i = 0; i < qs.size(); i++) {
+        try {
+            auto toks = tokenize_query(qs[i]);
+            Parser p(toks);
+            Node tree = p.parse();
+            plan(tree, index);
+            shapes[i] = shape_of(tree);
+        } catch (const std::exception&) {
+            shapes[i] = Shape::Error;
+        }
+    }
+
+    QueryCaches caches(postings_cache_mb, result_cache_mb);
+    if (shard.shards == 0) shard.shards = std::max(1u, std::thread::hardware_concurrency());
+    std::unique_ptr<TaskPool> shard_pool;
+    if (shard.shards > 1) {
+        shard_pool = std::make_unique<TaskPool>(shard.shards - 1);
+        shard.pool = shard_pool.get();
+    }
+    auto run = [&](size_t i) {
+        std::ostringstream out;
+        answer_index(qs[i], index, positions, tf, ro, caches, nullptr, out, shard);
+        return out.str().size();
+    };
+    if (warmup) {
+        for (size_t i = 0; i < qs.size(); i++) run(i); // page in the mapped lists
+    }
+
+    // closed loop: every worker takes the next query slot as soon as it is done
+    size_t total = qs.size() * (size_t)rounds;
+    std::atomic<size_t> next{0};
+    std::vector<std::vector<std::pair<uint8_t, double>>> lat(threads);
+    std::vector<uint64_t> bytes(threads, 0);
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] {
+            lat[t].reserve(total / threads + 1);
+            for (size_t s; (s = next.fetch_add(1)) < total;) {
+                size_t i = s % qs.size();
+                auto a = std::chrono::steady_clock::now();
+                bytes[t] += run(i);
+                double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - a).count();
+                lat[t].emplace_back((uint8_t)shapes[i], us);
+            }
+        });
+    }
+    for (auto& th : pool) th.join();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    std::vector<std::vector<double>> by_shape(NSHAPES);
+    std::vector<double> all;
+    uint64_t reply_bytes = 0;
+    for (unsigned t = 0; t < threads; t++) {
+        reply_bytes += bytes[t];
+        for (const auto& [s, us] : lat[t]) {
+            by_shape[s].push_back(us);
+            all.push_back(us);
+        }
+    }
+
+    std::cout << "Queries: " << qs.size() << " x " << rounds << " rounds, threads " << threads << ", shards "
+              << shard.shards << ", mode "
+              << (ro.k ? "top " + std::to_string(ro.k) + " " + rank_algo_name(ro.algo) : std::string("boolean")) << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Wall: " << wall << " s, throughput " << (double)total / wall << " q/s, replies "
+              << reply_bytes / total << " bytes avg\n\n";
+
+    std::cout << "shape\tcount\tmean_us\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\n";
+    auto row = [&](const char* name, std::vector<double>& v) {
+        if (v.empty()) return;
+        std::sort(v.begin(), v.end());
+        double sum = 0;
+        for (double x : v) sum += x;
+        std::cout << name << "\t" << v.size() << "\t" << sum / (double)v.size() << "\t" << percentile(v, 0.5) << "\t"
+                  << percentile(v, 0.9) << "\t" << percentile(v, 0.99) << "\t" << percentile(v, 0.999) << "\t"
+                  << v.back() << "\n";
+    };
+    for (int s = 0; s < NSHAPES; s++) row(shape_name((Shape)s), by_shape[s]);
+    row("all", all);
+
+    // log2 latency histogram of all queries
+    std::cout << "\nlatency_us\tcount\tshare\n";
+    std::vector<size_t> hist;
+    for (double us : all) {
+        size_t b = 0;
+        while ((double)(1ull << b) < us) b++;
+        if (hist.size() <= b) hist.resize(b + 1, 0);
+        hist[b]++;
+    }
+    for (size_t b = 0; b < hist.size(); b++) {
+        if (!hist[b]) continue;
+        double share = 100.0 * (double)hist[b] / (double)all.size();
+        std::cout << "<=" << (1ull << b) << "\t" << hist[b] << "\t" << share << "%\t"
+                  << std::string((size_t)std::lround(share / 2), '#') << "\n";
+    }
+    caches.report(std::cerr);
+    return 0;
+}
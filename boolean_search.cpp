@@ -1,102 +1,34 @@
 #include <algorithm>
-#include <cctype>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
-struct DictEntry {
-    uint32_t df = 0;
-    uint64_t offset = 0;
-    uint64_t len = 0;
-};
+#include <pthread.h>
 
-static std::string to_upper_ascii(std::string s) {
-    for (char& c : s) if (c >= 'a' && c <= 'z') c = char(c - 'a' + 'A');
-    return s;
-}
-
-static std::string to_lower_ascii(std::string s) {
-    for (char& c : s) if (c >= 'A' && c <= 'Z') c = char(c - 'A' + 'a');
-    return s;
-}
-
-static std::vector<std::string> tokenize_query(const std::string& q) {
-    std::vector<std::string> out;
-    std::string cur;
-    for (char c : q) {
-        if (std::isspace((unsigned char)c)) {
-            if (!cur.empty()) { out.push_back(cur); cur.clear(); }
-        } else if (c == '(' || c == ')') {
-            if (!cur.empty()) { out.push_back(cur); cur.clear(); }
-            out.push_back(std::string(1, c));
-        } else {
-            cur.push_back(c);
-        }
-    }
-    if (!cur.empty()) out.push_back(cur);
-    return out;
-}
-
-static std::vector<uint32_t> op_and(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
-    std::vector<uint32_t> r;
-    r.reserve(std::min(a.size(), b.size()));
-    size_t i = 0, j = 0;
-    while (i < a.size() && j < b.size()) {
-        if (a[i] == b[j]) { r.push_back(a[i]); i++; j++; }
-        else if (a[i] < b[j]) i++;
-        else j++;
-    }
-    return r;
-}
-
-static std::vector<uint32_t> op_or(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
-    std::vector<uint32_t> r;
-    r.reserve(a.size() + b.size());
-    size_t i = 0, j = 0;
-    while (i < a.size() && j < b.size()) {
-        if (a[i] == b[j]) { r.push_back(a[i]); i++; j++; }
-        else if (a[i] < b[j]) { r.push_back(a[i]); i++; }
-        else { r.push_back(b[j]); j++; }
-    }
-    while (i < a.size()) r.push_back(a[i++]);
-    while (j < b.size()) r.push_back(b[j++]);
-    r.erase(std::unique(r.begin(), r.end()), r.end());
-    return r;
-}
+#include "cache.hpp"
+#include "index_format.hpp"
+#include "query_engine.hpp"
+#include "server.hpp"
 
-static std::vector<uint32_t> op_not(const std::vector<uint32_t>& a, const std::vector<uint32_t>& universe) {
-    std::vector<uint32_t> r;
-    r.reserve(universe.size());
-    size_t i = 0, j = 0;
-    while (i < universe.size() && j < a.size()) {
-        if (universe[i] == a[j]) { i++; j++; }
-        else if (universe[i] < a[j]) { r.push_back(universe[i]); i++; }
-        else { j++; }
-    }
-    while (i < universe.size()) r.push_back(universe[i++]);
-    return r;
-}
-
-static std::vector<uint32_t> read_postings(std::ifstream& bin, const DictEntry& e) {
-    std::vector<uint32_t> docs;
-    if (e.len == 0) return docs;
-    docs.resize(e.len / sizeof(uint32_t));
-    bin.seekg((std::streamoff)e.offset, std::ios::beg);
-    bin.read(reinterpret_cast<char*>(docs.data()), (std::streamsize)e.len);
-    return docs;
-}
-
-static void load_dict(const std::string& dict_path, std::unordered_map<std::string, DictEntry>& dict) {
+static void load_dict(const std::string& dict_path, Index& index) {
     std::ifstream in(dict_path, std::ios::binary);
     if (!in) throw std::runtime_error("Cannot open dict: " + dict_path);
 
+    std::vector<std::string> terms;
+    std::vector<DictEntry> entries;
+
     std::string line;
     std::getline(in, line); // header
 
+    std::string prev;
     while (std::getline(in, line)) {
         if (line.empty()) continue;
         std::istringstream ss(line);
@@ -110,8 +42,21 @@ static void load_dict(const std::string& dict_path, std::unordered_map<std::stri
         e.df = (uint32_t)std::stoul(df_s);
         e.offset = (uint64_t)std::stoull(off_s);
         e.len = (uint64_t)std::stoull(len_s);
-        dict.emplace(term, e);
+
+        // indexes built before the codec column existed are raw
+        std::string codec_s;
+        if (std::getline(ss, codec_s, '\t') && !parse_codec(codec_s, e.codec)) {
+            throw std::runtime_error("Unknown codec '" + codec_s + "' for term: " + term);
+        }
+
+        // lookups are a binary search, so the file must keep build_index order
+        if (!entries.empty() && !(prev < term)) throw std::runtime_error("dict is not sorted at term: " + term);
+        prev = term;
+
+        terms.push_back(term);
+        entries.push_back(e);
     }
+    index.set_dict(terms, std::move(entries));
 }
 
 static uint32_t load_maxdoc(const std::string& maxdoc_path) {
@@ -123,154 +68,214 @@ static uint32_t load_maxdoc(const std::string& maxdoc_path) {
     return x;
 }
 
-class Parser {
-public:
-    Parser(const std::vector<std::string>& toks,
-           const std::unordered_map<std::string, DictEntry>& dict,
-           std::ifstream& postings,
-           const std::vector<uint32_t>& universe)
-        : t(toks), dict(dict), postings(postings), universe(universe) {}
-
-    std::vector<uint32_t> parse() {
-        pos = 0;
-        auto r = parse_or();
-        if (pos != t.size()) throw std::runtime_error("Unexpected token at end: " + t[pos]);
-        return r;
-    }
-
-private:
-    const std::vector<std::string>& t;
-    const std::unordered_map<std::string, DictEntry>& dict;
-    std::ifstream& postings;
-    const std::vector<uint32_t>& universe;
-    size_t pos = 0;
-
-    bool match_op(const std::string& op) {
-        if (pos >= t.size()) return false;
-        if (to_upper_ascii(t[pos]) == op) { pos++; return true; }
-        return false;
-    }
-
-    bool match(const std::string& s) {
-        if (pos >= t.size()) return false;
-        if (t[pos] == s) { pos++; return true; }
-        return false;
-    }
-
-    std::vector<uint32_t> postings_for_term(const std::string& raw) {
-        std::string term = to_lower_ascii(raw);
-        auto it = dict.find(term);
-        if (it == dict.end()) return {};
-        return read_postings(postings, it->second);
-    }
-
-    std::vector<uint32_t> parse_primary() {
-        if (match("(")) {
-            auto r = parse_or();
-            if (!match(")")) throw std::runtime_error("Expected ')'");
-            return r;
+// SIGUSR1 prints the cumulative counters to stderr. The signal is blocked in
+// every thread (before any is started) and taken by one thread in sigwait, so
+// the dump does not run inside a signal handler.
+static void dump_counters_on_signal(const QueryCounters& counters) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    std::thread([set, &counters] {
+        for (;;) {
+            int sig;
+            if (sigwait(&set, &sig) == 0) counters.print(std::cerr);
         }
-        if (pos >= t.size()) throw std::runtime_error("Unexpected end");
-
-        std::string u = to_upper_ascii(t[pos]);
-        if (u == "AND" || u == "OR" || u == "NOT") {
-            throw std::runtime_error("Expected term, got operator: " + t[pos]);
-        }
-        return postings_for_term(t[pos++]);
-    }
+    }).detach();
+}
 
-    std::vector<uint32_t> parse_not() {
-        if (match_op("NOT")) {
-            auto r = parse_not();
-            return op_not(r, universe);
+// One query line through the engine; the stats argument is null without --stats.
+using Answer = std::function<bool(const std::string& query, QueryStats* stats, std::ostream& out)>;
+
+// Stdin REPL, or the query server with --listen. Cache counters go to stderr on
+// exit, and with --stats the cumulative query counters as well.
+static int serve_queries(const ServerOptions& so, bool profile, const QueryCaches& caches, const Answer& answer) {
+    static QueryCounters counters; // read by the signal thread until exit
+    dump_counters_on_signal(counters);
+    auto handle = [&](const std::string& query, std::ostream& out) {
+        if (profile) {
+            QueryStats st;
+            bool ok = answer(query, &st, out);
+            counters.add(st.total_us, ok, &st);
+            return;
         }
-        return parse_primary();
-    }
-
-    std::vector<uint32_t> parse_and() {
-        auto left = parse_not();
-        while (match_op("AND")) {
-            auto right = parse_not();
-            left = op_and(left, right);
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = answer(query, nullptr, out);
+        counters.add(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count(), ok, nullptr);
+    };
+
+    int rc = 0;
+    if (!so.listen.empty()) {
+        rc = QueryServer(so, handle).run();
+    } else {
+        std::cerr << "Enter queries. Ctrl+D to exit.\n";
+        std::string query;
+        while (std::getline(std::cin, query)) {
+            if (query.empty()) continue;
+            handle(query, std::cout);
         }
-        return left;
     }
+    std::cout.flush();
+    caches.report(std::cerr);
+    if (profile) counters.print(std::cerr);
+    return rc;
+}
 
-    std::vector<uint32_t> parse_or() {
-        auto left = parse_and();
-        while (match_op("OR")) {
-            auto right = parse_and();
-            left = op_or(left, right);
-        }
-        return left;
+static int search_segments(const std::string& dir, const RankOptions& ro, const ServerOptions& so, bool profile,
+                           QueryCaches& caches) {
+    SegmentSet set(dir);
+    try {
+        set.refresh();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
     }
-};
+    auto snap = set.snapshot();
+    std::cerr << "Loaded segments: " << snap->segments.size() << " (generation " << snap->generation
+              << "), terms: " << snap->terms << "\n";
+    std::cerr << "Live docs: " << snap->live_docs << "\n";
+    return serve_queries(so, profile, caches, [&](const std::string& q, QueryStats* st, std::ostream& out) {
+        return answer_segments(q, set, ro, caches, st, out);
+    });
+}
 
 static void usage() {
     std::cerr
         << "Usage: boolean_search --dict index/dict.tsv --postings index/postings.bin --maxdoc index/maxdoc.txt\n"
-        << "Then type queries (AND/OR/NOT, parentheses) line by line.\n";
+        << "       boolean_search --index index/index.bin\n"
+        << "       boolean_search --segments index_dir   (segmented index of build_index --segments)\n"
+        << "Then type queries (AND/OR/NOT, parentheses) line by line.\n"
+        << "\"super mario\" (phrase) and nintendo NEAR/5 switch need an index built with --positions.\n"
+        << "mario*, *craft and mar*io match all dictionary terms of that form (up to 4096).\n"
+        << "zelad~1 and zelad~2 match the terms within 1 or 2 edits (the closest 64).\n"
+        << "Prefix a query with EXPLAIN to print its plan instead of the results.\n"
+        << "End a query with LIMIT n and/or OFFSET m to get one page of its results (\"RESULTS n MORE\" when\n"
+        << "the page is not the last); --max-results N caps every reply the same way.\n"
+        << "--top K ranks by BM25 and prints the K best docs with scores (needs tf.bin);\n"
+        << "--rank bmw|wand|exhaustive picks the top-k algorithm for OR queries (default bmw).\n"
+        << "--listen unix:/path | [host:]port serves the same line protocol over a socket instead of stdin;\n"
+        << "--workers N queries evaluated at once (default: all cores), --queue N queries waiting for a\n"
+        << "worker (default 64) before new ones are answered \"ERROR server busy\"; --max-connections N open\n"
+        << "clients (default 256), further ones get the same reply and are closed.\n"
+        << "--postings-cache MB decoded lists of hot terms (default 64), --result-cache MB replies of\n"
+        << "repeated queries (default 16); 0 turns a cache off. Hits and misses are printed on exit.\n"
+        << "--stats adds a STATS line after every reply (phase times, postings bytes, operator input sizes,\n"
+        << "result size per query node). kill -USR1 prints the cumulative counters to stderr at any time.\n"
+        << "--shards N splits each heavy boolean query into N doc-id ranges evaluated on N cores and joined\n"
+        << "(default 1, 0 = all cores); --shard-min-work N postings a query must touch to be split (default 65536).\n"
+        << "--show titles prints id<TAB>title<TAB>url per result, --show snippets adds a snippet with the query\n"
+        << "terms in <b>..</b>; both read store.bin (build_index --store) next to the index or --store <path>.\n";
 }
 
 int main(int argc, char** argv) {
-    std::string dict_path, postings_path, maxdoc_path;
+    std::string dict_path, postings_path, maxdoc_path, index_path, segments_dir, store_path;
+    RankOptions ro;
+    ServerOptions so;
+    uint64_t postings_cache_mb = 64, result_cache_mb = 16;
+    bool profile = false;
+    ShardOptions shard;
 
     for (int i = 1; i < argc; i++) {
         std::string a = argv[i];
         if (a == "--dict" && i + 1 < argc) dict_path = argv[++i];
         else if (a == "--postings" && i + 1 < argc) postings_path = argv[++i];
         else if (a == "--maxdoc" && i + 1 < argc) maxdoc_path = argv[++i];
+        else if (a == "--index" && i + 1 < argc) index_path = argv[++i];
+        else if (a == "--segments" && i + 1 < argc) segments_dir = argv[++i];
+        else if (a == "--top" && i + 1 < argc) ro.k = (size_t)std::stoul(argv[++i]);
+        else if (a == "--rank" && i + 1 < argc) {
+            if (!parse_rank_algo(argv[++i], ro.algo)) {
+                std::cerr << "Unknown rank algorithm: " << argv[i] << " (expected bmw, wand or exhaustive)\n";
+                return 2;
+            }
+        }
+        else if (a == "--listen" && i + 1 < argc) so.listen = argv[++i];
+        else if (a == "--workers" && i + 1 < argc) so.workers = (unsigned)std::stoul(argv[++i]);
+        else if (a == "--queue" && i + 1 < argc) so.queue_depth = (size_t)std::stoul(argv[++i]);
+        else if (a == "--max-connections" && i + 1 < argc) so.max_connections = (size_t)std::stoul(argv[++i]);
+        else if (a == "--postings-cache" && i + 1 < argc) postings_cache_mb = std::stoull(argv[++i]);
+        else if (a == "--result-cache" && i + 1 < argc) result_cache_mb = std::stoull(argv[++i]);
+        else if (a == "--stats") profile = true;
+        else if (a == "--max-results" && i + 1 < argc) ro.max_results = std::stoull(argv[++i]);
+        else if (a == "--shards" && i + 1 < argc) shard.shards = (unsigned)std::stoul(argv[++i]);
+        else if (a == "--shard-min-work" && i + 1 < argc) shard.min_work = std::stoull(argv[++i]);
+        else if (a == "--show" && i + 1 < argc) {
+            if (!parse_show(argv[++i], ro.show)) {
+                std::cerr << "Unknown --show: " << argv[i] << " (expected ids, titles or snippets)\n";
+                return 2;
+            }
+        }
+        else if (a == "--store" && i + 1 < argc) store_path = argv[++i];
         else if (a == "--help" || a == "-h") { usage(); return 0; }
         else { std::cerr << "Unknown arg: " << a << "\n"; usage(); return 2; }
     }
 
-    if (dict_path.empty() || postings_path.empty() || maxdoc_path.empty()) {
+    if (index_path.empty() && segments_dir.empty() && (dict_path.empty() || postings_path.empty() || maxdoc_path.empty())) {
         usage();
         return 2;
     }
 
-    std::unordered_map<std::string, DictEntry> dict;
-    dict.reserve(200000);
+    // titles and snippets of results, looked up by original doc id
+    DocStore store;
+    if (ro.show != Show::Ids) {
+        if (store_path.empty() && segments_dir.empty()) {
+            store_path = sibling_file(index_path.empty() ? postings_path : index_path, "store.bin");
+        }
+        if (store_path.empty()) {
+            std::cerr << "--show needs store.bin (build_index --store) next to the index or --store <path>\n";
+            return 2;
+        }
+        try {
+            store.open(store_path);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        ro.store = &store;
+        std::cerr << "Doc store: " << store.docs() << " docs\n";
+    }
+
+    QueryCaches caches(postings_cache_mb, result_cache_mb);
+    if (!segments_dir.empty()) return search_segments(segments_dir, ro, so, profile, caches);
 
-    uint32_t maxDoc = 0;
+    Index index;
+    Positions positions;
+    TfIndex tf;
     try {
-        load_dict(dict_path, dict);
-        maxDoc = load_maxdoc(maxdoc_path);
+        if (!index_path.empty()) {
+            index.open_bin(index_path);
+        } else {
+            load_dict(dict_path, index);
+            index.maxdoc = load_maxdoc(maxdoc_path);
+            index.open_postings(postings_path);
+        }
+        const std::string& near = index_path.empty() ? postings_path : index_path;
+        std::string path = sibling_file(near, "positions.bin");
+        if (!path.empty()) positions.open(path);
+        path = sibling_file(near, "tf.bin");
+        if (!path.empty()) tf.open(path);
+        path = sibling_file(near, "docmap.bin");
+        if (!path.empty()) index.open_docmap(path);
     } catch (const std::exception& e) {
         std::cerr << e.what() << "\n";
         return 1;
     }
+    uint32_t maxDoc = index.maxdoc;
 
-    std::ifstream postings(postings_path, std::ios::binary);
-    if (!postings) {
-        std::cerr << "Cannot open postings: " << postings_path << "\n";
-        return 1;
-    }
-
-    std::vector<uint32_t> universe;
-    universe.reserve(maxDoc);
-    for (uint32_t d = 1; d <= maxDoc; d++) universe.push_back(d);
-
-    std::cerr << "Loaded terms: " << dict.size() << "\n";
+    std::cerr << "Loaded terms: " << index.size() << "\n";
     std::cerr << "Universe docs: 1.." << maxDoc << "\n";
-    std::cerr << "Enter queries. Ctrl+D to exit.\n";
-
-    std::string query;
-    while (std::getline(std::cin, query)) {
-        if (query.empty()) continue;
-
-        try {
-            auto toks = tokenize_query(query);
-            Parser p(toks, dict, postings, universe);
-            auto res = p.parse();
-
-            std::cout << "RESULTS " << res.size() << "\n";
-            for (uint32_t d : res) std::cout << d << "\n";
-            std::cout << "END\n";
-        } catch (const std::exception& e) {
-            std::cout << "ERROR " << e.what() << "\n";
-        }
+    if (positions.loaded()) std::cerr << "Positions: loaded\n";
+    if (index.docmap.loaded()) std::cerr << "Doc map: loaded (results use the original doc ids)\n";
+    if (ro.k) std::cerr << "Ranked: top " << ro.k << " by BM25 (" << rank_algo_name(ro.algo) << ")\n";
+
+    if (shard.shards == 0) shard.shards = std::max(1u, std::thread::hardware_concurrency());
+    std::unique_ptr<TaskPool> pool;
+    if (shard.shards > 1) {
+        pool = std::make_unique<TaskPool>(shard.shards - 1);
+        shard.pool = pool.get();
+        std::cerr << "Shards: " << shard.shards << " doc ranges per boolean query\n";
     }
-
-    return 0;
+    return serve_queries(so, profile, caches, [&](const std::string& q, QueryStats* st, std::ostream& out) {
+        return answer_index(q, index, positions, tf, ro, caches, st, out, shard);
+    });
 }
@@ -1,17 +1,36 @@
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
 
-namespace fs = std::filesystem;
+#include <sys/resource.h>
 
-struct Pair {
-    std::string term;
-    uint32_t doc;
-};
+#include "doc_store.hpp"
+#include "index_format.hpp"
+#include "parallel.hpp"
+#include "positions.hpp"
+#include "ranking.hpp"
+#include "reorder.hpp"
+#include "segments.hpp"
+#include "stemmer.hpp"
+#include "tokenizer.hpp"
+#include "vocabulary.hpp"
+
+namespace fs = std::filesystem;
 
 static uint32_t parse_doc_id_from_filename(const fs::path& p) {
     std::string stem = p.stem().string();
@@ -26,135 +45,1201 @@ static void ensure_dir(const fs::path& p) {
     fs::create_directories(p, ec);
 }
 
-static bool read_line(std::ifstream& in, std::string& s) {
-    return static_cast<bool>(std::getline(in, s));
+static bool read_file(std::ifstream& in, std::string& buf) {
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    if (size < 0) return false;
+    in.seekg(0, std::ios::beg);
+    buf.resize((size_t)size);
+    return static_cast<bool>(in.read(&buf[0], size));
 }
 
-int main(int argc, char** argv) {
-    std::string stems_dir;
-    std::string out_dir = "index";
+static void write_lines(const fs::path& path, const std::vector<std::string>& lines) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::cerr << "Skip (cannot write): " << path.string() << "\n";
+        return;
+    }
+    for (const auto& l : lines) out << l << "\n";
+}
 
-    for (int i = 1; i < argc; i++) {
-        std::string a = argv[i];
-        if (a == "--stems" && i + 1 < argc) stems_dir = argv[++i];
-        else if (a == "--out" && i + 1 < argc) out_dir = argv[++i];
-        else if (a == "--help" || a == "-h") {
-            std::cerr << "Usage: build_index --stems <stems_dir> --out <index_dir>\n";
-            return 0;
-        } else {
-            std::cerr << "Unknown arg: " << a << "\n";
-            return 2;
+// Corpus mode: tokenize and stem one document in memory; the intermediate
+// token/stem lists are written only when a debug dump directory is given.
+static void terms_from_text(std::ifstream& in, const fs::path& p, std::size_t min_len, bool keep_hyphen,
+                            const std::string& dump_tokens, const std::string& dump_stems,
+                            std::vector<std::string>& terms) {
+    terms.clear();
+    tokenize_blocks(in, min_len, keep_hyphen, [&](std::string_view t) { terms.emplace_back(t); });
+    if (!dump_tokens.empty()) write_lines(fs::path(dump_tokens) / (p.stem().string() + ".tok"), terms);
+    static thread_local StemCache memo; // per indexing thread
+    for (auto& t : terms) t = memo.stem(t);
+    if (!dump_stems.empty()) write_lines(fs::path(dump_stems) / (p.stem().string() + ".stm"), terms);
+    // empty stems (e.g. of "ness") stay: they are not terms, but they keep their position
+}
+
+// Docs of one term with their tf and, with --positions, their positions stream (positions.hpp).
+struct TermPostings {
+    std::vector<uint32_t> docs;
+    std::vector<uint32_t> tf;
+    std::vector<uint8_t> pos;
+};
+
+// Postings and dict rows of consecutive terms, with offsets relative to `postings`.
+struct EncodedTerms {
+    std::vector<uint8_t> postings;
+    std::vector<std::string> terms;
+    std::vector<DictEntry> entries;
+    std::vector<uint8_t> positions; // positions.bin records, one per term when enabled
+    std::vector<uint64_t> pos_lens;
+    std::vector<uint8_t> tf;        // tf.bin records, one per term when enabled
+    std::vector<uint64_t> tf_lens;
+    uint64_t raw_bytes = 0;
+    size_t dense_terms = 0;
+
+    void clear() {
+        postings.clear();
+        terms.clear();
+        entries.clear();
+        positions.clear();
+        pos_lens.clear();
+        tf.clear();
+        tf_lens.clear();
+        raw_bytes = 0;
+        dense_terms = 0;
+    }
+};
+
+// Appends docs of the next doc range to a term's list. A doc id shared by two
+// files can end one range and start the next; its positions from the first file are kept.
+static void append_postings(TermPostings& acc, const TermPostings& more) {
+    size_t from = !acc.docs.empty() && !more.docs.empty() && more.docs.front() == acc.docs.back() ? 1 : 0;
+    acc.docs.insert(acc.docs.end(), more.docs.begin() + (std::ptrdiff_t)from, more.docs.end());
+    acc.tf.insert(acc.tf.end(), more.tf.begin() + (std::ptrdiff_t)from, more.tf.end());
+    if (more.pos.empty()) return;
+    const uint8_t* p = from ? skip_positions(more.pos.data()) : more.pos.data();
+    acc.pos.insert(acc.pos.end(), p, more.pos.data() + more.pos.size());
+}
+
+// Encodes postings term by term (terms must come in sorted order) into
+// postings.bin + dict.tsv (+ tf.bin, positions.bin) and finally index.bin. tf.bin
+// needs the doc lengths (set_doc_lengths) before the first term. encode() only reads the writer
+// settings, so chunks of terms can be encoded on several threads and then
+// appended in term order.
+class IndexWriter {
+public:
+    IndexWriter(const fs::path& out_dir, Codec codec, bool hybrid, bool positions, bool tf)
+        : out_dir_(out_dir), codec_(codec), hybrid_(hybrid), with_positions_(positions), with_tf_(tf),
+          postings_(out_dir / "postings.bin", std::ios::binary),
+          dict_(out_dir / "dict.tsv", std::ios::binary) {
+        if (!postings_ || !dict_) throw std::runtime_error("Cannot open output files in: " + out_dir.string());
+        dict_ << "term\tdf\toffset\tlen\tcodec\n";
+        if (with_positions_) positions_.open((out_dir / "positions.bin").string());
+        if (with_tf_) tf_.open((out_dir / "tf.bin").string());
+    }
+
+    // Tokens per doc, indexed by doc id.
+    void set_doc_lengths(std::vector<uint32_t> lens) { doclen_ = std::move(lens); }
+
+    void encode(std::string_view term, const TermPostings& list, EncodedTerms& out) const {
+        const std::vector<uint32_t>& docs = list.docs;
+        Codec term_codec = codec_;
+        if (hybrid_ && has_dense_chunk(docs)) {
+            term_codec = Codec::Roaring;
+            out.dense_terms++;
+        }
+
+        DictEntry e;
+        e.df = (uint32_t)docs.size();
+        e.codec = term_codec;
+        e.offset = out.postings.size();
+        encode_postings(term_codec, docs, out.postings);
+        e.len = out.postings.size() - e.offset;
+        out.terms.emplace_back(term);
+        out.entries.push_back(e);
+        out.raw_bytes += (uint64_t)docs.size() * sizeof(uint32_t);
+        if (with_positions_) {
+            size_t at = out.positions.size();
+            encode_positions_record(list.pos, e.df, out.positions);
+            out.pos_lens.push_back(out.positions.size() - at);
+        }
+        if (with_tf_) {
+            size_t at = out.tf.size();
+            encode_tf_record(docs, list.tf, doclen_, out.tf);
+            out.tf_lens.push_back(out.tf.size() - at);
         }
     }
 
-    if (stems_dir.empty()) {
-        std::cerr << "--stems is required\n";
-        return 2;
+    void append(EncodedTerms& chunk) {
+        postings_.write(reinterpret_cast<const char*>(chunk.postings.data()), (std::streamsize)chunk.postings.size());
+        for (size_t i = 0; i < chunk.entries.size(); i++) {
+            DictEntry e = chunk.entries[i];
+            e.offset += offset;
+            dict_ << chunk.terms[i] << "\t" << e.df << "\t" << e.offset << "\t" << e.len << "\t" << codec_name(e.codec) << "\n";
+            terms_.push_back(std::move(chunk.terms[i]));
+            entries_.push_back(e);
+        }
+        const uint8_t* rec = chunk.positions.data();
+        for (uint64_t len : chunk.pos_lens) {
+            positions_.add(rec, len);
+            rec += len;
+        }
+        rec = chunk.tf.data();
+        for (uint64_t len : chunk.tf_lens) {
+            tf_.add(rec, len);
+            rec += len;
+        }
+        offset += chunk.postings.size();
+        raw_bytes += chunk.raw_bytes;
+        dense_terms += chunk.dense_terms;
+        chunk.clear();
     }
 
-    ensure_dir(out_dir);
+    void add(std::string_view term, const TermPostings& list) {
+        encode(term, list, scratch_);
+        append(scratch_);
+    }
 
-    std::vector<Pair> pairs;
-    pairs.reserve(2'000'000);
+    void finish(uint32_t maxdoc) {
+        std::ofstream out(out_dir_ / "maxdoc.txt", std::ios::binary);
+        out << maxdoc << "\n";
+        postings_.close();
+        dict_.close();
+        if (!out || !postings_ || !dict_) throw std::runtime_error("Failed writing index in: " + out_dir_.string());
+        if (with_positions_) positions_.finish();
+        if (with_tf_) tf_.finish(std::move(doclen_), maxdoc);
+        write_index_bin((out_dir_ / "index.bin").string(), terms_, entries_, maxdoc,
+                        (out_dir_ / "postings.bin").string());
+    }
 
-    size_t files = 0;
-    uint32_t maxDoc = 0;
+    size_t terms() const { return terms_.size(); }
 
-    for (const auto& entry : fs::directory_iterator(stems_dir)) {
-        if (!entry.is_regular_file()) continue;
-        const auto p = entry.path();
-        if (p.extension() != ".stm") continue;
+    uint64_t offset = 0;
+    uint64_t raw_bytes = 0;
+    size_t dense_terms = 0;
 
-        uint32_t docId = parse_doc_id_from_filename(p);
-        if (docId > maxDoc) maxDoc = docId;
+private:
+    fs::path out_dir_;
+    Codec codec_;
+    bool hybrid_;
+    bool with_positions_;
+    bool with_tf_;
+    std::ofstream postings_;
+    std::ofstream dict_;
+    PositionsWriter positions_;
+    TfWriter tf_;
+    std::vector<uint32_t> doclen_;
+    EncodedTerms scratch_;
+    std::vector<std::string> terms_;
+    std::vector<DictEntry> entries_;
+};
 
-        std::ifstream in(p, std::ios::binary);
-        if (!in) continue;
+// Single-pass in-memory inversion (SPIMI). Terms are interned into a Vocabulary and
+// postings are appended per term id; when the footprint of the block reaches the memory limit,
+// the block is sorted by term and spilled as a run file:
+//
+//   repeated: uint32_t term_len, char term[term_len], uint32_t df, uint32_t docs[df], uint32_t tf[df]
+//             with positions also: uint32_t pos_len, uint8_t positions[pos_len]
+//
+// Documents must be added in doc id order, each one closed by end_doc(). Run files
+// are named <prefix><k>.bin.
+class SpimiBuilder {
+public:
+    SpimiBuilder(uint64_t mem_limit, fs::path run_dir, std::string run_prefix, bool positions)
+        : mem_limit_(mem_limit), run_dir_(std::move(run_dir)), run_prefix_(std::move(run_prefix)),
+          positions_(positions) {}
 
-        std::vector<std::string> terms;
-        terms.reserve(2048);
+    // Without positions, a repeated term of one document only counts in the tf of
+    // the list tail. With positions, the hits of the document are collected and
+    // grouped by term in end_doc().
+    void add(std::string_view term, uint32_t doc, uint32_t pos) {
+        uint32_t id = vocab_.intern(term);
+        if (id == lists_.size()) lists_.emplace_back();
+        doc_len_++;
+        if (positions_) {
+            hits_.emplace_back(id, pos);
+            return;
+        }
+        add_doc(lists_[id], doc);
+    }
 
-        std::string w;
-        while (read_line(in, w)) {
-            if (!w.empty()) terms.push_back(w);
+    void end_doc(uint32_t doc) {
+        if (doc_len_) doc_lens_.emplace_back(doc, doc_len_);
+        doc_len_ = 0;
+        if (hits_.empty()) return;
+        std::sort(hits_.begin(), hits_.end());
+        for (size_t i = 0; i < hits_.size();) {
+            uint32_t id = hits_[i].first;
+            doc_pos_.clear();
+            for (; i < hits_.size() && hits_[i].first == id; i++) doc_pos_.push_back(hits_[i].second);
+            TermPostings& list = lists_[id];
+            if (!add_doc(list, doc)) continue;
+            list.tf.back() = (uint32_t)doc_pos_.size();
+            size_t cap = list.pos.capacity();
+            append_positions(list.pos, doc_pos_.data(), doc_pos_.size());
+            list_bytes_ += list.pos.capacity() - cap;
         }
-        if (terms.empty()) continue;
+        hits_.clear();
+    }
 
-        std::sort(terms.begin(), terms.end());
-        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    // Called between documents, so a document never straddles two runs.
+    void maybe_spill() {
+        if (mem_limit_ && used() >= mem_limit_) spill();
+    }
 
-        for (const auto& t : terms) {
-            pairs.push_back({t, docId});
+    // Once any partial has spilled, what is left of every block goes to a run as well.
+    void spill_rest() {
+        if (vocab_.size()) spill();
+    }
+
+    const std::vector<fs::path>& runs() const { return runs_; }
+    const Vocabulary& vocab() const { return vocab_; }
+    const TermPostings& list(uint32_t id) const { return lists_[id]; }
+    // (doc, tokens) of the documents added so far
+    const std::vector<std::pair<uint32_t, uint32_t>>& doc_lengths() const { return doc_lens_; }
+
+    uint64_t postings = 0;
+
+private:
+    bool add_doc(TermPostings& list, uint32_t doc) {
+        std::vector<uint32_t>& docs = list.docs;
+        if (!docs.empty() && docs.back() == doc) {
+            list.tf.back()++;
+            return false;
         }
+        size_t cap = docs.capacity();
+        docs.push_back(doc);
+        list.tf.push_back(1);
+        list_bytes_ += (docs.capacity() - cap) * sizeof(uint32_t) * 2;
+        postings++;
+        return true;
+    }
 
-        files++;
-        if (files % 500 == 0) {
-            std::cerr << "Processed docs: " << files << ", pairs: " << pairs.size() << "\n";
+    uint64_t used() const {
+        return vocab_.footprint() + lists_.capacity() * sizeof(TermPostings) + list_bytes_;
+    }
+
+    void spill() {
+        ensure_dir(run_dir_);
+        fs::path path = run_dir_ / (run_prefix_ + std::to_string(runs_.size()) + ".bin");
+        std::ofstream out(path, std::ios::binary);
+        if (!out) throw std::runtime_error("Cannot write run: " + path.string());
+        for (uint32_t id : vocab_.sorted_ids()) {
+            std::string_view term = vocab_.term(id);
+            const TermPostings& list = lists_[id];
+            uint32_t len = (uint32_t)term.size();
+            uint32_t df = (uint32_t)list.docs.size();
+            out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+            out.write(term.data(), len);
+            out.write(reinterpret_cast<const char*>(&df), sizeof(df));
+            out.write(reinterpret_cast<const char*>(list.docs.data()), (std::streamsize)df * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(list.tf.data()), (std::streamsize)df * sizeof(uint32_t));
+            if (positions_) {
+                uint32_t pos_len = (uint32_t)list.pos.size();
+                out.write(reinterpret_cast<const char*>(&pos_len), sizeof(pos_len));
+                out.write(reinterpret_cast<const char*>(list.pos.data()), pos_len);
+            }
         }
+        if (!out) throw std::runtime_error("Failed writing run: " + path.string());
+        // one write per line: workers spill concurrently
+        std::cerr << ("Spilled run " + path.filename().string() + ": " + std::to_string(vocab_.size()) +
+                      " terms, ~" + std::to_string(used() >> 20) + " MB\n");
+        runs_.push_back(path);
+        vocab_.clear();
+        std::vector<TermPostings>().swap(lists_);
+        list_bytes_ = 0;
     }
 
-    if (pairs.empty()) {
-        std::cerr << "No pairs collected. Check stems directory.\n";
-        return 1;
+    uint64_t mem_limit_;
+    fs::path run_dir_;
+    std::string run_prefix_;
+    bool positions_;
+    Vocabulary vocab_;
+    std::vector<TermPostings> lists_; // term id -> docs, ascending
+    uint64_t list_bytes_ = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> hits_; // (term id, position) of the open document
+    std::vector<uint32_t> doc_pos_;
+    uint32_t doc_len_ = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> doc_lens_;
+    std::vector<fs::path> runs_;
+};
+
+struct RunReader {
+    std::ifstream in;
+    bool positions = false;
+    std::string term;
+    TermPostings list;
+
+    bool next() {
+        uint32_t len = 0, df = 0;
+        if (!in.read(reinterpret_cast<char*>(&len), sizeof(len))) return false;
+        term.resize(len);
+        in.read(&term[0], len);
+        in.read(reinterpret_cast<char*>(&df), sizeof(df));
+        list.docs.resize(df);
+        in.read(reinterpret_cast<char*>(list.docs.data()), (std::streamsize)df * sizeof(uint32_t));
+        list.tf.resize(df);
+        in.read(reinterpret_cast<char*>(list.tf.data()), (std::streamsize)df * sizeof(uint32_t));
+        if (positions) {
+            uint32_t pos_len = 0;
+            in.read(reinterpret_cast<char*>(&pos_len), sizeof(pos_len));
+            list.pos.resize(pos_len);
+            in.read(reinterpret_cast<char*>(list.pos.data()), pos_len);
+        }
+        if (!in) throw std::runtime_error("Truncated run file");
+        return true;
+    }
+};
+
+// k-way merge of runs given in doc range order: a min-heap keyed by (current
+// term, run number), so equal terms pop in run order, i.e. in doc order.
+static void merge_runs(const std::vector<fs::path>& runs, bool positions, IndexWriter& writer) {
+    std::vector<RunReader> readers(runs.size());
+    auto greater = [&](size_t a, size_t b) {
+        if (readers[a].term != readers[b].term) return readers[a].term > readers[b].term;
+        return a > b;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    for (size_t k = 0; k < runs.size(); k++) {
+        readers[k].in.open(runs[k], std::ios::binary);
+        readers[k].positions = positions;
+        if (!readers[k].in) throw std::runtime_error("Cannot read run: " + runs[k].string());
+        if (readers[k].next()) heap.push(k);
     }
 
-    std::sort(pairs.begin(), pairs.end(), [](const Pair& a, const Pair& b) {
-        if (a.term != b.term) return a.term < b.term;
-        return a.doc < b.doc;
+    std::string term;
+    TermPostings list;
+    while (!heap.empty()) {
+        size_t k = heap.top();
+        heap.pop();
+        term = readers[k].term;
+        list = readers[k].list;
+        if (readers[k].next()) heap.push(k);
+        while (!heap.empty() && readers[heap.top()].term == term) {
+            size_t r = heap.top();
+            heap.pop();
+            append_postings(list, readers[r].list);
+            if (readers[r].next()) heap.push(r);
+        }
+        writer.add(term, list);
+    }
+}
+
+// Merges in-memory partial indexes of consecutive doc ranges. The term space is
+// cut into ranges at sampled terms; every range is merged and encoded on its own
+// worker, and the encoded chunks are appended in term order, so the output is
+// the same for any number of threads.
+static void merge_partials(const std::vector<SpimiBuilder>& parts, unsigned threads, IndexWriter& writer) {
+    std::vector<std::vector<uint32_t>> sorted(parts.size());
+    parallel_for_stealing(parts.size(), threads, [&](size_t p) { sorted[p] = parts[p].vocab().sorted_ids(); });
+
+    // every 64th term of every partial, sorted; cut points at even quantiles
+    std::vector<std::string_view> sample;
+    for (size_t p = 0; p < parts.size(); p++) {
+        for (size_t i = 0; i < sorted[p].size(); i += 64) sample.push_back(parts[p].vocab().term(sorted[p][i]));
+    }
+    std::sort(sample.begin(), sample.end());
+    size_t nranges = threads > 1 ? (size_t)threads * 8 : 1;
+    std::vector<std::string_view> cuts; // range r is [cuts[r-1], cuts[r])
+    for (size_t r = 1; r < nranges && !sample.empty(); r++) {
+        std::string_view c = sample[sample.size() * r / nranges];
+        if (cuts.empty() || cuts.back() < c) cuts.push_back(c);
+    }
+    nranges = cuts.size() + 1;
+
+    std::vector<EncodedTerms> chunks(nranges);
+    parallel_for_stealing(nranges, threads, [&](size_t r) {
+        // slice of every partial's sorted ids that falls into the range
+        std::vector<size_t> pos(parts.size()), end(parts.size());
+        for (size_t p = 0; p < parts.size(); p++) {
+            const Vocabulary& v = parts[p].vocab();
+            auto less = [&](uint32_t id, std::string_view t) { return v.term(id) < t; };
+            pos[p] = r == 0 ? 0 : std::lower_bound(sorted[p].begin(), sorted[p].end(), cuts[r - 1], less) - sorted[p].begin();
+            end[p] = r == cuts.size() ? sorted[p].size()
+                                      : std::lower_bound(sorted[p].begin(), sorted[p].end(), cuts[r], less) - sorted[p].begin();
+        }
+
+        TermPostings list;
+        for (;;) {
+            bool any = false;
+            std::string_view term;
+            for (size_t p = 0; p < parts.size(); p++) {
+                if (pos[p] == end[p]) continue;
+                std::string_view t = parts[p].vocab().term(sorted[p][pos[p]]);
+                if (!any || t < term) term = t;
+                any = true;
+            }
+            if (!any) break;
+            list.docs.clear();
+            list.tf.clear();
+            list.pos.clear();
+            for (size_t p = 0; p < parts.size(); p++) {
+                if (pos[p] == end[p] || parts[p].vocab().term(sorted[p][pos[p]]) != term) continue;
+                append_postings(list, parts[p].list(sorted[p][pos[p]]));
+                pos[p]++;
+            }
+            writer.encode(term, list, chunks[r]);
+            // a single range runs on this thread: stream it instead of buffering
+            if (nranges == 1) writer.append(chunks[r]);
+        }
     });
 
-    fs::path postings_path = fs::path(out_dir) / "postings.bin";
-    fs::path dict_path = fs::path(out_dir) / "dict.tsv";
-    fs::path maxdoc_path = fs::path(out_dir) / "maxdoc.txt";
+    for (auto& c : chunks) writer.append(c);
+}
+
+// Documents of one partial index: a contiguous slice of the doc id order.
+struct DocRange {
+    size_t begin = 0, end = 0;
+    size_t files = 0;
+    uint32_t max_doc = 0;
+    std::exception_ptr error;
+};
+
+// Doc id reassignment before indexing (reorder.hpp).
+enum class Reorder { None, Bp, MinHash };
 
-    std::ofstream postings(postings_path, std::ios::binary);
-    std::ofstream dict(dict_path, std::ios::binary);
-    std::ofstream maxdoc(maxdoc_path, std::ios::binary);
+struct BuildOptions {
+    bool from_corpus = false;
+    std::string dump_tokens, dump_stems;
+    std::size_t min_len = 2;
+    bool keep_hyphen = true;
+    Codec codec = Codec::StreamVByte;
+    bool hybrid = true; // svb, but Roaring containers for terms with a dense 64K chunk
+    uint64_t mem_limit_mb = 0; // 0: no limit, the whole index is inverted in memory
+    unsigned threads = 1;
+    bool positions = false; // also write positions.bin
+    Reorder reorder = Reorder::None;
+};
 
-    if (!postings || !dict || !maxdoc) {
-        std::cerr << "Cannot open output files in: " << out_dir << "\n";
-        return 1;
+// Calls fn(term, position) for every term of one document file, position being
+// the token number in the document (empty stems count). False when the file
+// cannot be read.
+template <class F>
+static bool for_each_term(const BuildOptions& opt, const fs::path& p, std::vector<std::string>& terms,
+                          std::string& text, F&& fn) {
+    std::ifstream in(p, std::ios::binary);
+    if (!in) return false;
+    uint32_t position = 0;
+    if (opt.from_corpus) {
+        terms_from_text(in, p, opt.min_len, opt.keep_hyphen, opt.dump_tokens, opt.dump_stems, terms);
+        for (const auto& t : terms) {
+            if (!t.empty()) fn(std::string_view(t), position);
+            position++;
+        }
+        return true;
     }
+    if (!read_file(in, text)) return false;
+    std::string_view rest(text);
+    for (; !rest.empty(); position++) {
+        size_t nl = rest.find('\n');
+        std::string_view w = rest.substr(0, nl);
+        rest.remove_prefix(nl == std::string_view::npos ? rest.size() : nl + 1);
+        if (!w.empty()) fn(w, position);
+    }
+    return true;
+}
 
-    maxdoc << maxDoc << "\n";
+// Source files with their doc ids, sorted by id.
+using DocFiles = std::vector<std::pair<uint32_t, fs::path>>;
 
-    dict << "term\tdf\toffset\tlen\n";
+static DocFiles list_docs(const std::string& src_dir, bool from_corpus) {
+    DocFiles docs;
+    for (const auto& entry : fs::directory_iterator(src_dir)) {
+        if (!entry.is_regular_file()) continue;
+        const auto p = entry.path();
+        if (p.extension() != (from_corpus ? ".txt" : ".stm")) continue;
+        docs.emplace_back(parse_doc_id_from_filename(p), p);
+    }
+    std::sort(docs.begin(), docs.end());
+    return docs;
+}
 
-    uint64_t offset = 0;
-    size_t i = 0;
+// --reorder: reads every document once for its set of terms, orders the docs
+// (reorder.hpp) and numbers them 1..n in that order; files sharing a doc id stay
+// one doc. Ids below the largest one that have no file get the numbers after
+// n, so the universe of NOT stays that of the source ids. Returns the files
+// under their new ids, sorted by them, and fills original[new id] for
+// docmap.bin.
+static DocFiles reorder_docs(const BuildOptions& opt, const DocFiles& docs, std::vector<uint32_t>& original) {
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<size_t> group; // docs[group[g] .. group[g + 1]) share one doc id
+    for (size_t i = 0; i < docs.size(); i++) {
+        if (i == 0 || docs[i].first != docs[i - 1].first) group.push_back(i);
+    }
+    const size_t ndocs = group.size();
+    group.push_back(docs.size());
 
-    while (i < pairs.size()) {
-        size_t j = i;
-        const std::string& term = pairs[i].term;
+    BuildOptions read = opt; // the dumps are written by the indexing pass
+    read.dump_tokens.clear();
+    read.dump_stems.clear();
+    std::vector<std::vector<uint64_t>> hashes(ndocs);
+    std::vector<std::exception_ptr> errors(ndocs);
+    parallel_for_stealing(ndocs, opt.threads, [&](size_t g) {
+        std::vector<std::string> terms;
+        std::string text;
+        std::vector<uint64_t>& h = hashes[g];
+        try {
+            for (size_t i = group[g]; i < group[g + 1]; i++) {
+                for_each_term(read, docs[i].second, terms, text,
+                              [&](std::string_view t, uint32_t) { h.push_back(Vocabulary::hash(t)); });
+            }
+        } catch (...) {
+            errors[g] = std::current_exception();
+        }
+        std::sort(h.begin(), h.end());
+        h.erase(std::unique(h.begin(), h.end()), h.end());
+    });
+    for (const auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+
+    ForwardIndex f = forward_index(hashes);
+    std::vector<uint32_t> order;
+    if (opt.reorder == Reorder::Bp) {
+        BpOptions bp;
+        bp.threads = opt.threads;
+        order = bp_order(f, bp);
+    } else {
+        order = minhash_order(f);
+    }
 
-        std::vector<uint32_t> docs;
-        docs.reserve(64);
+    original.assign(ndocs + 1, 0);
+    DocFiles out;
+    out.reserve(docs.size());
+    for (uint32_t k = 0; k < ndocs; k++) {
+        size_t g = order[k];
+        original[k + 1] = docs[group[g]].first;
+        for (size_t i = group[g]; i < group[g + 1]; i++) out.emplace_back(k + 1, docs[i].second);
+    }
+    std::vector<bool> has_file(ndocs ? (size_t)docs.back().first + 1 : 0, false);
+    for (const auto& d : docs) has_file[d.first] = true;
+    for (uint32_t id = 1; id < has_file.size(); id++) {
+        if (!has_file[id]) original.push_back(id);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "Reordered " << ndocs << " docs by " << (opt.reorder == Reorder::Bp ? "bp" : "minhash") << " ("
+              << f.nterms << " terms in two docs or more) in " << secs << " s\n";
+    return out;
+}
+
+// Inverts `docs` into out_dir and prints the summary. The index covers the
+// docs 1..max(largest doc id, min_maxdoc). Returns the number of (term, doc)
+// postings; nothing is written when there are none.
+static uint64_t build(const BuildOptions& opt, const DocFiles& docs, const std::string& out_dir,
+                      uint32_t min_maxdoc = 0) {
+    const unsigned threads = opt.threads;
+    ensure_dir(out_dir);
+
+    // Several contiguous doc ranges per thread, so that stealing evens out slow
+    // ranges; each range is inverted into its own partial index. With a memory
+    // limit, at most `threads` partials are in memory at once: each gets its
+    // share of the limit and a finished partial is spilled completely.
+    size_t nparts = std::min(docs.size(), threads > 1 ? (size_t)threads * 4 : (size_t)1);
+    if (nparts == 0) nparts = 1;
+    const bool spill_finished = opt.mem_limit_mb && nparts > 1;
+    const uint64_t part_limit = (opt.mem_limit_mb << 20) / std::min<size_t>(threads, nparts);
+    const fs::path run_dir = fs::path(out_dir) / "runs";
+    std::vector<SpimiBuilder> parts;
+    std::vector<DocRange> ranges(nparts);
+    parts.reserve(nparts);
+    for (size_t k = 0; k < nparts; k++) {
+        parts.emplace_back(part_limit, run_dir, nparts > 1 ? "run_" + std::to_string(k) + "_" : "run_", opt.positions);
+        ranges[k].begin = docs.size() * k / nparts;
+        ranges[k].end = docs.size() * (k + 1) / nparts;
+    }
 
-        uint32_t last = 0;
-        bool have_last = false;
+    std::atomic<size_t> done_files{0};
+    std::mutex progress_m;
 
-        while (j < pairs.size() && pairs[j].term == term) {
-            uint32_t d = pairs[j].doc;
-            if (!have_last || d != last) {
-                docs.push_back(d);
-                last = d;
-                have_last = true;
+    parallel_for_stealing(nparts, threads, [&](size_t k) {
+        SpimiBuilder& spimi = parts[k];
+        DocRange& range = ranges[k];
+        std::vector<std::string> terms; // corpus mode: stems of one document
+        terms.reserve(2048);
+        std::string text;               // stems mode: the whole .stm file
+        try {
+            for (size_t d = range.begin; d < range.end; d++) {
+                const auto& [docId, p] = docs[d];
+                if (docId > range.max_doc) range.max_doc = docId;
+
+                bool any = false;
+                bool read = for_each_term(opt, p, terms, text, [&](std::string_view t, uint32_t position) {
+                    spimi.add(t, docId, position);
+                    any = true;
+                });
+                if (!read) continue;
+                spimi.end_doc(docId);
+                if (!any) continue;
+                spimi.maybe_spill();
+
+                range.files++;
+                if (++done_files % 500 == 0) {
+                    std::lock_guard<std::mutex> lk(progress_m);
+                    std::cerr << "Processed docs: " << done_files.load() << "\n";
+                }
             }
-            j++;
+            if (spill_finished) spimi.spill_rest();
+        } catch (...) {
+            range.error = std::current_exception();
         }
+    });
 
-        uint64_t len_bytes = (uint64_t)docs.size() * sizeof(uint32_t);
-        postings.write(reinterpret_cast<const char*>(docs.data()), (std::streamsize)len_bytes);
+    size_t files = 0;
+    uint32_t maxDoc = min_maxdoc;
+    uint64_t pairs = 0;
+    for (size_t k = 0; k < nparts; k++) {
+        if (ranges[k].error) std::rethrow_exception(ranges[k].error);
+        files += ranges[k].files;
+        maxDoc = std::max(maxDoc, ranges[k].max_doc);
+        pairs += parts[k].postings;
+    }
+    if (pairs == 0) return 0;
 
-        dict << term << "\t" << docs.size() << "\t" << offset << "\t" << len_bytes << "\n";
+    std::vector<uint32_t> doclen((size_t)maxDoc + 1, 0);
+    for (const auto& s : parts) {
+        for (const auto& [doc, len] : s.doc_lengths()) doclen[doc] += len;
+    }
 
-        offset += len_bytes;
-        i = j;
+    size_t nruns = 0;
+    IndexWriter writer(out_dir, opt.codec, opt.hybrid, opt.positions, true);
+    writer.set_doc_lengths(std::move(doclen));
+    bool spilled = false;
+    for (const auto& s : parts) spilled = spilled || !s.runs().empty();
+    if (spilled) {
+        // runs of all partials, in doc range order
+        std::vector<fs::path> runs;
+        for (auto& s : parts) {
+            s.spill_rest();
+            runs.insert(runs.end(), s.runs().begin(), s.runs().end());
+        }
+        nruns = runs.size();
+        merge_runs(runs, opt.positions, writer);
+        std::error_code ec;
+        fs::remove_all(run_dir, ec);
+    } else {
+        merge_partials(parts, threads, writer);
     }
+    writer.finish(maxDoc);
 
+    uint64_t offset = writer.offset;
+    uint64_t raw_bytes = writer.raw_bytes;
     std::cerr << "Index built.\n";
     std::cerr << "Docs processed: " << files << "\n";
     std::cerr << "maxDoc: " << maxDoc << "\n";
-    std::cerr << "Output: " << out_dir << "/dict.tsv, postings.bin, maxdoc.txt\n";
+    std::cerr << "Postings: " << offset << " bytes (" << (opt.hybrid ? "hybrid" : codec_name(opt.codec))
+              << "), raw would be " << raw_bytes << " bytes, ratio "
+              << (offset ? (double)raw_bytes / (double)offset : 0.0) << "x\n";
+    std::cerr << "Bits per posting: " << (raw_bytes ? (double)offset * 32 / (double)raw_bytes : 0.0) << "\n";
+    if (opt.hybrid) std::cerr << "Terms stored as Roaring containers: " << writer.dense_terms << "\n";
+    if (nruns) std::cerr << "Merged runs: " << nruns << "\n";
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    std::cerr << "Peak RSS: " << (ru.ru_maxrss >> 10) << " MB\n";
+    std::cerr << "Output: " << out_dir << "/dict.tsv, postings.bin, maxdoc.txt, index.bin, tf.bin"
+              << (opt.positions ? ", positions.bin" : "") << (opt.reorder != Reorder::None ? ", docmap.bin\n" : "\n");
+    return pairs;
+}
+
+// ---- document store (doc_store.hpp) ----
+
+struct DocMeta {
+    std::string title, url;
+};
+
+// meta.tsv of download_wiki_corpus.py: a header row, then id, title, url, bytes.
+static std::unordered_map<uint32_t, DocMeta> read_meta(const fs::path& path) {
+    std::unordered_map<uint32_t, DocMeta> meta;
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Skip titles (cannot read " << path.string() << ")\n";
+        return meta;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t t1 = line.find('\t');
+        size_t t2 = t1 == std::string::npos ? t1 : line.find('\t', t1 + 1);
+        if (t2 == std::string::npos || t1 == 0 || line.find_first_not_of("0123456789") < t1) continue; // header, junk
+        size_t t3 = line.find('\t', t2 + 1);
+        DocMeta& m = meta[(uint32_t)std::stoul(line.substr(0, t1))];
+        m.title = line.substr(t1 + 1, t2 - t1 - 1);
+        m.url = line.substr(t2 + 1, t3 == std::string::npos ? std::string::npos : t3 - t2 - 1);
+    }
+    return meta;
+}
+
+// store.bin in out_dir: texts of corpus_dir/*.txt with the titles and urls of
+// meta.tsv, under the original doc ids; a doc in only one of them is stored
+// with the other part empty.
+static void build_store(const std::string& corpus_dir, const std::string& meta_path, const std::string& out_dir) {
+    auto t0 = std::chrono::steady_clock::now();
+    std::unordered_map<uint32_t, DocMeta> meta = read_meta(meta_path);
+    DocFiles files = list_docs(corpus_dir, true);
+    std::vector<uint32_t> ids;
+    for (const auto& f : files) ids.push_back(f.first);
+    for (const auto& m : meta) ids.push_back(m.first);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    DocStoreWriter w;
+    w.open((fs::path(out_dir) / "store.bin").string());
+    const DocMeta none;
+    std::string text;
+    size_t f = 0;
+    for (uint32_t id : ids) {
+        text.clear();
+        for (; f < files.size() && files[f].first <= id; f++) {
+            if (files[f].first < id || !text.empty()) continue; // first file of an id
+            std::ifstream in(files[f].second, std::ios::binary);
+            if (!in || !read_file(in, text)) text.clear();
+        }
+        auto it = meta.find(id);
+        const DocMeta& m = it == meta.end() ? none : it->second;
+        w.add(id, m.title, m.url, text);
+    }
+    w.finish();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "Doc store: " << w.docs() << " docs, " << w.raw_bytes << " bytes in " << w.stored_bytes
+              << " compressed (" << (w.stored_bytes ? (double)w.raw_bytes / (double)w.stored_bytes : 0.0) << "x), "
+              << secs << " s\n";
+    std::cerr << "Output: " << out_dir << "/store.bin\n";
+}
+
+// ---- segmented index (segments.hpp) ----
+
+static std::string segment_name(uint32_t id) {
+    std::string n = std::to_string(id);
+    return "seg_" + std::string(n.size() < 6 ? 6 - n.size() : 0, '0') + n;
+}
+
+// Takes the next segment number; the directory is then written without the lock.
+static uint32_t reserve_segment(const std::string& dir) {
+    WriteLock lock(dir);
+    Manifest m = Manifest::load(dir);
+    uint32_t id = m.next_id++;
+    m.save(dir);
+    return id;
+}
+
+static Roaring deleted_docs(const std::string& dir, const SegmentInfo& s) {
+    return s.del_file.empty() ? Roaring() : read_doc_set(dir + "/" + s.del_file);
+}
+
+static void write_deleted(const std::string& dir, const Manifest& m, SegmentInfo& s, const Roaring& del) {
+    std::vector<uint32_t> v;
+    del.to_sorted(v);
+    s.del_file = "del_" + s.name + "_" + std::to_string(m.generation + 1) + ".bin";
+    s.deleted = (uint32_t)v.size();
+    write_doc_set(dir + "/" + s.del_file, v);
+}
+
+// Marks `ids` deleted in every segment of `m` (under the write lock). Segments
+// left without live docs are dropped; replaced files are added to `obsolete`.
+static void apply_deletes(const std::string& dir, Manifest& m, const Roaring& ids, std::vector<std::string>& obsolete) {
+    std::vector<SegmentInfo> kept;
+    for (SegmentInfo s : m.segments) {
+        Roaring hit = Roaring::op_and(read_doc_set(dir + "/" + s.name + "/docs.bin"), ids);
+        Roaring del = deleted_docs(dir, s);
+        Roaring now = Roaring::op_or(del, hit);
+        if (now.cardinality() != del.cardinality()) {
+            if (!s.del_file.empty()) obsolete.push_back(s.del_file);
+            if (now.cardinality() >= s.docs) {
+                std::cerr << "Segment " << s.name << " has no live docs left, dropped\n";
+                obsolete.push_back(s.name);
+                continue;
+            }
+            write_deleted(dir, m, s, now);
+        }
+        kept.push_back(s);
+    }
+    m.segments = std::move(kept);
+}
+
+static void remove_obsolete(const std::string& dir, const std::vector<std::string>& obsolete) {
+    // readers that still use them keep their mappings; the next manifest no longer lists them
+    for (const auto& f : obsolete) {
+        std::error_code ec;
+        fs::remove_all(fs::path(dir) / f, ec);
+    }
+}
+
+// Indexes a batch as a new segment. Its doc ids replace the same ids in all
+// older segments: an article that changed is re-added, one that was removed is
+// deleted with --delete.
+static void add_segment(const std::string& dir, const BuildOptions& opt, const DocFiles& docs) {
+    if (docs.empty()) throw std::runtime_error("No documents in the batch");
+    std::string name = segment_name(reserve_segment(dir));
+    std::string out = dir + "/" + name;
+    if (build(opt, docs, out) == 0) {
+        // still a valid segment: its (empty) docs replace the old versions
+        IndexWriter writer(out, opt.codec, opt.hybrid, opt.positions, true);
+        writer.finish(docs.back().first);
+    }
+
+    std::vector<uint32_t> ids;
+    for (const auto& d : docs) ids.push_back(d.first);
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    write_doc_set(out + "/docs.bin", ids);
+
+    std::vector<std::string> obsolete;
+    {
+        WriteLock lock(dir);
+        Manifest m = Manifest::load(dir);
+        apply_deletes(dir, m, Roaring::from_sorted(ids.data(), ids.size()), obsolete);
+        SegmentInfo s;
+        s.name = name;
+        s.docs = (uint32_t)ids.size();
+        m.segments.push_back(s);
+        m.save(dir);
+        std::cerr << "Added " << name << ": " << ids.size() << " docs, generation " << m.generation << "\n";
+    }
+    remove_obsolete(dir, obsolete);
+}
+
+static void delete_docs(const std::string& dir, std::vector<uint32_t> ids) {
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    std::vector<std::string> obsolete;
+    {
+        WriteLock lock(dir);
+        Manifest m = Manifest::load(dir);
+        apply_deletes(dir, m, Roaring::from_sorted(ids.data(), ids.size()), obsolete);
+        m.save(dir);
+        std::cerr << "Deleted " << ids.size() << " doc ids, generation " << m.generation << "\n";
+    }
+    remove_obsolete(dir, obsolete);
+}
+
+// Tiered merge policy: segments are grouped by live docs into tiers
+// [factor^t, factor^(t+1)); once a tier holds `factor` segments they are merged
+// into one segment of a higher tier. A segment with more than half of its docs
+// deleted is rewritten on its own. Returns the picked segment positions.
+static std::vector<size_t> pick_merge(const Manifest& m, unsigned factor) {
+    std::map<unsigned, std::vector<size_t>> tiers;
+    for (size_t i = 0; i < m.segments.size(); i++) {
+        const SegmentInfo& s = m.segments[i];
+        if ((uint64_t)s.deleted * 2 > s.docs) return {i};
+        unsigned tier = 0;
+        for (uint64_t n = std::max<uint32_t>(s.live(), 1); n >= factor; n /= factor) tier++;
+        tiers[tier].push_back(i);
+    }
+    for (auto& [tier, segs] : tiers) {
+        if (segs.size() < factor) continue;
+        std::stable_sort(segs.begin(), segs.end(),
+                         [&](size_t a, size_t b) { return m.segments[a].live() < m.segments[b].live(); });
+        segs.resize(factor);
+        return segs;
+    }
+    return {};
+}
+
+// Writes the live docs of `inputs` as segment `name`. The doc sets of the
+// inputs are disjoint, so every term's lists are filtered by the live set of
+// their segment and merged. tf and positions are kept when every input has them.
+static uint32_t merge_segments(const std::string& dir, const std::vector<SegmentInfo>& inputs,
+                               const std::vector<Roaring>& deleted, const std::string& name, const BuildOptions& opt) {
+    const size_t n = inputs.size();
+    std::vector<std::unique_ptr<Index>> idx(n);
+    std::vector<std::unique_ptr<Positions>> positions(n);
+    std::vector<std::unique_ptr<TfIndex>> tfs(n);
+    std::vector<Roaring> live(n);
+    Roaring all;
+    bool with_positions = true, with_tf = true;
+    for (size_t k = 0; k < n; k++) {
+        std::string seg = dir + "/" + inputs[k].name;
+        idx[k] = std::make_unique<Index>();
+        idx[k]->open_bin(seg + "/index.bin");
+        positions[k] = std::make_unique<Positions>();
+        if (fs::exists(seg + "/positions.bin")) positions[k]->open(seg + "/positions.bin");
+        else with_positions = false;
+        tfs[k] = std::make_unique<TfIndex>();
+        if (fs::exists(seg + "/tf.bin")) tfs[k]->open(seg + "/tf.bin");
+        else with_tf = false;
+        live[k] = Roaring::op_andnot(read_doc_set(seg + "/docs.bin"), deleted[k]);
+        all = Roaring::op_or(all, live[k]);
+    }
+    std::vector<uint32_t> all_docs;
+    all.to_sorted(all_docs);
+
+    std::string out = dir + "/" + name;
+    ensure_dir(out);
+    IndexWriter writer(out, opt.codec, opt.hybrid, with_positions, with_tf);
+    if (with_tf) {
+        std::vector<uint32_t> doclen(all_docs.empty() ? 1 : (size_t)all_docs.back() + 1, 0);
+        for (size_t k = 0; k < n; k++) {
+            std::vector<uint32_t> docs;
+            live[k].to_sorted(docs);
+            for (uint32_t d : docs) doclen[d] = tfs[k]->doclen(d);
+        }
+        writer.set_doc_lengths(std::move(doclen));
+    }
+    std::vector<uint32_t> pos(n, 0);
+    std::vector<uint32_t> part, part_tf;
+    TermPostings list;
+    // live docs of a term with their tf and positions entries, from all inputs
+    struct Hit {
+        uint32_t doc, tf;
+        const uint8_t *pos_begin, *pos_end;
+        bool operator<(const Hit& o) const { return doc < o.doc; }
+    };
+    std::vector<Hit> hits;
+    std::vector<std::string> head(n); // current term of every input
+    for (size_t k = 0; k < n; k++) {
+        if (idx[k]->size()) idx[k]->term(0, head[k]);
+    }
+    for (;;) {
+        const std::string* term = nullptr;
+        for (size_t k = 0; k < n; k++) {
+            if (pos[k] == idx[k]->size()) continue;
+            if (!term || head[k] < *term) term = &head[k];
+        }
+        if (!term) break;
+        std::string current = *term;
+
+        list.docs.clear();
+        list.tf.clear();
+        list.pos.clear();
+        hits.clear();
+        for (size_t k = 0; k < n; k++) {
+            if (pos[k] == idx[k]->size() || head[k] != current) continue;
+            uint32_t ord = pos[k]++;
+            if (pos[k] < idx[k]->size()) idx[k]->term(pos[k], head[k]);
+            PostingsView v = idx[k]->postings(idx[k]->entry(ord));
+            decode_postings(v.codec, v.data, v.len, v.df, part);
+            if (with_tf) tfs[k]->list(ord).decode(v.df, part_tf);
+            const uint8_t* p = with_positions ? positions[k]->list(ord).stream() : nullptr;
+            for (size_t i = 0; i < part.size(); i++) {
+                const uint8_t* q = p ? skip_positions(p) : nullptr;
+                if (live[k].contains(part[i])) hits.push_back({part[i], with_tf ? part_tf[i] : 0, p, q});
+                p = q;
+            }
+        }
+        std::sort(hits.begin(), hits.end());
+        for (const Hit& h : hits) {
+            list.docs.push_back(h.doc);
+            list.tf.push_back(h.tf);
+            if (with_positions) list.pos.insert(list.pos.end(), h.pos_begin, h.pos_end);
+        }
+        if (!list.docs.empty()) writer.add(current, list);
+    }
+    writer.finish(all_docs.empty() ? 0 : all_docs.back());
+    write_doc_set(out + "/docs.bin", all_docs);
+    return (uint32_t)all_docs.size();
+}
+
+// Runs the merge policy until it picks nothing. The merge itself runs without
+// the write lock (searchers and other writers go on); only picking the inputs
+// and committing the result lock the manifest. Deletes that hit the inputs
+// while they were being merged are carried over to the new segment.
+static void compact(const std::string& dir, const BuildOptions& opt, unsigned factor) {
+    for (;;) {
+        std::vector<SegmentInfo> inputs;
+        std::vector<Roaring> deleted;
+        uint32_t id = 0;
+        {
+            WriteLock lock(dir);
+            Manifest m = Manifest::load(dir);
+            std::vector<size_t> pick = pick_merge(m, factor);
+            if (pick.empty()) return;
+            for (size_t i : pick) {
+                inputs.push_back(m.segments[i]);
+                deleted.push_back(deleted_docs(dir, m.segments[i]));
+            }
+            id = m.next_id++;
+            m.save(dir);
+        }
+
+        std::string name = segment_name(id);
+        uint32_t ndocs = merge_segments(dir, inputs, deleted, name, opt);
+
+        std::vector<std::string> obsolete;
+        {
+            WriteLock lock(dir);
+            Manifest m = Manifest::load(dir);
+            std::vector<SegmentInfo> kept;
+            Roaring late;
+            size_t found = 0;
+            for (const SegmentInfo& s : m.segments) {
+                auto in = std::find_if(inputs.begin(), inputs.end(), [&](const SegmentInfo& x) { return x.name == s.name; });
+                if (in == inputs.end()) {
+                    kept.push_back(s);
+                    continue;
+                }
+                found++;
+                late = Roaring::op_or(late, Roaring::op_andnot(deleted_docs(dir, s), deleted[in - inputs.begin()]));
+                obsolete.push_back(s.name);
+                if (!s.del_file.empty()) obsolete.push_back(s.del_file);
+            }
+            if (found != inputs.size()) {
+                // an input was dropped meanwhile (all its docs deleted): retry with a fresh pick
+                std::error_code ec;
+                fs::remove_all(fs::path(dir) / name, ec);
+                continue;
+            }
+            m.segments = std::move(kept);
+            if (ndocs > 0) {
+                SegmentInfo s;
+                s.name = name;
+                s.docs = ndocs;
+                if (late.cardinality()) write_deleted(dir, m, s, late);
+                m.segments.push_back(s);
+            } else {
+                obsolete.push_back(name);
+            }
+            m.save(dir);
+            std::cerr << "Merged";
+            for (const auto& s : inputs) std::cerr << " " << s.name;
+            std::cerr << " -> " << name << " (" << ndocs << " docs), generation " << m.generation << "\n";
+        }
+        remove_obsolete(dir, obsolete);
+    }
+}
+
+static std::vector<uint32_t> read_ids(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open: " + path);
+    std::vector<uint32_t> ids;
+    uint32_t id;
+    while (in >> id) ids.push_back(id);
+    return ids;
+}
+
+int main(int argc, char** argv) {
+    std::string stems_dir;
+    std::string corpus_dir;
+    std::string out_dir = "index";
+    std::string segments_dir, delete_file;
+    std::string store_dir, meta_path;
+    bool compact_only = false, no_merge = false;
+    unsigned merge_factor = 4;
+    BuildOptions opt;
+
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--stems" && i + 1 < argc) stems_dir = argv[++i];
+        else if (a == "--corpus" && i + 1 < argc) corpus_dir = argv[++i];
+        else if (a == "--dump-tokens" && i + 1 < argc) opt.dump_tokens = argv[++i];
+        else if (a == "--dump-stems" && i + 1 < argc) opt.dump_stems = argv[++i];
+        else if (a == "--min-len" && i + 1 < argc) opt.min_len = static_cast<std::size_t>(std::stoul(argv[++i]));
+        else if (a == "--no-hyphen") opt.keep_hyphen = false;
+        else if (a == "--out" && i + 1 < argc) out_dir = argv[++i];
+        else if (a == "--mem-limit" && i + 1 < argc) opt.mem_limit_mb = std::stoull(argv[++i]);
+        else if (a == "--threads" && i + 1 < argc) opt.threads = static_cast<unsigned>(std::stoul(argv[++i]));
+        else if (a == "--segments" && i + 1 < argc) segments_dir = argv[++i];
+        else if (a == "--delete" && i + 1 < argc) delete_file = argv[++i];
+        else if (a == "--compact") compact_only = true;
+        else if (a == "--no-merge") no_merge = true;
+        else if (a == "--positions") opt.positions = true;
+        else if (a == "--merge-factor" && i + 1 < argc) merge_factor = std::max(2u, (unsigned)std::stoul(argv[++i]));
+        else if (a == "--store" && i + 1 < argc) store_dir = argv[++i];
+        else if (a == "--meta" && i + 1 < argc) meta_path = argv[++i];
+        else if (a == "--reorder" && i + 1 < argc) {
+            std::string r = argv[++i];
+            if (r == "none") opt.reorder = Reorder::None;
+            else if (r == "bp") opt.reorder = Reorder::Bp;
+            else if (r == "minhash") opt.reorder = Reorder::MinHash;
+            else {
+                std::cerr << "Unknown reorder: " << r << " (expected none, bp or minhash)\n";
+                return 2;
+            }
+        }
+        else if (a == "--codec" && i + 1 < argc) {
+            std::string c = argv[++i];
+            opt.hybrid = c == "hybrid";
+            if (!opt.hybrid && !parse_codec(c, opt.codec)) {
+                std::cerr << "Unknown codec: " << c << " (expected hybrid, svb, roar or raw)\n";
+                return 2;
+            }
+        }
+        else if (a == "--help" || a == "-h") {
+            std::cerr
+                << "Usage:\n"
+                << "  build_index --stems <stems_dir> --out <index_dir> [--codec hybrid|svb|roar|raw] [--mem-limit MB]\n"
+                << "              [--threads N] [--positions] [--reorder none|bp|minhash] [--store <corpus_dir> [--meta meta.tsv]]\n"
+                << "  build_index --corpus <corpus_dir> --out <index_dir> [--codec ...] [--min-len N] [--no-hyphen]\n"
+                << "              [--dump-tokens <dir>] [--dump-stems <dir>] [--mem-limit MB] [--threads N] [--positions]\n"
+                << "  build_index --segments <index_dir> (--stems <batch_dir> | --corpus <batch_dir>) [options above]\n"
+                << "  build_index --segments <index_dir> --delete <ids_file>\n"
+                << "  build_index --segments <index_dir> --compact\n"
+                << "\n"
+                << "--corpus tokenizes and stems corpus/*.txt in this process, no intermediate files.\n"
+                << "--mem-limit bounds the in-memory postings: full blocks are spilled as sorted runs\n"
+                << "into <index_dir>/runs and merged at the end.\n"
+                << "--threads N indexes N doc ranges in parallel and merges them by term range (0 = all cores).\n"
+                << "--positions also writes positions.bin (token positions) for phrase and NEAR/k queries.\n"
+                << "--reorder renumbers the docs so that similar ones get close ids (smaller postings),\n"
+                << "by graph bisection (bp) or minhash order; docmap.bin maps them back for the searches.\n"
+                << "--store also writes store.bin: texts of <corpus_dir>/*.txt with titles and urls of meta.tsv\n"
+                << "(default: next to <corpus_dir>), block compressed, for boolean_search --show.\n"
+                << "--segments adds the batch as a new immutable segment (its doc ids replace older\n"
+                << "versions), or deletes doc ids; then runs the tiered merge policy unless --no-merge\n"
+                << "(--merge-factor F, default 4).\n";
+            return 0;
+        } else {
+            std::cerr << "Unknown arg: " << a << "\n";
+            return 2;
+        }
+    }
+
+    const bool batch = !stems_dir.empty() || !corpus_dir.empty();
+    if (!stems_dir.empty() && !corpus_dir.empty()) {
+        std::cerr << "Exactly one of --stems or --corpus is required\n";
+        return 2;
+    }
+    if (segments_dir.empty() ? !batch : (int)batch + (int)!delete_file.empty() + (int)compact_only != 1) {
+        std::cerr << (segments_dir.empty() ? "Exactly one of --stems or --corpus is required\n"
+                                           : "--segments needs exactly one of --stems/--corpus, --delete or --compact\n");
+        return 2;
+    }
+    if (!segments_dir.empty() && opt.reorder != Reorder::None) {
+        std::cerr << "--reorder cannot be used with --segments (segments keep the original doc ids)\n";
+        return 2;
+    }
+    if (!segments_dir.empty() && !store_dir.empty()) {
+        std::cerr << "--store cannot be used with --segments (build the store with a full index)\n";
+        return 2;
+    }
+    if (!store_dir.empty() && meta_path.empty()) {
+        fs::path d(store_dir);
+        if (!d.has_filename()) d = d.parent_path(); // corpus/
+        meta_path = (d.parent_path() / "meta.tsv").string();
+    }
+    opt.from_corpus = !corpus_dir.empty();
+    const std::string& src_dir = opt.from_corpus ? corpus_dir : stems_dir;
+    if (opt.threads == 0) opt.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (!opt.dump_tokens.empty()) ensure_dir(opt.dump_tokens);
+    if (!opt.dump_stems.empty()) ensure_dir(opt.dump_stems);
+
+    try {
+        if (!segments_dir.empty()) {
+            ensure_dir(segments_dir);
+            if (batch) add_segment(segments_dir, opt, list_docs(src_dir, opt.from_corpus));
+            else if (!delete_file.empty()) delete_docs(segments_dir, read_ids(delete_file));
+            if (!no_merge || compact_only) compact(segments_dir, opt, merge_factor);
+            Manifest m = Manifest::load(segments_dir);
+            uint64_t live = 0;
+            for (const auto& s : m.segments) live += s.live();
+            std::cerr << "Segments: " << m.segments.size() << ", live docs: " << live << ", generation " << m.generation << "\n";
+            return 0;
+        }
+
+        DocFiles docs = list_docs(src_dir, opt.from_corpus);
+        std::vector<uint32_t> original;
+        if (opt.reorder != Reorder::None) docs = reorder_docs(opt, docs, original);
+        const fs::path docmap = fs::path(out_dir) / "docmap.bin";
+        std::error_code ec;
+        fs::remove(docmap, ec); // of an earlier reordered build into the same directory
+
+        // visit documents in doc id order: postings are appended already sorted
+        if (build(opt, docs, out_dir, original.empty() ? 0 : (uint32_t)(original.size() - 1)) == 0) {
+            std::cerr << "No pairs collected. Check " << (opt.from_corpus ? "corpus" : "stems") << " directory.\n";
+            return 1;
+        }
+        if (!original.empty()) write_docmap(docmap.string(), original);
+        if (!store_dir.empty()) build_store(store_dir, meta_path, out_dir);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
     return 0;
 }
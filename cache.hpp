@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Query-time caches of boolean_search, shared by all server workers (one lock each).
+//
+// PostingsCache keeps decoded svb lists of hot terms, bounded in bytes. Raw
+// lists are used in place from the mapped index and Roaring lists are already
+// containers, so only svb decoding is worth caching. Admission is TinyLFU:
+// every lookup counts the term in a small count-min sketch, and once the cache
+// is full a new list gets in only if its term was looked up more often than the
+// LRU entries it would evict. One-off terms of a scan therefore never push out
+// the Zipf head. Lists that are not admitted stay packed, as without a cache.
+//
+// ResultCache maps a canonical query (see canonical() in query_engine.hpp) to its
+// complete reply, LRU, bounded in bytes.
+
+// Count-min sketch of recent lookups: 4 rows of 8-bit saturating counters; all
+// counters are halved every 10 * width increments so old popularity fades.
+class FrequencySketch {
+public:
+    explicit FrequencySketch(size_t width = 1 << 16) : mask_(width - 1), table_(width * ROWS, 0) {}
+
+    void add(uint64_t h) {
+        for (size_t r = 0; r < ROWS; r++) {
+            uint8_t& c = table_[r * (mask_ + 1) + slot(h, r)];
+            if (c < 255) c++;
+        }
+        if (++added_ >= (mask_ + 1) * 10) {
+            for (uint8_t& c : table_) c >>= 1;
+            added_ = 0;
+        }
+    }
+
+    uint32_t estimate(uint64_t h) const {
+        uint32_t m = 255;
+        for (size_t r = 0; r < ROWS; r++) m = std::min<uint32_t>(m, table_[r * (mask_ + 1) + slot(h, r)]);
+        return m;
+    }
+
+private:
+    static constexpr size_t ROWS = 4;
+
+    size_t slot(uint64_t h, size_t r) const {
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9ull + 2 * r;
+        return (size_t)(h >> 32) & mask_;
+    }
+
+    size_t mask_;
+    std::vector<uint8_t> table_;
+    size_t added_ = 0;
+};
+
+class PostingsCache {
+public:
+    using List = std::shared_ptr<const std::vector<uint32_t>>;
+
+    explicit PostingsCache(uint64_t capacity_bytes) : cap_(capacity_bytes) {}
+
+    bool enabled() const { return cap_ > 0; }
+
+    // The decoded list of `term` in the index identified by `scope` (a segment),
+    // or nullptr when the list is not admitted. `decode` fills the vector; it
+    // runs outside the lock.
+    template <class F>
+    List get(uint64_t scope, uint32_t term, uint32_t df, F&& decode) {
+        Key key{scope, term};
+        uint64_t h = key.hash();
+        uint64_t bytes = (uint64_t)df * sizeof(uint32_t) + ENTRY_OVERHEAD;
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            sketch_.add(h);
+            auto it = map_.find(key);
+            if (it != map_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                hits_++;
+                return it->second->list;
+            }
+            misses_++;
+            if (!admit(sketch_.estimate(h), bytes)) {
+                rejected_++;
+                return nullptr;
+            }
+        }
+
+        auto v = std::make_shared<std::vector<uint32_t>>();
+        decode(*v);
+
+        std::lock_guard<std::mutex> lk(m_);
+        auto it = map_.find(key); // another worker may have loaded it meanwhile
+        if (it != map_.end()) return it->second->list;
+        while (used_ + bytes > cap_ && !lru_.empty()) evict_last();
+        lru_.push_front(Entry{key, v, bytes});
+        map_[key] = lru_.begin();
+        used_ += bytes;
+        return v;
+    }
+
+    void report(std::ostream& out) const {
+        std::lock_guard<std::mutex> lk(m_);
+        out << "Postings cache: " << hits_ << " hits, " << misses_ << " misses (" << rejected_ << " not admitted), "
+            << map_.size() << " lists, " << used_ / (1024 * 1024) << " of " << cap_ / (1024 * 1024) << " MB, "
+            << evicted_ << " evicted\n";
+    }
+
+private:
+    static constexpr uint64_t ENTRY_OVERHEAD = 96; // list node, hash node, vector header
+
+    struct Key {
+        uint64_t scope;
+        uint32_t term;
+        bool operator==(const Key& o) const { return scope == o.scope && term == o.term; }
+        uint64_t hash() const { return (scope * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)term * 0xff51afd7ed558ccdull); }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const { return (size_t)k.hash(); }
+    };
+    struct Entry {
+        Key key;
+        List list;
+        uint64_t bytes;
+    };
+
+    // Room for `bytes` now, or only LRU victims looked up less often than the candidate.
+    bool admit(uint32_t freq, uint64_t bytes) const {
+        if (bytes > cap_) return false;
+        uint64_t room = cap_ - used_;
+        for (auto it = lru_.rbegin(); room < bytes && it != lru_.rend(); ++it) {
+            if (sketch_.estimate(it->key.hash()) >= freq) return false;
+            room += it->bytes;
+        }
+        return room >= bytes;
+    }
+
+    void evict_last() {
+        used_ -= lru_.back().bytes;
+        map_.erase(lru_.back().key);
+        lru_.pop_back();
+        evicted_++;
+    }
+
+    uint64_t cap_;
+    uint64_t used_ = 0;
+    mutable std::mutex m_;
+    FrequencySketch sketch_;
+    std::list<Entry> lru_; // most recent first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map_;
+    uint64_t hits_ = 0, misses_ = 0, rejected_ = 0, evicted_ = 0;
+};
+
+class ResultCache {
+public:
+    explicit ResultCache(uint64_t capacity_bytes) : cap_(capacity_bytes) {}
+
+    bool enabled() const { return cap_ > 0; }
+
+    bool get(const std::string& key, std::string& reply) {
+        std::lock_guard<std::mutex> lk(m_);
+        auto it = map_.find(key);
+        if (it == map_.end()) {
+            misses_++;
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        reply = it->second->second;
+        hits_++;
+        return true;
+    }
+
+    void put(const std::string& key, const std::string& reply) {
+        uint64_t bytes = key.size() * 2 + reply.size() + ENTRY_OVERHEAD; // the key is stored twice
+        if (bytes > cap_) return;
+        std::lock_guard<std::mutex> lk(m_);
+        if (map_.count(key)) return;
+        while (used_ + bytes > cap_ && !lru_.empty()) {
+            used_ -= lru_.back().first.size() * 2 + lru_.back().second.size() + ENTRY_OVERHEAD;
+            map_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        lru_.emplace_front(key, reply);
+        map_[key] = lru_.begin();
+        used_ += bytes;
+    }
+
+    void report(std::ostream& out) const {
+        std::lock_guard<std::mutex> lk(m_);
+        out << "Result cache: " << hits_ << " hits, " << misses_ << " misses, " << map_.size() << " queries, "
+            << used_ / 1024 << " KB\n";
+    }
+
+private:
+    static constexpr uint64_t ENTRY_OVERHEAD = 128;
+
+    uint64_t cap_;
+    uint64_t used_ = 0;
+    mutable std::mutex m_;
+    std::list<std::pair<std::string, std::string>> lru_; // most recent first
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> map_;
+    uint64_t hits_ = 0, misses_ = 0;
+};
+
+struct QueryCaches {
+    PostingsCache postings;
+    ResultCache results;
+
+    QueryCaches(uint64_t postings_mb, uint64_t results_mb)
+        : postings(postings_mb * 1024 * 1024), results(results_mb * 1024 * 1024) {}
+
+    void report(std::ostream& out) const {
+        if (postings.enabled()) postings.report(out);
+        if (results.enabled()) results.report(out);
+    }
+};
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "index_format.hpp"
+#include "positions.hpp"
+#include "postings_codec.hpp"
+#include "roaring.hpp"
+
+// Document-at-a-time boolean evaluation, for paged queries (LIMIT / OFFSET,
+// --max-results). A query tree becomes a tree of cursors; each one is
+// positioned on its current doc and moves forward only:
+//
+//   next()            the following doc
+//   advance(target)   the first doc >= target (no move if already there)
+//
+// doc() is END once the cursor is exhausted. Term cursors read the mapped
+// postings in place, a block (svb), a 64K container (roar) or nothing (raw) at
+// a time, so a page costs memory in the size of the query, not of its result,
+// and evaluation stops when the page is full. Unpaged queries keep the
+// list-at-a-time Evaluator: over whole lists its set operations are faster.
+
+class DocCursor {
+public:
+    static constexpr uint32_t END = UINT32_MAX;
+
+    virtual ~DocCursor() = default;
+
+    uint32_t doc() const { return doc_; }
+    virtual void next() = 0;
+    virtual void advance(uint32_t target) = 0;
+
+protected:
+    uint32_t doc_ = END;
+};
+
+// One term's postings; an empty view gives an empty cursor.
+class PostingsCursor : public DocCursor {
+public:
+    explicit PostingsCursor(const PostingsView& v) : v_(v) {
+        if (v_.df == 0) return;
+        if (v_.codec == Codec::Roaring) {
+            nchunks_ = load_u32(v_.data);
+            load_chunk(0, v_.data + 4 + (size_t)nchunks_ * 8, 0);
+            return;
+        }
+        nblocks_ = v_.codec == Codec::Raw ? 1 : svb_num_blocks(v_.df);
+        load_block(0);
+    }
+
+    void next() override {
+        if (doc_ == END) return;
+        if (v_.codec == Codec::Roaring) {
+            if (bits_) seek_bit(low_ + 1);
+            else if (++i_ < card_) doc_ = key_ << 16 | u16(i_);
+            else next_chunk();
+            return;
+        }
+        if (++i_ < n_) doc_ = docs_[i_];
+        else load_block(block_ + 1);
+    }
+
+    void advance(uint32_t target) override {
+        if (doc_ >= target) return;
+        if (v_.codec == Codec::Roaring) {
+            advance_chunks(target);
+            return;
+        }
+        if (target > docs_[n_ - 1]) {
+            uint32_t b = block_ + 1;
+            while (b < nblocks_ && load_u32(v_.data + (size_t)b * 4) < target) b++;
+            load_block(b);
+            if (doc_ >= target) return;
+        }
+        // the target is in this block
+        i_ = (uint32_t)(std::lower_bound(docs_ + i_ + 1, docs_ + n_, target) - docs_);
+        doc_ = docs_[i_];
+    }
+
+    uint32_t df() const { return v_.df; }
+
+    // Index of doc() in the whole list: the positions of the doc are found by it.
+    uint32_t rank() const {
+        if (v_.codec != Codec::Roaring) return block_ * POSTINGS_BLOCK + i_;
+        if (!bits_) return chunk_rank_ + i_;
+        uint32_t r = chunk_rank_;
+        uint32_t w = low_ >> 6;
+        for (uint32_t k = 0; k < w; k++) r += (uint32_t)__builtin_popcountll(word(k));
+        return r + (uint32_t)__builtin_popcountll(word(w) & ((uint64_t(1) << (low_ & 63)) - 1));
+    }
+
+private:
+    PostingsView v_;
+
+    // raw and svb: the current block of docs (a raw list is one block)
+    uint32_t nblocks_ = 0, block_ = 0, n_ = 0, i_ = 0;
+    const uint32_t* docs_ = nullptr;
+    uint32_t buf_[POSTINGS_BLOCK];
+
+    // roar: the current container, read in place
+    uint32_t nchunks_ = 0, chunk_ = 0, key_ = 0, card_ = 0, chunk_rank_ = 0, low_ = 0;
+    bool bits_ = false;
+    const uint8_t* payload_ = nullptr;
+
+    void load_block(uint32_t b) {
+        block_ = b;
+        i_ = 0;
+        if (b >= nblocks_) {
+            n_ = 0;
+            doc_ = END;
+            return;
+        }
+        if (v_.codec == Codec::Raw) {
+            docs_ = v_.raw_docs();
+            n_ = v_.df;
+        } else {
+            n_ = svb_decode_block(v_.data, v_.len, v_.df, b, buf_);
+            docs_ = buf_;
+        }
+        doc_ = docs_[0];
+    }
+
+    uint16_t u16(uint32_t i) const { return uint16_t(payload_[2 * i] | payload_[2 * i + 1] << 8); }
+
+    uint64_t word(uint32_t w) const {
+        uint64_t x;
+        std::memcpy(&x, payload_ + (size_t)w * 8, 8);
+        return x;
+    }
+
+    static size_t payload_size(bool bitmap, uint32_t card) {
+        return bitmap ? ROARING_WORDS * 8 : ((size_t)card * 2 + 3) / 4 * 4;
+    }
+
+    // Container c with its payload at p and `rank` docs before it, on its first member.
+    void load_chunk(uint32_t c, const uint8_t* p, uint32_t rank) {
+        if (!enter_chunk(c, p, rank)) return;
+        if (bits_) seek_bit(0);
+        else doc_ = key_ << 16 | u16(0);
+    }
+
+    // Reads only the header of container c; false (and END) past the last one.
+    bool enter_chunk(uint32_t c, const uint8_t* p, uint32_t rank) {
+        chunk_ = c;
+        if (c >= nchunks_) {
+            doc_ = END;
+            return false;
+        }
+        uint32_t kk = load_u32(v_.data + 4 + (size_t)c * 8);
+        key_ = kk & 0xFFFF;
+        bits_ = (kk >> 16) != 0;
+        card_ = load_u32(v_.data + 8 + (size_t)c * 8);
+        payload_ = p;
+        chunk_rank_ = rank;
+        i_ = 0;
+        return true;
+    }
+
+    const uint8_t* next_payload() const { return payload_ + payload_size(bits_, card_); }
+
+    void next_chunk() { load_chunk(chunk_ + 1, next_payload(), chunk_rank_ + card_); }
+
+    // First member >= low in the current bitmap, else the next container.
+    void seek_bit(uint32_t low) {
+        for (uint32_t w = low >> 6; low < 65536 && w < ROARING_WORDS; w++) {
+            uint64_t x = word(w);
+            if (w == low >> 6) x &= ~uint64_t(0) << (low & 63);
+            if (x) {
+                low_ = w * 64 + (uint32_t)__builtin_ctzll(x);
+                doc_ = key_ << 16 | low_;
+                return;
+            }
+        }
+        next_chunk();
+    }
+
+    // Containers before the target's are skipped by their headers.
+    void advance_chunks(uint32_t target) {
+        uint32_t key = target >> 16;
+        if (key_ < key) {
+            bool in = true;
+            while (in && key_ < key) in = enter_chunk(chunk_ + 1, next_payload(), chunk_rank_ + card_);
+            if (!in) return;
+            if (key_ > key) {
+                load_chunk(chunk_, payload_, chunk_rank_);
+                return;
+            }
+        }
+        uint32_t low = target & 0xFFFF;
+        if (bits_) {
+            seek_bit(low);
+            return;
+        }
+        uint32_t lo = i_, hi = card_;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (u16(mid) < low) lo = mid + 1;
+            else hi = mid;
+        }
+        i_ = lo;
+        if (i_ < card_) doc_ = key_ << 16 | u16(i_);
+        else next_chunk();
+    }
+};
+
+using CursorPtr = std::unique_ptr<DocCursor>;
+
+// Docs of every `kids` cursor and of none of the `excluded` ones. The first
+// kid leads (the planner puts the rarest first), the others are advanced to
+// its candidate; a miss moves the lead past it.
+class AndCursor : public DocCursor {
+public:
+    AndCursor(std::vector<CursorPtr> kids, std::vector<CursorPtr> excluded)
+        : kids_(std::move(kids)), excluded_(std::move(excluded)) {
+        settle();
+    }
+
+    void next() override {
+        kids_[0]->next();
+        settle();
+    }
+
+    void advance(uint32_t target) override {
+        if (doc_ >= target) return;
+        kids_[0]->advance(target);
+        settle();
+    }
+
+private:
+    std::vector<CursorPtr> kids_, excluded_;
+
+    void settle() {
+        uint32_t d = kids_[0]->doc();
+        while (d != END) {
+            uint32_t next = d;
+            for (size_t i = 1; i < kids_.size() && next == d; i++) {
+                kids_[i]->advance(d);
+                next = kids_[i]->doc();
+            }
+            if (next != d) {
+                kids_[0]->advance(next);
+                d = kids_[0]->doc();
+                continue;
+            }
+            bool out = false;
+            for (size_t i = 0; i < excluded_.size() && !out; i++) {
+                excluded_[i]->advance(d);
+                out = excluded_[i]->doc() == d;
+            }
+            if (!out) break;
+            kids_[0]->next();
+            d = kids_[0]->doc();
+        }
+        doc_ = d;
+    }
+};
+
+// Union: a binary heap of the kids by their current doc.
+class OrCursor : public DocCursor {
+public:
+    explicit OrCursor(std::vector<CursorPtr> kids) : kids_(std::move(kids)) {
+        for (size_t i = kids_.size() / 2; i-- > 0;) sift_down(i);
+        top();
+    }
+
+    void next() override {
+        if (doc_ == END) return;
+        uint32_t d = doc_;
+        while (kids_[0]->doc() == d) {
+            kids_[0]->next();
+            sift_down(0);
+        }
+        top();
+    }
+
+    void advance(uint32_t target) override {
+        while (doc_ < target) {
+            kids_[0]->advance(target);
+            sift_down(0);
+            top();
+        }
+    }
+
+private:
+    std::vector<CursorPtr> kids_;
+
+    void top() { doc_ = kids_.empty() ? END : kids_[0]->doc(); }
+
+    void sift_down(size_t i) {
+        size_t n = kids_.size();
+        for (;;) {
+            size_t m = i, l = 2 * i + 1, r = l + 1;
+            if (l < n && kids_[l]->doc() < kids_[m]->doc()) m = l;
+            if (r < n && kids_[r]->doc() < kids_[m]->doc()) m = r;
+            if (m == i) return;
+            std::swap(kids_[i], kids_[m]);
+            i = m;
+        }
+    }
+};
+
+// Docs lo..hi not in the kid.
+class NotCursor : public DocCursor {
+public:
+    NotCursor(CursorPtr kid, uint32_t lo, uint32_t hi) : kid_(std::move(kid)), hi_(hi) { settle(lo); }
+
+    void next() override {
+        if (doc_ != END) settle(doc_ + 1);
+    }
+
+    void advance(uint32_t target) override {
+        if (doc_ < target) settle(target);
+    }
+
+private:
+    CursorPtr kid_;
+    uint32_t hi_;
+
+    void settle(uint32_t d) {
+        for (; d <= hi_ && d != END; d++) {
+            kid_->advance(d);
+            if (kid_->doc() != d) break;
+        }
+        doc_ = d <= hi_ ? d : END;
+    }
+};
+
+// Docs of the kid that are in `set` (the live docs of a segment).
+class MemberCursor : public DocCursor {
+public:
+    MemberCursor(CursorPtr kid, const Roaring& set) : kid_(std::move(kid)), set_(set) { settle(); }
+
+    void next() override {
+        kid_->next();
+        settle();
+    }
+
+    void advance(uint32_t target) override {
+        kid_->advance(target);
+        settle();
+    }
+
+private:
+    CursorPtr kid_;
+    const Roaring& set_;
+
+    void settle() {
+        while (kid_->doc() != END && !set_.contains(kid_->doc())) kid_->next();
+        doc_ = kid_->doc();
+    }
+};
+
+// PHRASE / NEAR: the docs of all terms, each checked against the positions of
+// its terms (found by the rank of the doc in every term's list).
+class PositionalCursor : public DocCursor {
+public:
+    // `terms` in query order; for NEAR exactly two and `dist` > 0.
+    PositionalCursor(std::vector<std::unique_ptr<PostingsCursor>> terms, std::vector<PositionsList> pos, bool phrase,
+                     uint32_t dist)
+        : pos_(std::move(pos)), p_(terms.size()), phrase_(phrase), dist_(dist) {
+        size_t rarest = 0;
+        for (size_t i = 1; i < terms.size(); i++) {
+            if (terms[i]->df() < terms[rarest]->df()) rarest = i;
+        }
+        std::vector<CursorPtr> kids;
+        for (auto& t : terms) {
+            terms_.push_back(t.get());
+            kids.push_back(std::move(t));
+        }
+        std::swap(kids[0], kids[rarest]); // the rarest term leads
+        and_ = std::make_unique<AndCursor>(std::move(kids), std::vector<CursorPtr>());
+        settle();
+    }
+
+    void next() override {
+        and_->next();
+        settle();
+    }
+
+    void advance(uint32_t target) override {
+        if (doc_ >= target) return;
+        and_->advance(target);
+        settle();
+    }
+
+private:
+    std::unique_ptr<AndCursor> and_;
+    std::vector<PostingsCursor*> terms_;
+    std::vector<PositionsList> pos_;
+    std::vector<std::vector<uint32_t>> p_;
+    bool phrase_;
+    uint32_t dist_;
+
+    void settle() {
+        for (; and_->doc() != END; and_->next()) {
+            for (size_t i = 0; i < terms_.size(); i++) pos_[i].positions(terms_[i]->rank(), p_[i]);
+            if (phrase_ ? phrase_match(p_) : near_match(p_[0], p_[1], dist_)) break;
+        }
+        doc_ = and_->doc();
+    }
+};
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "index_format.hpp"
+#include "postings_codec.hpp"
+#include "stemmer.hpp"
+#include "tokenizer.hpp"
+
+// Document store (store.bin), written by build_index --store next to the index:
+// title, url and text of every document, so results can be shown without
+// meta.tsv and the corpus files.
+//
+// Records are packed into blocks of about STORE_META_BLOCK / STORE_TEXT_BLOCK
+// bytes (titles and urls apart from the texts, so a list of titles never
+// decodes a text), and every block is compressed on its own with the LZ codec
+// below. A fixed-width entry per doc id gives the block and the offset of its
+// records, so a lookup decodes exactly one block:
+//
+//   compressed blocks                 meta and text blocks in the order they filled up
+//   StoreBlock meta_blocks[n_meta]    offset, compressed and raw length (8-byte aligned)
+//   StoreBlock text_blocks[n_text]
+//   StoreEntry entries[max_id + 1]    indexed by the original doc id
+//   StoreFooter
+//
+//   meta record   varint len, title, varint len, url
+//   text record   varint len, text
+//
+// Doc ids are the ids of the source files (not the ones of a reordered index),
+// so the store is looked up after docmap.bin.
+
+static constexpr char STORE_MAGIC[4] = {'I', 'R', 'D', 'S'};
+static constexpr uint32_t STORE_VERSION = 1;
+static constexpr uint32_t STORE_META_BLOCK = 8 << 10;
+static constexpr uint32_t STORE_TEXT_BLOCK = 32 << 10;
+static constexpr uint32_t STORE_NONE = UINT32_MAX;
+
+struct StoreBlock {
+    uint64_t offset = 0;
+    uint32_t len = 0;     // compressed
+    uint32_t raw_len = 0;
+};
+static_assert(sizeof(StoreBlock) == 16, "StoreBlock is part of the on-disk format");
+
+struct StoreEntry {
+    uint32_t meta_block = STORE_NONE; // STORE_NONE: no such doc
+    uint32_t meta_pos = 0;
+    uint32_t text_block = STORE_NONE;
+    uint32_t text_pos = 0;
+};
+static_assert(sizeof(StoreEntry) == 16, "StoreEntry is part of the on-disk format");
+
+struct StoreFooter {
+    char magic[4];
+    uint32_t version;
+    uint32_t max_id;
+    uint32_t docs;
+    uint32_t meta_blocks;
+    uint32_t text_blocks;
+    uint64_t table_off; // meta_blocks, then text_blocks, then entries
+};
+static_assert(sizeof(StoreFooter) == 32, "StoreFooter is part of the on-disk format");
+
+// ---- LZ codec ----
+//
+// Byte-oriented LZ77 in the manner of LZ4: a sequence is a token byte (literal
+// count in the high nibble, match length - 4 in the low one; 15 continues in
+// 255-bytes), the literals, a little-endian uint16 match offset and the match
+// length continuation. The last sequence has literals only; the decoder stops
+// at the raw length stored in the block table. Matches are found with a hash of
+// the next 4 bytes, greedy, within a 64K window.
+
+inline void lz_put_len(std::vector<uint8_t>& out, size_t n) {
+    for (; n >= 255; n -= 255) out.push_back(255);
+    out.push_back((uint8_t)n);
+}
+
+inline void lz_compress(const uint8_t* src, size_t n, std::vector<uint8_t>& out) {
+    constexpr int HASH_BITS = 14;
+    std::vector<uint32_t> table((size_t)1 << HASH_BITS, UINT32_MAX);
+    auto hash4 = [&](size_t i) {
+        uint32_t v;
+        std::memcpy(&v, src + i, 4);
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    };
+    auto sequence = [&](size_t lit_from, size_t lit_len, size_t offset, size_t match) {
+        size_t m = match ? match - 4 : 0;
+        out.push_back((uint8_t)(std::min<size_t>(lit_len, 15) << 4 | std::min<size_t>(m, 15)));
+        if (lit_len >= 15) lz_put_len(out, lit_len - 15);
+        out.insert(out.end(), src + lit_from, src + lit_from + lit_len);
+        if (!match) return;
+        out.push_back((uint8_t)offset);
+        out.push_back((uint8_t)(offset >> 8));
+        if (m >= 15) lz_put_len(out, m - 15);
+    };
+
+    size_t anchor = 0, i = 0;
+    while (i + 4 <= n) {
+        uint32_t h = hash4(i);
+        size_t cand = table[h];
+        table[h] = (uint32_t)i;
+        if (cand == UINT32_MAX || i - cand > 0xFFFF || std::memcmp(src + cand, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t len = 4;
+        while (i + len < n && src[cand + len] == src[i + len]) len++;
+        sequence(anchor, i - anchor, i - cand, len);
+        i += len;
+        anchor = i;
+    }
+    sequence(anchor, n - anchor, 0, 0);
+}
+
+// Decodes a block of `raw_len` bytes into out.
+inline void lz_decompress(const uint8_t* p, size_t len, size_t raw_len, std::string& out) {
+    out.resize(raw_len);
+    char* dst = &out[0];
+    size_t o = 0;
+    const uint8_t* end = p + len;
+    auto get_len = [&](size_t n) {
+        if (n < 15) return n;
+        uint8_t b;
+        do {
+            if (p == end) throw std::runtime_error("Corrupt doc store block");
+            b = *p++;
+            n += b;
+        } while (b == 255);
+        return n;
+    };
+    while (o < raw_len) {
+        if (p == end) throw std::runtime_error("Corrupt doc store block");
+        uint8_t token = *p++;
+        size_t lit = get_len(token >> 4);
+        if (lit > (size_t)(end - p) || lit > raw_len - o) throw std::runtime_error("Corrupt doc store block");
+        std::memcpy(dst + o, p, lit);
+        p += lit;
+        o += lit;
+        if (o == raw_len) break;
+        if (end - p < 2) throw std::runtime_error("Corrupt doc store block");
+        size_t offset = (size_t)p[0] | (size_t)p[1] << 8;
+        p += 2;
+        size_t match = get_len(token & 15) + 4;
+        if (offset == 0 || offset > o || match > raw_len - o) throw std::runtime_error("Corrupt doc store block");
+        if (offset >= 8 && o + match + 8 <= raw_len) {
+            // 8 bytes at a time, each chunk already written; the overshoot is overwritten later
+            for (size_t k = 0; k < match; k += 8) std::memcpy(dst + o + k, dst + o + k - offset, 8);
+            o += match;
+        } else {
+            // byte by byte: the match overlaps what it copies
+            for (size_t k = 0; k < match; k++, o++) dst[o] = dst[o - offset];
+        }
+    }
+}
+
+// ---- writer ----
+
+// Sequential writer of store.bin; docs are added in ascending id order.
+class DocStoreWriter {
+public:
+    void open(const std::string& path) {
+        out_.open(path, std::ios::binary);
+        if (!out_) throw std::runtime_error("Cannot write doc store: " + path);
+    }
+
+    void add(uint32_t id, std::string_view title, std::string_view url, std::string_view text) {
+        if (!entries_.empty() && id < entries_.size()) throw std::runtime_error("Doc store ids must ascend");
+        entries_.resize((size_t)id + 1);
+        StoreEntry& e = entries_[id];
+        record_.clear();
+        append_string(record_, title);
+        append_string(record_, url);
+        place(meta_, STORE_META_BLOCK, e.meta_block, e.meta_pos);
+        record_.clear();
+        append_string(record_, text);
+        place(text_, STORE_TEXT_BLOCK, e.text_block, e.text_pos);
+        docs_++;
+    }
+
+    void finish() {
+        flush(meta_);
+        flush(text_);
+        pad_to(out_, pos_, 8);
+        StoreFooter f{};
+        std::memcpy(f.magic, STORE_MAGIC, 4);
+        f.version = STORE_VERSION;
+        f.max_id = entries_.empty() ? 0 : (uint32_t)(entries_.size() - 1);
+        f.docs = docs_;
+        f.meta_blocks = (uint32_t)meta_.blocks.size();
+        f.text_blocks = (uint32_t)text_.blocks.size();
+        f.table_off = pos_;
+        if (entries_.empty()) entries_.resize(1);
+        out_.write(reinterpret_cast<const char*>(meta_.blocks.data()), (std::streamsize)(meta_.blocks.size() * sizeof(StoreBlock)));
+        out_.write(reinterpret_cast<const char*>(text_.blocks.data()), (std::streamsize)(text_.blocks.size() * sizeof(StoreBlock)));
+        out_.write(reinterpret_cast<const char*>(entries_.data()), (std::streamsize)(entries_.size() * sizeof(StoreEntry)));
+        out_.write(reinterpret_cast<const char*>(&f), sizeof(f));
+        out_.close();
+        if (!out_) throw std::runtime_error("Failed writing doc store");
+    }
+
+    uint32_t docs() const { return docs_; }
+    uint64_t raw_bytes = 0;    // records before compression
+    uint64_t stored_bytes = 0; // compressed blocks
+
+private:
+    struct Stream {
+        std::vector<uint8_t> buf;
+        std::vector<StoreBlock> blocks;
+    };
+
+    std::ofstream out_;
+    uint64_t pos_ = 0;
+    Stream meta_, text_;
+    std::vector<StoreEntry> entries_;
+    std::vector<uint8_t> record_, packed_;
+    uint32_t docs_ = 0;
+
+    static void append_string(std::vector<uint8_t>& out, std::string_view s) {
+        append_varint(out, (uint32_t)s.size());
+        out.insert(out.end(), s.begin(), s.end());
+    }
+
+    // Appends record_ to the stream; a record never straddles two blocks.
+    void place(Stream& s, size_t block_size, uint32_t& block, uint32_t& pos) {
+        if (!s.buf.empty() && s.buf.size() + record_.size() > block_size) flush(s);
+        block = (uint32_t)s.blocks.size();
+        pos = (uint32_t)s.buf.size();
+        s.buf.insert(s.buf.end(), record_.begin(), record_.end());
+    }
+
+    void flush(Stream& s) {
+        if (s.buf.empty()) return;
+        packed_.clear();
+        lz_compress(s.buf.data(), s.buf.size(), packed_);
+        StoreBlock b;
+        b.offset = pos_;
+        b.len = (uint32_t)packed_.size();
+        b.raw_len = (uint32_t)s.buf.size();
+        out_.write(reinterpret_cast<const char*>(packed_.data()), (std::streamsize)packed_.size());
+        pos_ += packed_.size();
+        raw_bytes += s.buf.size();
+        stored_bytes += packed_.size();
+        s.blocks.push_back(b);
+        s.buf.clear();
+    }
+};
+
+// ---- reader ----
+
+// Mapped store.bin. Lookups are const and decode into the caller's Reader,
+// which keeps the last meta and text block: docs printed in id order mostly
+// share blocks, and each block is decoded once.
+class DocStore {
+public:
+    struct Reader {
+        uint32_t meta_block = STORE_NONE, text_block = STORE_NONE;
+        std::string meta, text;
+        uint64_t decoded = 0; // blocks decompressed
+    };
+
+    bool loaded() const { return entries_ != nullptr; }
+
+    void open(const std::string& path) {
+        file_.open(path);
+        StoreFooter f{};
+        if (file_.size() >= sizeof(f)) std::memcpy(&f, file_.data() + file_.size() - sizeof(f), sizeof(f));
+        if (file_.size() < sizeof(f) || std::memcmp(f.magic, STORE_MAGIC, 4) != 0) {
+            throw std::runtime_error("Not a doc store: " + path);
+        }
+        if (f.version != STORE_VERSION) {
+            throw std::runtime_error("Unsupported doc store version " + std::to_string(f.version) + ": " + path);
+        }
+        uint64_t tables = ((uint64_t)f.meta_blocks + f.text_blocks) * sizeof(StoreBlock) +
+                          ((uint64_t)f.max_id + 1) * sizeof(StoreEntry);
+        if (f.table_off + tables + sizeof(f) > file_.size()) throw std::runtime_error("Truncated doc store: " + path);
+        const uint8_t* t = file_.data() + f.table_off;
+        meta_blocks_ = reinterpret_cast<const StoreBlock*>(t);
+        text_blocks_ = meta_blocks_ + f.meta_blocks;
+        entries_ = reinterpret_cast<const StoreEntry*>(text_blocks_ + f.text_blocks);
+        n_meta_ = f.meta_blocks;
+        n_text_ = f.text_blocks;
+        max_id_ = f.max_id;
+        docs_ = f.docs;
+        for (uint32_t b = 0; b < n_meta_ + n_text_; b++) {
+            const StoreBlock& sb = meta_blocks_[b];
+            if (sb.offset + sb.len > f.table_off) throw std::runtime_error("Corrupt doc store: " + path);
+        }
+    }
+
+    uint32_t docs() const { return docs_; }
+
+    // Title and url of doc `id`, viewing into r; false when the store has no such doc.
+    bool meta(uint32_t id, Reader& r, std::string_view& title, std::string_view& url) const {
+        const StoreEntry* e = entry(id);
+        if (!e) return false;
+        const uint8_t* p = block(meta_blocks_, n_meta_, e->meta_block, r.meta_block, r.meta, r) + e->meta_pos;
+        title = read_string(p, r.meta);
+        url = read_string(p, r.meta);
+        return true;
+    }
+
+    bool text(uint32_t id, Reader& r, std::string_view& text) const {
+        const StoreEntry* e = entry(id);
+        if (!e) return false;
+        const uint8_t* p = block(text_blocks_, n_text_, e->text_block, r.text_block, r.text, r) + e->text_pos;
+        text = read_string(p, r.text);
+        return true;
+    }
+
+private:
+    MappedFile file_;
+    const StoreBlock* meta_blocks_ = nullptr;
+    const StoreBlock* text_blocks_ = nullptr;
+    const StoreEntry* entries_ = nullptr;
+    uint32_t n_meta_ = 0, n_text_ = 0, max_id_ = 0, docs_ = 0;
+
+    const StoreEntry* entry(uint32_t id) const {
+        if (!entries_ || id > max_id_ || entries_[id].meta_block == STORE_NONE) return nullptr;
+        return &entries_[id];
+    }
+
+    const uint8_t* block(const StoreBlock* table, uint32_t n, uint32_t b, uint32_t& cur, std::string& buf,
+                         Reader& r) const {
+        if (b >= n) throw std::runtime_error("Corrupt doc store entry");
+        if (cur != b) {
+            cur = STORE_NONE; // stays invalid if decoding throws
+            lz_decompress(file_.data() + table[b].offset, table[b].len, table[b].raw_len, buf);
+            cur = b;
+            r.decoded++;
+        }
+        return reinterpret_cast<const uint8_t*>(buf.data());
+    }
+
+    static std::string_view read_string(const uint8_t*& p, const std::string& buf) {
+        const uint8_t* end = reinterpret_cast<const uint8_t*>(buf.data()) + buf.size();
+        uint32_t len = read_varint(p);
+        if (len > (size_t)(end - p)) throw std::runtime_error("Corrupt doc store record");
+        std::string_view s(reinterpret_cast<const char*>(p), len);
+        p += len;
+        return s;
+    }
+};
+
+// ---- snippets ----
+
+// About `width` tokens of `text` on one line, from the window with the most
+// distinct query terms (then the most hits), the matching words wrapped in
+// <b>..</b> and the text around them HTML-escaped (&, <, >, "), so a doc's
+// own markup cannot break or inject into the snippet. Words are tokenized and
+// stemmed as build_index does with its defaults, and `terms` are stems.
+// Without any hit the snippet is the start.
+inline std::string make_snippet(std::string_view text, const std::vector<std::string>& terms, size_t width = 30) {
+    struct Tok {
+        size_t begin, end;
+        int term; // index in `terms`, -1: no hit
+    };
+    std::vector<Tok> toks;
+    std::string low, stem;
+    // suffix rules never touch the first letter, so only words starting like a
+    // term are stemmed
+    bool first[256] = {};
+    for (const auto& t : terms) {
+        if (!t.empty()) first[(unsigned char)t[0]] = true;
+    }
+    for (size_t i = 0; i < text.size();) {
+        if (!is_alnum_ascii(text[i])) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < text.size() &&
+               (is_alnum_ascii(text[j]) || (text[j] == '-' && j + 1 < text.size() && is_alnum_ascii(text[j + 1])))) {
+            j++;
+        }
+        int term = -1;
+        if (j - i >= 2 && first[(unsigned char)to_lower_ascii(text[i])]) {
+            low.assign(text.data() + i, j - i);
+            for (char& c : low) c = to_lower_ascii(c);
+            stem_into(low, stem);
+            auto it = std::find(terms.begin(), terms.end(), stem);
+            if (it != terms.end()) term = (int)(it - terms.begin());
+        }
+        toks.push_back({i, j, term});
+        i = j;
+    }
+    if (toks.empty()) return std::string();
+
+    // sliding window: count of each term inside, distinct terms and hits
+    size_t best = 0;
+    uint64_t best_score = 0;
+    std::vector<uint32_t> in(terms.size(), 0);
+    uint64_t distinct = 0, hits = 0;
+    for (size_t k = 0; k < toks.size(); k++) {
+        if (toks[k].term >= 0 && in[(size_t)toks[k].term]++ == 0) distinct++;
+        if (toks[k].term >= 0) hits++;
+        if (k >= width) {
+            int out = toks[k - width].term;
+            if (out >= 0 && --in[(size_t)out] == 0) distinct--;
+            if (out >= 0) hits--;
+        }
+        uint64_t score = distinct << 32 | hits;
+        if (score > best_score) {
+            best_score = score;
+            best = k + 1 > width ? k + 1 - width : 0;
+        }
+    }
+    size_t last = std::min(toks.size(), best + width);
+
+    std::string s;
+    if (best > 0) s += "... ";
+    bool space = false;
+    for (size_t k = best; k < last; k++) {
+        // the text between tokens, on one line and with single spaces
+        size_t from = k == best ? toks[k].begin : toks[k - 1].end;
+        for (size_t i = from; i < toks[k].begin; i++) {
+            unsigned char c = (unsigned char)text[i];
+            if (c <= ' ') {
+                if (!space) s += ' ';
+                space = true;
+            } else {
+                switch (c) {
+                    case '&': s += "&amp;"; break;
+                    case '<': s += "&lt;"; break;
+                    case '>': s += "&gt;"; break;
+                    case '"': s += "&quot;"; break;
+                    default: s += (char)c;
+                }
+                space = false;
+            }
+        }
+        if (toks[k].term >= 0) s += "<b>";
+        // tokens are ASCII letters, digits and '-': nothing to escape
+        s.append(text.data() + toks[k].begin, toks[k].end - toks[k].begin);
+        if (toks[k].term >= 0) s += "</b>";
+        space = false;
+    }
+    if (last < toks.size()) s += " ...";
+    return s;
+}
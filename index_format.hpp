@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postings_codec.hpp"
+#include "term_dict.hpp"
+
+// Binary index (index.bin), little endian, written by build_index next to dict.tsv:
+//
+//   IndexHeader
+//   uint32_t   block_off[nblocks + 1]  start of every front-coded term block (term_dict.hpp)
+//   uint32_t   suffix_order[nterms]    term ids ordered by reversed term, for *suffix queries
+//   DictEntry  entries[nterms]         postings entry of each term, in term order (8-byte aligned)
+//   uint8_t    terms[]                 sorted terms, front coded in blocks of term_block
+//   postings                           same bytes as postings.bin (8-byte aligned)
+//
+// All section offsets are absolute file offsets, so the file is used in place
+// after mmap: lookups are a binary search over the block heads, postings are
+// pointers into the mapping.
+//
+// Version 1 files (plain terms: uint32_t term_offs[nterms + 1] at term_index_off
+// and the terms concatenated without separators) are still read; their
+// dictionary is front coded in memory when the index is opened.
+
+static constexpr char INDEX_MAGIC[4] = {'I', 'R', 'I', 'X'};
+static constexpr uint32_t INDEX_VERSION = 2;
+
+struct DictEntry {
+    uint32_t df = 0;
+    Codec codec = Codec::Raw;
+    uint64_t offset = 0;
+    uint64_t len = 0;
+};
+static_assert(sizeof(DictEntry) == 24, "DictEntry is part of the on-disk format");
+
+struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t nterms;
+    uint32_t maxdoc;
+    uint64_t term_index_off; // block_off (version 1: term_offs)
+    uint64_t entries_off;
+    uint64_t terms_off;
+    uint64_t terms_len;
+    uint64_t postings_off;
+    uint64_t postings_len;
+    uint64_t suffix_off;     // version 2 from here on
+    uint32_t term_block;
+    uint32_t reserved;
+};
+static_assert(sizeof(IndexHeader) == 80, "IndexHeader is part of the on-disk format");
+static constexpr size_t INDEX_HEADER_V1 = 64;
+
+inline void pad_to(std::ofstream& out, uint64_t& pos, uint64_t align) {
+    static const char zeros[8] = {};
+    while (pos % align) {
+        uint64_t n = std::min<uint64_t>(align - pos % align, sizeof(zeros));
+        out.write(zeros, (std::streamsize)n);
+        pos += n;
+    }
+}
+
+// `terms` must be sorted; postings are copied from the already written postings.bin.
+inline void write_index_bin(const std::string& path, const std::vector<std::string>& terms,
+                            const std::vector<DictEntry>& entries, uint32_t maxdoc,
+                            const std::string& postings_path) {
+    std::ifstream postings(postings_path, std::ios::binary);
+    std::ofstream out(path, std::ios::binary);
+    if (!postings || !out) throw std::runtime_error("Cannot write binary index: " + path);
+
+    TermDictData dict;
+    encode_term_dict(terms, dict);
+
+    IndexHeader h{};
+    std::memcpy(h.magic, INDEX_MAGIC, 4);
+    h.version = INDEX_VERSION;
+    h.nterms = (uint32_t)terms.size();
+    h.maxdoc = maxdoc;
+    h.term_block = TERM_BLOCK;
+    h.term_index_off = sizeof(IndexHeader);
+    h.suffix_off = h.term_index_off + dict.block_off.size() * sizeof(uint32_t);
+    h.entries_off = h.suffix_off + (uint64_t)h.nterms * sizeof(uint32_t);
+    h.entries_off = (h.entries_off + 7) / 8 * 8;
+    h.terms_off = h.entries_off + (uint64_t)h.nterms * sizeof(DictEntry);
+    h.terms_len = dict.bytes.size();
+    h.postings_off = (h.terms_off + h.terms_len + 7) / 8 * 8;
+    postings.seekg(0, std::ios::end);
+    h.postings_len = (uint64_t)postings.tellg();
+    postings.seekg(0, std::ios::beg);
+
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    uint64_t pos = sizeof(h);
+
+    out.write(reinterpret_cast<const char*>(dict.block_off.data()),
+              (std::streamsize)(dict.block_off.size() * sizeof(uint32_t)));
+    out.write(reinterpret_cast<const char*>(dict.suffix_order.data()),
+              (std::streamsize)(dict.suffix_order.size() * sizeof(uint32_t)));
+    pos = h.suffix_off + (uint64_t)h.nterms * sizeof(uint32_t);
+    pad_to(out, pos, 8);
+
+    out.write(reinterpret_cast<const char*>(entries.data()), (std::streamsize)(entries.size() * sizeof(DictEntry)));
+    pos += entries.size() * sizeof(DictEntry);
+
+    out.write(reinterpret_cast<const char*>(dict.bytes.data()), (std::streamsize)dict.bytes.size());
+    pos += h.terms_len;
+    pad_to(out, pos, 8);
+
+    out << postings.rdbuf();
+    if (!out) throw std::runtime_error("Failed writing binary index: " + path);
+}
+
+// Read-only mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    void open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open: " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot stat: " + path);
+        }
+        size_ = (size_t)st.st_size;
+        if (size_ > 0) {
+            void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot mmap: " + path);
+            }
+            data_ = static_cast<const uint8_t*>(p);
+        }
+        ::close(fd);
+    }
+
+    void close() {
+        if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// docmap.bin, written by build_index --reorder next to index.bin: the index
+// numbers its docs 1..maxdoc in the reordered sequence, and this maps them back
+// to the ids of the source files.
+//
+//   DocMapHeader
+//   uint32_t original[maxdoc + 1]   original id of every index doc id (original[0] = 0)
+
+static constexpr char DOCMAP_MAGIC[4] = {'I', 'R', 'D', 'M'};
+static constexpr uint32_t DOCMAP_VERSION = 1;
+
+struct DocMapHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t maxdoc;
+    uint32_t max_original;
+};
+static_assert(sizeof(DocMapHeader) == 16, "DocMapHeader is part of the on-disk format");
+
+inline void write_docmap(const std::string& path, const std::vector<uint32_t>& original) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out || original.empty()) throw std::runtime_error("Cannot write doc map: " + path);
+    DocMapHeader h{};
+    std::memcpy(h.magic, DOCMAP_MAGIC, 4);
+    h.version = DOCMAP_VERSION;
+    h.maxdoc = (uint32_t)(original.size() - 1);
+    h.max_original = *std::max_element(original.begin(), original.end());
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char*>(original.data()), (std::streamsize)(original.size() * sizeof(uint32_t)));
+    if (!out) throw std::runtime_error("Failed writing doc map: " + path);
+}
+
+// Mapped docmap.bin. Without one, every id is its own original.
+class DocMap {
+public:
+    void open(const std::string& path) {
+        file_.open(path);
+        DocMapHeader h{};
+        if (file_.size() >= sizeof(h)) std::memcpy(&h, file_.data(), sizeof(h));
+        if (file_.size() < sizeof(h) || std::memcmp(h.magic, DOCMAP_MAGIC, 4) != 0) {
+            throw std::runtime_error("Not a doc map: " + path);
+        }
+        if (h.version != DOCMAP_VERSION) {
+            throw std::runtime_error("Unsupported doc map version " + std::to_string(h.version) + ": " + path);
+        }
+        if (sizeof(h) + ((uint64_t)h.maxdoc + 1) * sizeof(uint32_t) > file_.size()) {
+            throw std::runtime_error("Truncated doc map: " + path);
+        }
+        maxdoc_ = h.maxdoc;
+        max_original_ = h.max_original;
+        original_ = reinterpret_cast<const uint32_t*>(file_.data() + sizeof(h));
+    }
+
+    bool loaded() const { return original_ != nullptr; }
+    uint32_t maxdoc() const { return maxdoc_; }
+    uint32_t max_original() const { return max_original_; }
+
+    uint32_t original(uint32_t doc) const { return original_ && doc <= maxdoc_ ? original_[doc] : doc; }
+
+private:
+    MappedFile file_;
+    const uint32_t* original_ = nullptr;
+    uint32_t maxdoc_ = 0;
+    uint32_t max_original_ = 0;
+};
+
+// Postings of one term, pointing into the mapped postings.
+struct PostingsView {
+    const uint8_t* data = nullptr;
+    uint64_t len = 0;
+    uint32_t df = 0;
+    Codec codec = Codec::Raw;
+
+    // raw lists are used in place, without decoding
+    const uint32_t* raw_docs() const { return reinterpret_cast<const uint32_t*>(data); }
+};
+
+// Sorted dictionary plus postings. Filled either from a mapped index.bin or,
+// for the text format and version 1 files, from a dictionary encoded in memory.
+class Index {
+public:
+    uint32_t maxdoc = 0;
+    DocMap docmap; // of a reordered index; results are printed with original ids
+
+    void open_bin(const std::string& path) {
+        file_.open(path);
+        if (file_.size() < INDEX_HEADER_V1) throw std::runtime_error("Not a binary index: " + path);
+        IndexHeader h{};
+        std::memcpy(&h, file_.data(), std::min(sizeof(h), file_.size()));
+        if (std::memcmp(h.magic, INDEX_MAGIC, 4) != 0) throw std::runtime_error("Not a binary index: " + path);
+        if (h.version != 1 && h.version != INDEX_VERSION) {
+            throw std::runtime_error("Unsupported binary index version " + std::to_string(h.version) + ": " + path);
+        }
+        if (h.postings_off + h.postings_len > file_.size()) throw std::runtime_error("Truncated binary index: " + path);
+
+        const uint8_t* base = file_.data();
+        maxdoc = h.maxdoc;
+        nterms_ = h.nterms;
+        entries_ = reinterpret_cast<const DictEntry*>(base + h.entries_off);
+        postings_ = base + h.postings_off;
+        postings_len_ = h.postings_len;
+        if (h.version == 1) {
+            const uint32_t* offs = reinterpret_cast<const uint32_t*>(base + h.term_index_off);
+            const char* text = reinterpret_cast<const char*>(base + h.terms_off);
+            std::vector<std::string> terms(nterms_);
+            for (uint32_t i = 0; i < nterms_; i++) terms[i].assign(text + offs[i], offs[i + 1] - offs[i]);
+            encode_term_dict(terms, own_dict_);
+            dict_.attach(own_dict_, nterms_);
+            return;
+        }
+        if (h.term_block == 0) throw std::runtime_error("Corrupt binary index: " + path);
+        dict_.attach(base + h.terms_off, reinterpret_cast<const uint32_t*>(base + h.term_index_off),
+                     reinterpret_cast<const uint32_t*>(base + h.suffix_off), nterms_, h.term_block);
+    }
+
+    // docmap.bin of a reordered index; must have been written with this index.
+    void open_docmap(const std::string& path) {
+        docmap.open(path);
+        if (docmap.maxdoc() != maxdoc) throw std::runtime_error("Doc map does not match the index: " + path);
+    }
+
+    // Text format: dict.tsv rows (already sorted by build_index) plus mapped postings.bin.
+    void set_dict(const std::vector<std::string>& terms, std::vector<DictEntry> entries) {
+        encode_term_dict(terms, own_dict_);
+        own_entries_ = std::move(entries);
+        nterms_ = (uint32_t)own_entries_.size();
+        entries_ = own_entries_.data();
+        dict_.attach(own_dict_, nterms_);
+    }
+
+    void open_postings(const std::string& path) {
+        file_.open(path);
+        postings_ = file_.data();
+        postings_len_ = file_.size();
+    }
+
+    uint32_t size() const { return nterms_; }
+
+    // Term i, decoded into buf.
+    std::string_view term(uint32_t i, std::string& buf) const { return dict_.term(i, buf); }
+
+    const DictEntry& entry(uint32_t i) const { return entries_[i]; }
+
+    const TermDict& dict() const { return dict_; }
+
+    // Returns the term ordinal or -1.
+    int64_t find(std::string_view t) const { return dict_.find(t); }
+
+    PostingsView postings(const DictEntry& e) const {
+        if (e.offset + e.len > postings_len_) throw std::runtime_error("Postings out of range");
+        PostingsView v;
+        v.data = postings_ + e.offset;
+        v.len = e.len;
+        v.df = e.df;
+        v.codec = e.codec;
+        return v;
+    }
+
+private:
+    MappedFile file_;
+    uint32_t nterms_ = 0;
+    TermDict dict_;
+    const DictEntry* entries_ = nullptr;
+    const uint8_t* postings_ = nullptr;
+    uint64_t postings_len_ = 0;
+
+    TermDictData own_dict_;
+    std::vector<DictEntry> own_entries_;
+};
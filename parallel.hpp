@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs fn(item) for every item in [0, n) on `threads` workers with work stealing.
+// Each worker starts with a contiguous slice and takes items from its front; a
+// worker whose queue runs dry steals the back half of another worker's queue, so
+// a few expensive items do not leave the other cores idle.
+template <class F>
+void parallel_for_stealing(size_t n, unsigned threads, F&& fn) {
+    if (threads <= 1 || n <= 1) {
+        for (size_t i = 0; i < n; i++) fn(i);
+        return;
+    }
+    threads = (unsigned)std::min<size_t>(threads, n);
+
+    struct Queue {
+        std::mutex m;
+        std::deque<size_t> items;
+    };
+    std::vector<Queue> queues(threads);
+    for (unsigned t = 0; t < threads; t++) {
+        for (size_t i = n * t / threads; i < n * (t + 1) / threads; i++) queues[t].items.push_back(i);
+    }
+
+    auto worker = [&](unsigned self) {
+        std::vector<size_t> stolen;
+        for (;;) {
+            size_t item = 0;
+            bool got = false;
+            {
+                std::lock_guard<std::mutex> lk(queues[self].m);
+                if (!queues[self].items.empty()) {
+                    item = queues[self].items.front();
+                    queues[self].items.pop_front();
+                    got = true;
+                }
+            }
+            for (unsigned k = 1; k < threads && !got; k++) {
+                Queue& victim = queues[(self + k) % threads];
+                {
+                    std::lock_guard<std::mutex> lk(victim.m);
+                    if (victim.items.empty()) continue;
+                    size_t take = (victim.items.size() + 1) / 2;
+                    stolen.assign(victim.items.end() - (std::ptrdiff_t)take, victim.items.end());
+                    victim.items.erase(victim.items.end() - (std::ptrdiff_t)take, victim.items.end());
+                }
+                item = stolen.front();
+                got = true;
+                std::lock_guard<std::mutex> lk(queues[self].m);
+                queues[self].items.insert(queues[self].items.end(), stolen.begin() + 1, stolen.end());
+            }
+            // nothing is ever added, so once every queue is empty the remaining items are in flight elsewhere
+            if (!got) return;
+            fn(item);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++) pool.emplace_back(worker, t);
+    for (auto& th : pool) th.join();
+}
+
+// Long-lived helper threads for work inside one request (the doc-range shards of
+// a query), so a request does not pay for starting threads. run(n, fn) returns
+// once fn(0) .. fn(n - 1) are done; the calling thread takes items too, so a run
+// never waits for helpers busy with other runs, and several threads may call
+// run at the same time. An exception of fn is rethrown by run.
+class TaskPool {
+public:
+    explicit TaskPool(unsigned helpers) {
+        for (unsigned i = 0; i < helpers; i++) threads_.emplace_back([this] { help(); });
+    }
+
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            closing_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    void run(size_t n, const std::function<void(size_t)>& fn) {
+        if (n == 0) return;
+        Batch b;
+        b.fn = &fn;
+        b.n = n;
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            if (n > 1 && !threads_.empty()) batches_.push_back(&b);
+        }
+        work_cv_.notify_all();
+        size_t item;
+        while (claim(&b, item)) finish(&b, item);
+        std::unique_lock<std::mutex> lk(m_);
+        done_cv_.wait(lk, [&] { return b.done == n; });
+        if (b.error) std::rethrow_exception(b.error);
+    }
+
+private:
+    struct Batch {
+        const std::function<void(size_t)>* fn;
+        size_t n;
+        size_t next = 0; // items are claimed and counted under m_
+        size_t done = 0;
+        std::exception_ptr error; // the first one
+    };
+
+    std::mutex m_;
+    std::condition_variable work_cv_, done_cv_;
+    std::deque<Batch*> batches_; // batches with unclaimed items
+    bool closing_ = false;
+    std::vector<std::thread> threads_;
+
+    bool claim(Batch* b, size_t& item) {
+        std::lock_guard<std::mutex> lk(m_);
+        if (b->next == b->n) return false;
+        item = b->next++;
+        if (b->next == b->n) batches_.erase(std::remove(batches_.begin(), batches_.end(), b), batches_.end());
+        return true;
+    }
+
+    void finish(Batch* b, size_t item) {
+        std::exception_ptr err;
+        try {
+            (*b->fn)(item);
+        } catch (...) {
+            err = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        if (err && !b->error) b->error = err;
+        if (++b->done == b->n) done_cv_.notify_all(); // the owner may return as soon as m_ is released
+    }
+
+    void help() {
+        for (;;) {
+            Batch* b;
+            size_t item;
+            {
+                std::unique_lock<std::mutex> lk(m_);
+                work_cv_.wait(lk, [this] { return closing_ || !batches_.empty(); });
+                if (batches_.empty()) return;
+                b = batches_.front();
+                item = b->next++;
+                if (b->next == b->n) batches_.pop_front();
+            }
+            finish(b, item);
+        }
+    }
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "index_format.hpp"
+#include "postings_codec.hpp"
+
+// Positional postings (positions.bin), written by build_index --positions next
+// to the index. Position = index of the token in the document's token stream
+// (a line of the .stm file); empty stems keep their position.
+//
+// Positions stream of a term: for every doc of its postings, in the same order,
+//   varint tf, varint first position, varint (tf - 1) position deltas
+//
+// positions.bin:
+//   per term, in dictionary order:
+//     uint32_t nblocks                  ceil(df / POSTINGS_BLOCK)
+//     uint32_t block_off[nblocks]       start of every POSTINGS_BLOCK-th doc entry in the stream
+//     stream
+//   uint64_t table[nterms][2]           offset and length of every term record (8-byte aligned)
+//   PositionsFooter
+//
+// block_off lets a reader jump to the positions of the k-th doc of a list and
+// skip at most POSTINGS_BLOCK - 1 entries, so only candidate docs are decoded.
+
+static constexpr char POSITIONS_MAGIC[4] = {'I', 'R', 'P', 'S'};
+static constexpr uint32_t POSITIONS_VERSION = 1;
+
+struct PositionsFooter {
+    char magic[4];
+    uint32_t version;
+    uint64_t nterms;
+    uint64_t table_off;
+};
+static_assert(sizeof(PositionsFooter) == 24, "PositionsFooter is part of the on-disk format");
+
+// Appends one doc entry; `pos` is sorted.
+inline void append_positions(std::vector<uint8_t>& stream, const uint32_t* pos, size_t n) {
+    append_varint(stream, (uint32_t)n);
+    uint32_t prev = 0;
+    for (size_t i = 0; i < n; i++) {
+        append_varint(stream, pos[i] - prev);
+        prev = pos[i];
+    }
+}
+
+// Returns the end of the doc entry starting at p.
+inline const uint8_t* skip_positions(const uint8_t* p) {
+    uint32_t tf = read_varint(p);
+    for (uint32_t i = 0; i < tf; i++) {
+        while (*p++ & 0x80) {
+        }
+    }
+    return p;
+}
+
+// Term record: block directory for the stream of `df` doc entries.
+inline void encode_positions_record(const std::vector<uint8_t>& stream, uint32_t df, std::vector<uint8_t>& out) {
+    uint32_t nblocks = (df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+    append_u32(out, nblocks);
+    size_t dir = out.size();
+    out.resize(out.size() + (size_t)nblocks * 4);
+    const uint8_t* p = stream.data();
+    for (uint32_t i = 0; i < df; i++) {
+        if (i % POSTINGS_BLOCK == 0) {
+            uint32_t off = (uint32_t)(p - stream.data());
+            std::memcpy(&out[dir + (size_t)(i / POSTINGS_BLOCK) * 4], &off, 4);
+        }
+        p = skip_positions(p);
+    }
+    out.insert(out.end(), stream.begin(), stream.end());
+}
+
+// Positions of one term inside the mapped file.
+struct PositionsList {
+    const uint8_t* record = nullptr;
+    uint64_t len = 0;
+
+    const uint8_t* stream() const { return record + 4 + (size_t)load_u32(record) * 4; }
+
+    // Positions of the doc at `rank` in the term's postings.
+    void positions(uint32_t rank, std::vector<uint32_t>& out) const {
+        const uint8_t* p = stream() + load_u32(record + 4 + (size_t)(rank / POSTINGS_BLOCK) * 4);
+        for (uint32_t i = rank % POSTINGS_BLOCK; i > 0; i--) p = skip_positions(p);
+        uint32_t tf = read_varint(p);
+        out.resize(tf);
+        uint32_t prev = 0;
+        for (uint32_t i = 0; i < tf; i++) {
+            prev += read_varint(p);
+            out[i] = prev;
+        }
+    }
+};
+
+// Some position x with x + i in the positions of the i-th term, for every i.
+inline bool phrase_match(const std::vector<std::vector<uint32_t>>& p) {
+    std::vector<size_t> j(p.size(), 0);
+    for (uint32_t x : p[0]) {
+        bool all = true;
+        for (size_t i = 1; i < p.size() && all; i++) {
+            while (j[i] < p[i].size() && p[i][j[i]] < x + i) j[i]++;
+            if (j[i] == p[i].size()) return false;
+            all = p[i][j[i]] == x + i;
+        }
+        if (all) return true;
+    }
+    return false;
+}
+
+// Two different occurrences at most `dist` positions apart, in either order.
+inline bool near_match(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b, uint32_t dist) {
+    for (uint32_t x : a) {
+        auto it = std::lower_bound(b.begin(), b.end(), x >= dist ? x - dist : 0);
+        for (; it != b.end() && *it <= (uint64_t)x + dist; ++it) {
+            if (*it != x) return true;
+        }
+    }
+    return false;
+}
+
+class Positions {
+public:
+    bool loaded() const { return table_ != nullptr; }
+
+    void open(const std::string& path) {
+        file_.open(path);
+        if (file_.size() < sizeof(PositionsFooter)) throw std::runtime_error("Not a positions file: " + path);
+        PositionsFooter f;
+        std::memcpy(&f, file_.data() + file_.size() - sizeof(f), sizeof(f));
+        if (std::memcmp(f.magic, POSITIONS_MAGIC, 4) != 0) throw std::runtime_error("Not a positions file: " + path);
+        if (f.version != POSITIONS_VERSION) {
+            throw std::runtime_error("Unsupported positions version " + std::to_string(f.version) + ": " + path);
+        }
+        if (f.table_off + f.nterms * 16 + sizeof(f) > file_.size()) throw std::runtime_error("Truncated positions file: " + path);
+        nterms_ = f.nterms;
+        table_ = file_.data() + f.table_off;
+    }
+
+    // Same ordinal as in the dictionary.
+    PositionsList list(uint32_t term) const {
+        if (term >= nterms_) throw std::runtime_error("Positions do not match the dictionary");
+        uint64_t off, len;
+        std::memcpy(&off, table_ + (size_t)term * 16, 8);
+        std::memcpy(&len, table_ + (size_t)term * 16 + 8, 8);
+        PositionsList l;
+        l.record = file_.data() + off;
+        l.len = len;
+        return l;
+    }
+
+private:
+    MappedFile file_;
+    uint64_t nterms_ = 0;
+    const uint8_t* table_ = nullptr;
+};
+
+// Sequential writer of positions.bin, fed in dictionary order.
+class PositionsWriter {
+public:
+    void open(const std::string& path) {
+        out_.open(path, std::ios::binary);
+        if (!out_) throw std::runtime_error("Cannot write positions: " + path);
+    }
+
+    bool is_open() const { return out_.is_open(); }
+
+    // `record` from encode_positions_record
+    void add(const uint8_t* record, size_t len) {
+        out_.write(reinterpret_cast<const char*>(record), (std::streamsize)len);
+        table_.push_back(pos_);
+        table_.push_back(len);
+        pos_ += len;
+    }
+
+    void finish() {
+        pad_to(out_, pos_, 8);
+        PositionsFooter f{};
+        std::memcpy(f.magic, POSITIONS_MAGIC, 4);
+        f.version = POSITIONS_VERSION;
+        f.nterms = table_.size() / 2;
+        f.table_off = pos_;
+        out_.write(reinterpret_cast<const char*>(table_.data()), (std::streamsize)(table_.size() * 8));
+        out_.write(reinterpret_cast<const char*>(&f), sizeof(f));
+        out_.close();
+        if (!out_) throw std::runtime_error("Failed writing positions");
+    }
+
+private:
+    std::ofstream out_;
+    uint64_t pos_ = 0;
+    std::vector<uint64_t> table_;
+};
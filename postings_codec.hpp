@@ -0,0 +1,350 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IR_X86 1
+#endif
+
+// Postings list codecs.
+//
+// raw: docs as plain uint32_t array (the original postings.bin format).
+// svb: docs split into blocks of POSTINGS_BLOCK ids, delta-gapped against the
+//      last doc of the previous block and packed with StreamVByte.
+//
+// svb list layout (offset of every list is 4-byte aligned, len includes padding):
+//   uint32_t last_doc[nblocks]   max doc id of each block
+//   uint32_t end_off[nblocks]    end of each block payload, relative to payload start
+//   payload: per block ceil(n/4) control bytes, then data bytes
+// nblocks = ceil(df / POSTINGS_BLOCK), so df from the dictionary is enough to decode.
+//
+// roar: Roaring-style containers for dense terms. Docs are split into chunks of
+//       65536 ids by their high 16 bits; each chunk is a sorted uint16_t array when
+//       it holds at most ROARING_ARRAY_MAX docs and a 65536-bit bitmap otherwise.
+//   uint32_t nchunks
+//   per chunk: uint16_t key, uint16_t kind (0 array, 1 bitmap), uint32_t card
+//   payload: per chunk uint16_t[card] padded to 4 bytes, or uint64_t[1024]
+
+enum class Codec : uint32_t {
+    Raw = 0,
+    StreamVByte = 1,
+    Roaring = 2,
+};
+
+static constexpr uint32_t POSTINGS_BLOCK = 128;
+static constexpr uint32_t ROARING_ARRAY_MAX = 4096;
+static constexpr uint32_t ROARING_WORDS = 1024;
+
+inline const char* codec_name(Codec c) {
+    switch (c) {
+        case Codec::Raw: return "raw";
+        case Codec::StreamVByte: return "svb";
+        case Codec::Roaring: return "roar";
+    }
+    return "?";
+}
+
+inline bool parse_codec(const std::string& s, Codec& c) {
+    if (s == "raw") { c = Codec::Raw; return true; }
+    if (s == "svb") { c = Codec::StreamVByte; return true; }
+    if (s == "roar") { c = Codec::Roaring; return true; }
+    return false;
+}
+
+inline uint32_t load_u32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void append_u32(std::vector<uint8_t>& out, uint32_t v) {
+    uint8_t b[4];
+    std::memcpy(b, &v, 4);
+    out.insert(out.end(), b, b + 4);
+}
+
+inline void append_varint(std::vector<uint8_t>& out, uint32_t v) {
+    while (v >= 0x80) {
+        out.push_back(uint8_t(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+inline uint32_t read_varint(const uint8_t*& p) {
+    uint32_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = *p++;
+        v |= uint32_t(b & 0x7F) << shift;
+        if (b < 0x80) return v;
+    }
+}
+
+inline uint32_t svb_num_blocks(uint32_t df) {
+    return (df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+}
+
+// True when some 64K chunk of the list is dense enough to be stored as a bitmap.
+inline bool has_dense_chunk(const std::vector<uint32_t>& docs) {
+    size_t i = 0;
+    while (i < docs.size()) {
+        size_t j = i;
+        while (j < docs.size() && (docs[j] >> 16) == (docs[i] >> 16)) j++;
+        if (j - i > ROARING_ARRAY_MAX) return true;
+        i = j;
+    }
+    return false;
+}
+
+// ---- encoding ----
+
+inline void svb_encode_block(const uint32_t* deltas, uint32_t n, std::vector<uint8_t>& out) {
+    size_t ctrl_pos = out.size();
+    out.resize(out.size() + (n + 3) / 4, 0);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t v = deltas[i];
+        uint32_t bytes = v < (1u << 8) ? 1 : v < (1u << 16) ? 2 : v < (1u << 24) ? 3 : 4;
+        out[ctrl_pos + i / 4] |= uint8_t((bytes - 1) << ((i % 4) * 2));
+        for (uint32_t k = 0; k < bytes; k++) out.push_back(uint8_t(v >> (8 * k)));
+    }
+}
+
+inline void roaring_encode(const std::vector<uint32_t>& docs, std::vector<uint8_t>& out) {
+    std::vector<size_t> bounds;
+    for (size_t i = 0; i < docs.size(); i++) {
+        if (i == 0 || (docs[i] >> 16) != (docs[i - 1] >> 16)) bounds.push_back(i);
+    }
+    bounds.push_back(docs.size());
+
+    uint32_t nchunks = (uint32_t)bounds.size() - 1;
+    append_u32(out, nchunks);
+    for (uint32_t c = 0; c < nchunks; c++) {
+        uint32_t card = (uint32_t)(bounds[c + 1] - bounds[c]);
+        uint32_t key = docs[bounds[c]] >> 16;
+        uint32_t kind = card > ROARING_ARRAY_MAX ? 1 : 0;
+        append_u32(out, key | (kind << 16));
+        append_u32(out, card);
+    }
+    for (uint32_t c = 0; c < nchunks; c++) {
+        size_t lo = bounds[c], hi = bounds[c + 1];
+        if (hi - lo > ROARING_ARRAY_MAX) {
+            uint64_t words[ROARING_WORDS] = {};
+            for (size_t i = lo; i < hi; i++) words[(docs[i] & 0xFFFF) >> 6] |= uint64_t(1) << (docs[i] & 63);
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(words);
+            out.insert(out.end(), p, p + sizeof(words));
+        } else {
+            for (size_t i = lo; i < hi; i++) {
+                uint16_t v = uint16_t(docs[i] & 0xFFFF);
+                out.push_back(uint8_t(v));
+                out.push_back(uint8_t(v >> 8));
+            }
+            while (out.size() % 4) out.push_back(0);
+        }
+    }
+}
+
+// Appends the encoded list to `out` and pads it to a multiple of 4 bytes.
+inline void encode_postings(Codec codec, const std::vector<uint32_t>& docs, std::vector<uint8_t>& out) {
+    size_t start = out.size();
+    if (codec == Codec::Raw) {
+        for (uint32_t d : docs) append_u32(out, d);
+        return;
+    }
+    if (codec == Codec::Roaring) {
+        std::vector<uint8_t> buf;
+        roaring_encode(docs, buf);
+        out.insert(out.end(), buf.begin(), buf.end());
+        return;
+    }
+
+    uint32_t nblocks = svb_num_blocks((uint32_t)docs.size());
+    size_t dir_pos = out.size();
+    out.resize(out.size() + (size_t)nblocks * 8);
+    size_t payload_pos = out.size();
+
+    uint32_t deltas[POSTINGS_BLOCK];
+    uint32_t prev = 0;
+    for (uint32_t b = 0; b < nblocks; b++) {
+        size_t lo = (size_t)b * POSTINGS_BLOCK;
+        uint32_t n = (uint32_t)std::min<size_t>(POSTINGS_BLOCK, docs.size() - lo);
+        for (uint32_t i = 0; i < n; i++) {
+            deltas[i] = docs[lo + i] - prev;
+            prev = docs[lo + i];
+        }
+        svb_encode_block(deltas, n, out);
+
+        uint32_t end_off = (uint32_t)(out.size() - payload_pos);
+        std::memcpy(&out[dir_pos + (size_t)b * 4], &prev, 4);
+        std::memcpy(&out[dir_pos + (size_t)nblocks * 4 + (size_t)b * 4], &end_off, 4);
+    }
+    while ((out.size() - start) % 4) out.push_back(0);
+}
+
+// ---- decoding ----
+
+struct SvbTables {
+    uint8_t shuffle[256][16];
+    uint8_t length[256];
+
+    SvbTables() {
+        for (int c = 0; c < 256; c++) {
+            uint8_t pos = 0;
+            for (int i = 0; i < 4; i++) {
+                int bytes = ((c >> (2 * i)) & 3) + 1;
+                for (int k = 0; k < 4; k++) {
+                    shuffle[c][i * 4 + k] = k < bytes ? uint8_t(pos + k) : 0x80;
+                }
+                pos = uint8_t(pos + bytes);
+            }
+            length[c] = pos;
+        }
+    }
+};
+
+inline const SvbTables& svb_tables() {
+    static const SvbTables t;
+    return t;
+}
+
+inline const uint8_t* svb_decode_scalar(const uint8_t* ctrl, const uint8_t* data,
+                                        uint32_t from, uint32_t n, uint32_t prev, uint32_t* out) {
+    for (uint32_t i = from; i < n; i++) {
+        uint32_t bytes = ((ctrl[i / 4] >> ((i % 4) * 2)) & 3) + 1;
+        uint32_t v = 0;
+        for (uint32_t k = 0; k < bytes; k++) v |= uint32_t(data[k]) << (8 * k);
+        data += bytes;
+        prev += v;
+        out[i] = prev;
+    }
+    return data;
+}
+
+#ifdef IR_X86
+// Decodes whole groups of 4 while a full 16-byte load stays inside the list,
+// returns how many values were produced; the caller finishes with the scalar path.
+__attribute__((target("ssse3")))
+inline uint32_t svb_decode_ssse3(const uint8_t* ctrl, const uint8_t*& data, const uint8_t* limit,
+                                 uint32_t n, uint32_t& prev, uint32_t* out) {
+    const SvbTables& t = svb_tables();
+    __m128i base = _mm_set1_epi32((int)prev);
+    uint32_t i = 0;
+    for (; i + 4 <= n && data + 16 <= limit; i += 4) {
+        uint8_t c = ctrl[i / 4];
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        __m128i shuf = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.shuffle[c]));
+        __m128i v = _mm_shuffle_epi8(raw, shuf);
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, base);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+        base = _mm_shuffle_epi32(v, 0xFF);
+        data += t.length[c];
+    }
+    prev = (uint32_t)_mm_cvtsi128_si32(base);
+    return i;
+}
+
+inline bool cpu_has_ssse3() {
+    static const bool ok = __builtin_cpu_supports("ssse3");
+    return ok;
+}
+#endif
+
+// Decodes block `b` of an svb list into `out` (up to POSTINGS_BLOCK values),
+// returns the number of docs in the block.
+inline uint32_t svb_decode_block(const uint8_t* list, size_t len, uint32_t df, uint32_t b, uint32_t* out) {
+    uint32_t nblocks = svb_num_blocks(df);
+    const uint8_t* payload = list + (size_t)nblocks * 8;
+    const uint8_t* end_offs = list + (size_t)nblocks * 4;
+
+    uint32_t begin = b == 0 ? 0 : load_u32(end_offs + (size_t)(b - 1) * 4);
+    uint32_t prev = b == 0 ? 0 : load_u32(list + (size_t)(b - 1) * 4);
+    uint32_t n = std::min<uint32_t>(POSTINGS_BLOCK, df - b * POSTINGS_BLOCK);
+
+    const uint8_t* ctrl = payload + begin;
+    const uint8_t* data = ctrl + (n + 3) / 4;
+    uint32_t i = 0;
+#ifdef IR_X86
+    if (cpu_has_ssse3()) i = svb_decode_ssse3(ctrl, data, list + len, n, prev, out);
+#else
+    (void)len;
+#endif
+    svb_decode_scalar(ctrl, data, i, n, prev, out);
+    return n;
+}
+
+// Docs of an svb list inside [lo, hi]: the last_doc directory picks the blocks
+// that overlap the range, only those are decoded.
+inline void svb_decode_range(const uint8_t* list, size_t len, uint32_t df, uint32_t lo, uint32_t hi,
+                             std::vector<uint32_t>& out) {
+    out.clear();
+    uint32_t nblocks = svb_num_blocks(df);
+    uint32_t b = 0, e = nblocks; // first block whose last doc is >= lo
+    while (b < e) {
+        uint32_t mid = b + (e - b) / 2;
+        if (load_u32(list + (size_t)mid * 4) < lo) b = mid + 1;
+        else e = mid;
+    }
+    uint32_t buf[POSTINGS_BLOCK];
+    for (; b < nblocks; b++) {
+        uint32_t n = svb_decode_block(list, len, df, b, buf);
+        uint32_t i = 0;
+        while (i < n && buf[i] < lo) i++;
+        for (; i < n && buf[i] <= hi; i++) out.push_back(buf[i]);
+        if (i < n || load_u32(list + (size_t)b * 4) >= hi) break;
+    }
+}
+
+// Walks the chunks of a roar list: f(key, is_bitmap, card, payload).
+template <class F>
+inline void roaring_for_each_chunk(const uint8_t* list, F&& f) {
+    uint32_t nchunks = load_u32(list);
+    const uint8_t* payload = list + 4 + (size_t)nchunks * 8;
+    for (uint32_t c = 0; c < nchunks; c++) {
+        uint32_t kk = load_u32(list + 4 + (size_t)c * 8);
+        uint32_t card = load_u32(list + 8 + (size_t)c * 8);
+        bool bitmap = (kk >> 16) != 0;
+        f(kk & 0xFFFF, bitmap, card, payload);
+        payload += bitmap ? ROARING_WORDS * 8 : ((size_t)card * 2 + 3) / 4 * 4;
+    }
+}
+
+inline void roaring_decode(const uint8_t* list, uint32_t* out) {
+    roaring_for_each_chunk(list, [&](uint32_t key, bool bitmap, uint32_t card, const uint8_t* p) {
+        uint32_t high = key << 16;
+        if (!bitmap) {
+            for (uint32_t i = 0; i < card; i++) *out++ = high | (uint32_t(p[2 * i]) | uint32_t(p[2 * i + 1]) << 8);
+            return;
+        }
+        for (uint32_t w = 0; w < ROARING_WORDS; w++) {
+            uint64_t word;
+            std::memcpy(&word, p + (size_t)w * 8, 8);
+            while (word) {
+                *out++ = high | (w * 64 + (uint32_t)__builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    });
+}
+
+inline void decode_postings(Codec codec, const uint8_t* list, size_t len, uint32_t df, std::vector<uint32_t>& out) {
+    out.resize(df);
+    if (df == 0) return;
+    if (codec == Codec::Raw) {
+        std::memcpy(out.data(), list, (size_t)df * sizeof(uint32_t));
+        return;
+    }
+    if (codec == Codec::Roaring) {
+        roaring_decode(list, out.data());
+        return;
+    }
+    uint32_t nblocks = svb_num_blocks(df);
+    for (uint32_t b = 0; b < nblocks; b++) {
+        svb_decode_block(list, len, df, b, out.data() + (size_t)b * POSTINGS_BLOCK);
+    }
+}
@@ -0,0 +1,1611 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "cache.hpp"
+#include "doc_cursor.hpp"
+#include "doc_store.hpp"
+#include "index_format.hpp"
+#include "parallel.hpp"
+#include "positions.hpp"
+#include "ranking.hpp"
+#include "roaring.hpp"
+#include "segments.hpp"
+#include "setops.hpp"
+
+// Query engine of boolean_search, shared with bench_search: tokenizer, parser
+// and planner, boolean evaluation over DocLists, ranked mode, and the two entry
+// points answer_index / answer_segments that turn one query line into the
+// reply block (RESULTS n ... END, PLAN ... END or ERROR ...).
+
+// Sorted doc ids: borrowed from the mapped index (raw lists), owned, shared
+// with the postings cache, a compressed list that is decoded only when an
+// operator needs all of it, or a Roaring container set for dense terms and NOT results.
+struct DocList {
+    std::vector<uint32_t> own;
+    PostingsCache::List shared;
+    const uint32_t* ptr = nullptr;
+    size_t n = 0;
+    PostingsView packed;
+    bool is_packed = false;
+    Roaring bits;
+    bool is_bits = false;
+
+    DocList() = default;
+    explicit DocList(std::vector<uint32_t> v) : own(std::move(v)), ptr(own.data()), n(own.size()) {}
+    DocList(const uint32_t* p, size_t count) : ptr(p), n(count) {}
+    explicit DocList(PostingsCache::List v) : shared(std::move(v)), ptr(shared->data()), n(shared->size()) {}
+    explicit DocList(const PostingsView& v) : n(v.df), packed(v), is_packed(true) {}
+    explicit DocList(Roaring r) : n(r.cardinality()), bits(std::move(r)), is_bits(true) {}
+    DocList(DocList&&) = default;
+    DocList& operator=(DocList&&) = default;
+    DocList(const DocList&) = delete;
+    DocList& operator=(const DocList&) = delete;
+
+    // Converts any representation to a sorted array.
+    DocList& unpack() {
+        if (is_bits) {
+            bits.to_sorted(own);
+            bits = Roaring();
+            ptr = own.data();
+            is_bits = false;
+        }
+        if (is_packed) {
+            decode_postings(packed.codec, packed.data, packed.len, packed.df, own);
+            ptr = own.data();
+            is_packed = false;
+        }
+        return *this;
+    }
+
+    Roaring to_roaring() {
+        if (is_bits) return bits;
+        unpack();
+        return Roaring::from_sorted(ptr, n);
+    }
+
+    size_t size() const { return n; }
+    uint32_t operator[](size_t i) const { return ptr[i]; }
+    const uint32_t* begin() const { return ptr; }
+    const uint32_t* end() const { return ptr + n; }
+};
+
+inline std::string to_upper_ascii(std::string s) {
+    for (char& c : s) if (c >= 'a' && c <= 'z') c = char(c - 'a' + 'A');
+    return s;
+}
+
+inline std::string to_lower_ascii(std::string s) {
+    for (char& c : s) if (c >= 'A' && c <= 'Z') c = char(c - 'A' + 'a');
+    return s;
+}
+
+// A quoted phrase is one token that keeps its opening quote: "super mario
+inline std::vector<std::string> tokenize_query(const std::string& q) {
+    std::vector<std::string> out;
+    std::string cur;
+    for (size_t i = 0; i < q.size(); i++) {
+        char c = q[i];
+        if (c == '"') {
+            if (!cur.empty()) { out.push_back(cur); cur.clear(); }
+            size_t close = q.find('"', i + 1);
+            if (close == std::string::npos) throw std::runtime_error("Unterminated phrase");
+            out.push_back(q.substr(i, close - i));
+            i = close;
+        } else if (std::isspace((unsigned char)c)) {
+            if (!cur.empty()) { out.push_back(cur); cur.clear(); }
+        } else if (c == '(' || c == ')') {
+            if (!cur.empty()) { out.push_back(cur); cur.clear(); }
+            out.push_back(std::string(1, c));
+        } else {
+            cur.push_back(c);
+        }
+    }
+    if (!cur.empty()) out.push_back(cur);
+    return out;
+}
+
+// A compressed list this many times longer than the other side is intersected
+// through its skip pointers instead of being decoded.
+static constexpr size_t SKIP_RATIO = GALLOP_RATIO;
+
+inline DocList op_and(DocList& a, DocList& b) {
+    if (a.is_bits && b.is_bits) return DocList(Roaring::op_and(a.bits, b.bits));
+    if (a.is_bits || b.is_bits) {
+        DocList& bits = a.is_bits ? a : b;
+        DocList& arr = a.is_bits ? b : a;
+        arr.unpack();
+        std::vector<uint32_t> r;
+        bits.bits.filter(arr.begin(), arr.size(), true, r);
+        return DocList(std::move(r));
+    }
+
+    DocList& small = a.size() <= b.size() ? a : b;
+    DocList& large = a.size() <= b.size() ? b : a;
+    small.unpack();
+
+    std::vector<uint32_t> r;
+    if (large.is_packed && large.size() >= small.size() * SKIP_RATIO) {
+        const PostingsView& v = large.packed;
+        intersect_packed(small.begin(), small.size(), v.data, v.len, v.df, r);
+    } else {
+        large.unpack();
+        intersect_adaptive(small.begin(), small.size(), large.begin(), large.size(), r);
+    }
+    return DocList(std::move(r));
+}
+
+inline DocList op_or(DocList& a, DocList& b) {
+    if (a.is_bits || b.is_bits) return DocList(Roaring::op_or(a.to_roaring(), b.to_roaring()));
+    a.unpack();
+    b.unpack();
+    std::vector<uint32_t> r;
+    r.reserve(a.size() + b.size());
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (a[i] == b[j]) { r.push_back(a[i]); i++; j++; }
+        else if (a[i] < b[j]) { r.push_back(a[i]); i++; }
+        else { r.push_back(b[j]); j++; }
+    }
+    while (i < a.size()) r.push_back(a[i++]);
+    while (j < b.size()) r.push_back(b[j++]);
+    r.erase(std::unique(r.begin(), r.end()), r.end());
+    return DocList(std::move(r));
+}
+
+// Union of any number of lists in one pass instead of n - 1 pairwise merges
+// that copy the growing result each time. Sparse inputs go through a min-heap
+// of list heads, O(total log n); when the postings are dense in their doc range
+// (wildcards over a common prefix, long ORs) they are set in a bitmap of that
+// range instead, O(total + range / 64). With a container set among the lists
+// all of them are united as Roaring, as op_or does.
+inline DocList op_or_n(std::vector<DocList>& lists) {
+    if (lists.empty()) return DocList();
+    if (lists.size() == 1) return std::move(lists[0]);
+    if (lists.size() == 2) return op_or(lists[0], lists[1]);
+    if (std::any_of(lists.begin(), lists.end(), [](const DocList& l) { return l.is_bits; })) {
+        Roaring u;
+        for (auto& l : lists) u = Roaring::op_or(u, l.to_roaring());
+        return DocList(std::move(u));
+    }
+    size_t total = 0;
+    uint32_t lo = UINT32_MAX, hi = 0;
+    for (auto& l : lists) {
+        l.unpack();
+        if (!l.size()) continue;
+        total += l.size();
+        lo = std::min(lo, l[0]);
+        hi = std::max(hi, l[l.size() - 1]);
+    }
+    std::vector<uint32_t> r;
+    if (total == 0) return DocList(std::move(r));
+
+    if (total >= ((uint64_t)hi - lo) / 16) {
+        std::vector<uint64_t> bits(((size_t)hi - lo) / 64 + 1, 0);
+        for (const auto& l : lists) {
+            for (uint32_t d : l) bits[(d - lo) >> 6] |= uint64_t(1) << ((d - lo) & 63);
+        }
+        for (size_t w = 0; w < bits.size(); w++) {
+            for (uint64_t x = bits[w]; x; x &= x - 1) r.push_back(lo + (uint32_t)(w * 64 + __builtin_ctzll(x)));
+        }
+        return DocList(std::move(r));
+    }
+
+    // heap[0] is the smallest head; it is advanced in place and sifted down
+    struct Head {
+        uint32_t doc;
+        const uint32_t* next;
+        const uint32_t* end;
+    };
+    std::vector<Head> heap;
+    for (const auto& l : lists) {
+        if (l.size()) heap.push_back({l[0], l.begin() + 1, l.end()});
+    }
+    auto later = [](const Head& a, const Head& b) { return a.doc > b.doc; };
+    std::make_heap(heap.begin(), heap.end(), later);
+    r.reserve(total);
+    while (!heap.empty()) {
+        Head& top = heap.front();
+        if (r.empty() || r.back() != top.doc) r.push_back(top.doc);
+        if (top.next == top.end) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            heap.pop_back();
+            continue;
+        }
+        top.doc = *top.next++;
+        size_t i = 0, n = heap.size();
+        for (;;) {
+            size_t c = 2 * i + 1;
+            if (c >= n) break;
+            if (c + 1 < n && heap[c + 1].doc < heap[c].doc) c++;
+            if (heap[c].doc >= heap[i].doc) break;
+            std::swap(heap[c], heap[i]);
+            i = c;
+        }
+    }
+    return DocList(std::move(r));
+}
+
+// Complement against lo..hi as a container set: full bitmaps with the members
+// cleared word by word, no universe list.
+inline DocList op_not(DocList& a, uint32_t lo, uint32_t hi) {
+    return DocList(Roaring::op_not(a.to_roaring(), lo, hi));
+}
+
+// a AND NOT b, without ever building the complement of b.
+inline DocList op_andnot(DocList& a, DocList& b) {
+    if (a.is_bits) return DocList(Roaring::op_andnot(a.bits, b.to_roaring()));
+    a.unpack();
+    if (b.is_bits) {
+        std::vector<uint32_t> r;
+        b.bits.filter(a.begin(), a.size(), false, r);
+        return DocList(std::move(r));
+    }
+    std::vector<uint32_t> r;
+    if (b.is_packed && b.size() >= a.size() * SKIP_RATIO) {
+        const PostingsView& v = b.packed;
+        subtract_packed(a.begin(), a.size(), v.data, v.len, v.df, r);
+    } else {
+        b.unpack();
+        subtract_adaptive(a.begin(), a.size(), b.begin(), b.size(), r);
+    }
+    return DocList(std::move(r));
+}
+
+inline DocList read_postings(const Index& index, const DictEntry& e) {
+    PostingsView v = index.postings(e);
+    if (v.df == 0) return DocList();
+    if (v.codec == Codec::Raw) return DocList(v.raw_docs(), v.df);
+    if (v.codec == Codec::Roaring) return DocList(Roaring::from_packed(v.data));
+    return DocList(v);
+}
+
+// The part of a term's list inside [lo, hi], for doc-range sharded evaluation:
+// raw lists are sliced in place, svb lists decode only the blocks that overlap
+// the range and Roaring lists copy only the containers of the range.
+inline DocList read_postings_range(const Index& index, const DictEntry& e, uint32_t lo, uint32_t hi) {
+    PostingsView v = index.postings(e);
+    if (v.df == 0) return DocList();
+    if (v.codec == Codec::Raw) {
+        const uint32_t* b = std::lower_bound(v.raw_docs(), v.raw_docs() + v.df, lo);
+        const uint32_t* end = std::upper_bound(b, v.raw_docs() + v.df, hi);
+        return DocList(b, (size_t)(end - b));
+    }
+    if (v.codec == Codec::Roaring) return DocList(Roaring::from_packed(v.data, lo, hi));
+    std::vector<uint32_t> docs;
+    svb_decode_range(v.data, v.len, v.df, lo, hi, docs);
+    return DocList(std::move(docs));
+}
+
+// Query tree. AND/OR are n-ary after planning; NOT has exactly one child.
+// PHRASE has two or more TERM kids in query order, NEAR/dist exactly two.
+// PATTERN is a wildcard term (prefix*, *suffix or prefix*suffix) in `term`;
+// FUZZY is word~dist, the word in `term`. plan() gives both the matching terms
+// of the queried index as TERM kids.
+struct Node {
+    enum class Kind { Term, And, Or, Not, Phrase, Near, Pattern, Fuzzy };
+
+    Kind kind = Kind::Term;
+    std::string term;
+    std::vector<Node> kids;
+    uint32_t dist = 0; // NEAR/dist, word~dist
+    uint64_t est = 0;  // estimated result size, filled by plan()
+};
+
+// A string of decimal digits as a number; throws instead of wrapping above max.
+inline uint64_t parse_number(const std::string& digits, uint64_t max, const std::string& what) {
+    uint64_t v = 0;
+    for (char c : digits) {
+        uint64_t d = (uint64_t)(c - '0');
+        if (v > (max - d) / 10) throw std::runtime_error(what + " out of range (max " + std::to_string(max) + ")");
+        v = v * 10 + d;
+    }
+    return v;
+}
+
+// NEAR/k (any case); a bare "near" is a term.
+inline bool parse_near_op(const std::string& tok, uint32_t& dist) {
+    std::string u = to_upper_ascii(tok);
+    if (u.size() < 6 || u.compare(0, 5, "NEAR/") != 0) return false;
+    if (!std::all_of(u.begin() + 5, u.end(), [](char c) { return c >= '0' && c <= '9'; })) return false;
+    dist = (uint32_t)parse_number(u.substr(5), UINT32_MAX, "NEAR distance " + u.substr(5));
+    if (dist == 0) throw std::runtime_error("NEAR distance must be at least 1");
+    return true;
+}
+
+class Parser {
+public:
+    explicit Parser(const std::vector<std::string>& toks) : t(toks) {}
+
+    Node parse() {
+        pos = 0;
+        auto r = parse_or();
+        if (pos != t.size()) throw std::runtime_error("Unexpected token at end: " + t[pos]);
+        return r;
+    }
+
+private:
+    const std::vector<std::string>& t;
+    size_t pos = 0;
+
+    bool match_op(const std::string& op) {
+        if (pos >= t.size()) return false;
+        if (to_upper_ascii(t[pos]) == op) { pos++; return true; }
+        return false;
+    }
+
+    bool match(const std::string& s) {
+        if (pos >= t.size()) return false;
+        if (t[pos] == s) { pos++; return true; }
+        return false;
+    }
+
+    static Node binary(Node::Kind kind, Node left, Node right) {
+        Node n;
+        n.kind = kind;
+        n.kids.push_back(std::move(left));
+        n.kids.push_back(std::move(right));
+        return n;
+    }
+
+    Node parse_primary() {
+        if (match("(")) {
+            auto r = parse_or();
+            if (!match(")")) throw std::runtime_error("Expected ')'");
+            return r;
+        }
+        if (pos >= t.size()) throw std::runtime_error("Unexpected end");
+
+        std::string u = to_upper_ascii(t[pos]);
+        uint32_t dist;
+        if (u == "AND" || u == "OR" || u == "NOT" || parse_near_op(t[pos], dist)) {
+            throw std::runtime_error("Expected term, got operator: " + t[pos]);
+        }
+        if (t[pos][0] == '"') return phrase(t[pos++].substr(1));
+        Node n;
+        n.term = to_lower_ascii(t[pos++]);
+        if (n.term.find('*') != std::string::npos) {
+            if (std::count(n.term.begin(), n.term.end(), '*') != 1 || n.term == "*") {
+                throw std::runtime_error("Unsupported wildcard: " + n.term + " (expected prefix*, *suffix or prefix*suffix)");
+            }
+            n.kind = Node::Kind::Pattern;
+        }
+        size_t tilde = n.term.find('~');
+        if (tilde != std::string::npos) {
+            std::string d = n.term.substr(tilde + 1);
+            if (n.kind == Node::Kind::Pattern || tilde == 0 || (d != "1" && d != "2")) {
+                throw std::runtime_error("Unsupported fuzzy term: " + n.term + " (expected word~1 or word~2)");
+            }
+            n.kind = Node::Kind::Fuzzy;
+            n.dist = (uint32_t)(d[0] - '0');
+            n.term.resize(tilde);
+        }
+        return n;
+    }
+
+    // A one-word phrase is just a term.
+    static Node phrase(const std::string& text) {
+        Node n;
+        n.kind = Node::Kind::Phrase;
+        std::istringstream ss(text);
+        std::string w;
+        while (ss >> w) {
+            Node k;
+            k.term = to_lower_ascii(w);
+            n.kids.push_back(std::move(k));
+        }
+        if (n.kids.empty()) throw std::runtime_error("Empty phrase");
+        if (n.kids.size() == 1) return std::move(n.kids[0]);
+        return n;
+    }
+
+    Node parse_near() {
+        auto left = parse_primary();
+        uint32_t dist;
+        while (pos < t.size() && parse_near_op(t[pos], dist)) {
+            pos++;
+            auto right = parse_primary();
+            if (left.kind != Node::Kind::Term || right.kind != Node::Kind::Term) {
+                throw std::runtime_error("NEAR/k operands must be terms");
+            }
+            left = binary(Node::Kind::Near, std::move(left), std::move(right));
+            left.dist = dist;
+        }
+        return left;
+    }
+
+    Node parse_not() {
+        if (match_op("NOT")) {
+            Node n;
+            n.kind = Node::Kind::Not;
+            n.kids.push_back(parse_not());
+            return n;
+        }
+        return parse_near();
+    }
+
+    Node parse_and() {
+        auto left = parse_not();
+        while (match_op("AND")) {
+            left = binary(Node::Kind::And, std::move(left), parse_not());
+        }
+        return left;
+    }
+
+    Node parse_or() {
+        auto left = parse_and();
+        while (match_op("OR")) {
+            left = binary(Node::Kind::Or, std::move(left), parse_and());
+        }
+        return left;
+    }
+};
+
+// A wildcard matching more terms than this is an error rather than a huge union.
+static constexpr size_t MAX_PATTERN_TERMS = 4096;
+
+// A fuzzy term keeps at most this many of its matches: a short word~2 can be
+// close to hundreds of terms, and each one is another list in the union.
+static constexpr size_t MAX_FUZZY_TERMS = 64;
+
+// The terms `ids` (ascending) become the TERM kids of n.
+inline void set_expansion(Node& n, const Index& index, const std::vector<uint32_t>& ids) {
+    n.kids.clear();
+    uint64_t sum = 0;
+    std::string buf;
+    for (uint32_t id : ids) {
+        Node k;
+        k.term = std::string(index.term(id, buf));
+        k.est = index.entry(id).df;
+        sum += k.est;
+        n.kids.push_back(std::move(k));
+    }
+    n.est = std::min<uint64_t>(sum, index.maxdoc);
+}
+
+// The kids of a PATTERN become the matching terms of `index`, in dictionary order.
+inline void expand_pattern(Node& n, const Index& index) {
+    std::string_view p = n.term;
+    size_t star = p.find('*');
+    std::vector<uint32_t> ids;
+    if (!index.dict().match(p.substr(0, star), p.substr(star + 1), MAX_PATTERN_TERMS, ids)) {
+        throw std::runtime_error("Wildcard " + n.term + " matches more than " + std::to_string(MAX_PATTERN_TERMS) +
+                                 " terms");
+    }
+    set_expansion(n, index, ids);
+}
+
+// The kids of a FUZZY node become the terms of `index` within its edit
+// distance, in dictionary order. Of more than MAX_FUZZY_TERMS the closest are
+// kept, the more frequent first among equally close ones.
+inline void expand_fuzzy(Node& n, const Index& index) {
+    std::vector<std::pair<uint32_t, uint32_t>> found; // (id, distance)
+    index.dict().fuzzy(n.term, n.dist, found);
+    if (found.size() > MAX_FUZZY_TERMS) {
+        auto closer = [&](const std::pair<uint32_t, uint32_t>& a, const std::pair<uint32_t, uint32_t>& b) {
+            if (a.second != b.second) return a.second < b.second;
+            uint32_t da = index.entry(a.first).df, db = index.entry(b.first).df;
+            return da != db ? da > db : a.first < b.first;
+        };
+        std::nth_element(found.begin(), found.begin() + MAX_FUZZY_TERMS, found.end(), closer);
+        found.resize(MAX_FUZZY_TERMS);
+    }
+    std::vector<uint32_t> ids;
+    for (const auto& f : found) ids.push_back(f.first);
+    std::sort(ids.begin(), ids.end());
+    set_expansion(n, index, ids);
+}
+
+// Flattens AND/OR chains into n-ary nodes, removes double negation, expands
+// wildcards and fuzzy terms, estimates cardinalities from df and orders
+// operands: AND evaluates its positive operands by ascending size and then
+// subtracts the negated ones, largest first.
+inline void plan(Node& n, const Index& index) {
+    if (n.kind == Node::Kind::Term) {
+        int64_t id = index.find(n.term);
+        n.est = id < 0 ? 0 : index.entry((uint32_t)id).df;
+        return;
+    }
+    if (n.kind == Node::Kind::Pattern) {
+        expand_pattern(n, index);
+        return;
+    }
+    if (n.kind == Node::Kind::Fuzzy) {
+        expand_fuzzy(n, index);
+        return;
+    }
+
+    for (auto& k : n.kids) plan(k, index);
+
+    // positional operators keep their term order; at most as many docs as the rarest term
+    if (n.kind == Node::Kind::Phrase || n.kind == Node::Kind::Near) {
+        n.est = index.maxdoc;
+        for (const auto& k : n.kids) n.est = std::min(n.est, k.est);
+        return;
+    }
+
+    if (n.kind == Node::Kind::Not) {
+        if (n.kids[0].kind == Node::Kind::Not) {
+            Node inner = std::move(n.kids[0].kids[0]);
+            n = std::move(inner);
+            return;
+        }
+        uint64_t c = n.kids[0].est;
+        n.est = c >= index.maxdoc ? 0 : index.maxdoc - c;
+        return;
+    }
+
+    std::vector<Node> flat;
+    for (auto& k : n.kids) {
+        if (k.kind == n.kind) {
+            for (auto& g : k.kids) flat.push_back(std::move(g));
+        } else {
+            flat.push_back(std::move(k));
+        }
+    }
+    n.kids = std::move(flat);
+
+    if (n.kind == Node::Kind::Or) {
+        std::stable_sort(n.kids.begin(), n.kids.end(), [](const Node& a, const Node& b) { return a.est < b.est; });
+        uint64_t sum = 0;
+        for (const auto& k : n.kids) sum += k.est;
+        n.est = std::min<uint64_t>(sum, index.maxdoc);
+        return;
+    }
+
+    auto negated = [](const Node& k) { return k.kind == Node::Kind::Not; };
+    std::stable_sort(n.kids.begin(), n.kids.end(), [&](const Node& a, const Node& b) {
+        if (negated(a) != negated(b)) return !negated(a);
+        if (negated(a)) return a.kids[0].est > b.kids[0].est;
+        return a.est < b.est;
+    });
+    n.est = index.maxdoc;
+    for (const auto& k : n.kids) n.est = std::min(n.est, k.est);
+}
+
+inline void explain(const Node& n, int depth, bool minus, std::ostream& out) {
+    out << std::string((size_t)depth * 2, ' ');
+    if (minus) {
+        out << "MINUS est=" << n.kids[0].est << "\n";
+        explain(n.kids[0], depth + 1, false, out);
+        return;
+    }
+    switch (n.kind) {
+        case Node::Kind::Term: out << "TERM " << n.term << " df=" << n.est << "\n"; return;
+        case Node::Kind::Not: out << "NOT est=" << n.est << "\n"; break;
+        case Node::Kind::Or: out << "OR est=" << n.est << "\n"; break;
+        case Node::Kind::Phrase: out << "PHRASE est=" << n.est << "\n"; break;
+        case Node::Kind::Near: out << "NEAR/" << n.dist << " est=" << n.est << "\n"; break;
+        case Node::Kind::Pattern:
+        case Node::Kind::Fuzzy: {
+            if (n.kind == Node::Kind::Pattern) out << "PATTERN " << n.term;
+            else out << "FUZZY " << n.term << "~" << n.dist;
+            out << " terms=" << n.kids.size() << " est=" << n.est << "\n";
+            size_t shown = std::min<size_t>(n.kids.size(), 10);
+            for (size_t i = 0; i < shown; i++) explain(n.kids[i], depth + 1, false, out);
+            if (shown < n.kids.size()) {
+                out << std::string((size_t)(depth + 1) * 2, ' ') << "... " << n.kids.size() - shown << " more\n";
+            }
+            return;
+        }
+        case Node::Kind::And: {
+            bool has_positive = !n.kids.empty() && n.kids[0].kind != Node::Kind::Not;
+            out << (has_positive ? "AND" : "NOT-ALL") << " est=" << n.est << "\n";
+            for (const auto& k : n.kids) explain(k, depth + 1, has_positive && k.kind == Node::Kind::Not, out);
+            return;
+        }
+    }
+    for (const auto& k : n.kids) explain(k, depth + 1, false, out);
+}
+
+// Canonical text of a parsed query, the result cache key: AND/OR chains are
+// flattened, their operands deduplicated and sorted, NEAR operands sorted and
+// double negation dropped, so "b AND (a AND b)" and "a and b" share one entry.
+inline std::string canonical(const Node& n) {
+    switch (n.kind) {
+        case Node::Kind::Term:
+        case Node::Kind::Pattern: return n.term;
+        case Node::Kind::Fuzzy: return n.term + "~" + std::to_string(n.dist);
+        case Node::Kind::Not:
+            if (n.kids[0].kind == Node::Kind::Not) return canonical(n.kids[0].kids[0]);
+            return "(NOT " + canonical(n.kids[0]) + ")";
+        case Node::Kind::Phrase: {
+            std::string r = "(PHRASE";
+            for (const auto& k : n.kids) r += " " + k.term;
+            return r + ")";
+        }
+        case Node::Kind::Near: {
+            std::string a = n.kids[0].term, b = n.kids[1].term;
+            if (b < a) std::swap(a, b);
+            return "(NEAR/" + std::to_string(n.dist) + " " + a + " " + b + ")";
+        }
+        case Node::Kind::And:
+        case Node::Kind::Or: break;
+    }
+    std::vector<std::string> ops;
+    std::vector<const Node*> stack{&n};
+    while (!stack.empty()) {
+        const Node* x = stack.back();
+        stack.pop_back();
+        for (const auto& k : x->kids) {
+            if (k.kind == n.kind) stack.push_back(&k);
+            else ops.push_back(canonical(k));
+        }
+    }
+    std::sort(ops.begin(), ops.end());
+    ops.erase(std::unique(ops.begin(), ops.end()), ops.end());
+    if (ops.size() == 1) return ops[0];
+    std::string r = n.kind == Node::Kind::And ? "(AND" : "(OR";
+    for (const auto& o : ops) r += " " + o;
+    return r + ")";
+}
+
+// Per-query profile (boolean_search --stats), printed as a STATS line after
+// the reply. Everything is collected only when a QueryStats is passed, so
+// without --stats the evaluator does no clock reads or counting.
+struct QueryStats {
+    double total_us = 0;
+    double parse_us = 0;    // tokenize + parse
+    double plan_us = 0;     // plan(): dictionary lookups for df, flattening, ordering
+    double lookup_us = 0;   // dictionary lookups during evaluation
+    double postings_us = 0; // fetching term lists (cache, Roaring containers, svb when cached)
+    double ops_us = 0;      // AND / OR / NOT operators, including lazy decoding of packed lists
+    double rank_us = 0;     // BM25 top-k
+    double format_us = 0;   // reply text
+    uint64_t lists = 0, bytes = 0; // term lists fetched and their postings bytes
+    uint64_t and_ops = 0, and_in = 0, or_ops = 0, or_in = 0, not_ops = 0, not_in = 0; // calls, operand elements
+    uint64_t scored = 0;
+    bool cached = false; // reply from the result cache
+    uint32_t shards = 1; // doc ranges the query was evaluated in; times are then summed over them
+    std::vector<std::pair<std::string, uint64_t>> nodes; // result size per evaluated node, pre-order
+
+    // Adds the evaluation profile of one doc-range shard; node sizes add up
+    // where the shards evaluated the same nodes.
+    void merge(const QueryStats& o) {
+        lookup_us += o.lookup_us;
+        postings_us += o.postings_us;
+        ops_us += o.ops_us;
+        lists += o.lists;
+        bytes += o.bytes;
+        and_ops += o.and_ops;
+        and_in += o.and_in;
+        or_ops += o.or_ops;
+        or_in += o.or_in;
+        not_ops += o.not_ops;
+        not_in += o.not_in;
+        for (size_t i = 0; i < o.nodes.size(); i++) {
+            if (i < nodes.size() && nodes[i].first == o.nodes[i].first) nodes[i].second += o.nodes[i].second;
+            else nodes.push_back(o.nodes[i]);
+        }
+    }
+
+    void print(std::ostream& out) const {
+        char buf[512];
+        std::snprintf(buf, sizeof(buf),
+                      "STATS total_us=%.1f parse_us=%.1f plan_us=%.1f lookup_us=%.1f postings_us=%.1f ops_us=%.1f "
+                      "rank_us=%.1f format_us=%.1f lists=%llu bytes=%llu and=%llu/%llu or=%llu/%llu not=%llu/%llu "
+                      "scored=%llu cached=%d shards=%u",
+                      total_us, parse_us, plan_us, lookup_us, postings_us, ops_us, rank_us, format_us,
+                      (unsigned long long)lists, (unsigned long long)bytes, (unsigned long long)and_ops,
+                      (unsigned long long)and_in, (unsigned long long)or_ops, (unsigned long long)or_in,
+                      (unsigned long long)not_ops, (unsigned long long)not_in, (unsigned long long)scored, cached ? 1 : 0, shards);
+        out << buf << " nodes=";
+        for (size_t i = 0; i < nodes.size(); i++) out << (i ? "," : "") << nodes[i].first << ":" << nodes[i].second;
+        out << "\n";
+    }
+};
+
+// Adds the time until destruction to *acc; a null acc costs no clock read.
+class StatTimer {
+public:
+    explicit StatTimer(double* acc) : acc_(acc) {
+        if (acc_) t0_ = std::chrono::steady_clock::now();
+    }
+    ~StatTimer() {
+        if (acc_) *acc_ += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0_).count();
+    }
+    StatTimer(const StatTimer&) = delete;
+    StatTimer& operator=(const StatTimer&) = delete;
+
+private:
+    double* acc_;
+    std::chrono::steady_clock::time_point t0_;
+};
+
+// Cumulative counters since start, shared by all workers. Queries, errors and
+// latency are always counted; the breakdown only for queries run with stats.
+struct QueryCounters {
+    std::atomic<uint64_t> queries{0}, errors{0}, cached{0}, profiled{0};
+    std::atomic<uint64_t> total_ns{0}, parse_ns{0}, plan_ns{0}, lookup_ns{0}, postings_ns{0}, ops_ns{0}, rank_ns{0},
+        format_ns{0};
+    std::atomic<uint64_t> lists{0}, bytes{0}, and_in{0}, or_in{0}, not_in{0}, scored{0};
+
+    void add(double total_us, bool ok, const QueryStats* st) {
+        auto ns = [](double us) { return (uint64_t)(us * 1000); };
+        queries++;
+        if (!ok) errors++;
+        total_ns += ns(total_us);
+        if (!st) return;
+        profiled++;
+        if (st->cached) cached++;
+        parse_ns += ns(st->parse_us);
+        plan_ns += ns(st->plan_us);
+        lookup_ns += ns(st->lookup_us);
+        postings_ns += ns(st->postings_us);
+        ops_ns += ns(st->ops_us);
+        rank_ns += ns(st->rank_us);
+        format_ns += ns(st->format_us);
+        lists += st->lists;
+        bytes += st->bytes;
+        and_in += st->and_in;
+        or_in += st->or_in;
+        not_in += st->not_in;
+        scored += st->scored;
+    }
+
+    void print(std::ostream& out) const {
+        auto ms = [](const std::atomic<uint64_t>& ns) { return std::to_string(ns.load() / 1000000); };
+        out << "COUNTERS queries=" << queries << " errors=" << errors << " total_ms=" << ms(total_ns)
+            << " profiled=" << profiled << " cached=" << cached << " parse_ms=" << ms(parse_ns)
+            << " plan_ms=" << ms(plan_ns) << " lookup_ms=" << ms(lookup_ns) << " postings_ms=" << ms(postings_ns)
+            << " ops_ms=" << ms(ops_ns) << " rank_ms=" << ms(rank_ns) << " format_ms=" << ms(format_ns)
+            << " lists=" << lists << " bytes=" << bytes << " and_in=" << and_in << " or_in=" << or_in
+            << " not_in=" << not_in << " scored=" << scored << "\n";
+    }
+};
+
+// `live`, when given, is the universe of NOT instead of 1..maxdoc (the live
+// docs of a segment); the caller still has to drop deleted docs from the result.
+// PHRASE and NEAR need `positions` of the same index. With a `cache`, decoded
+// lists of hot terms are shared through it; `scope` tells the segments apart.
+// `stats`, when given, collects the per-query profile.
+class Evaluator {
+public:
+    explicit Evaluator(const Index& index, const Roaring* live = nullptr, const Positions* positions = nullptr,
+                       PostingsCache* cache = nullptr, uint64_t scope = 0, QueryStats* stats = nullptr)
+        : index(index), live(live), positions(positions), cache(cache), scope(scope), stats(stats) {}
+
+    // Evaluates only the docs in [lo, hi]: every list is cut to the range and
+    // NOT complements within it (one doc-range shard of a query).
+    void restrict_to(uint32_t lo, uint32_t hi) {
+        lo_ = lo;
+        hi_ = hi;
+        ranged_ = true;
+    }
+
+    DocList eval(const Node& n) {
+        if (!stats) return eval_node(n);
+        size_t slot = stats->nodes.size();
+        stats->nodes.emplace_back(node_label(n), 0);
+        DocList r = eval_node(n);
+        stats->nodes[slot].second = r.size();
+        return r;
+    }
+
+private:
+    const Index& index;
+    const Roaring* live;
+    const Positions* positions;
+    PostingsCache* cache;
+    uint64_t scope;
+    QueryStats* stats;
+    uint32_t lo_ = 0, hi_ = UINT32_MAX;
+    bool ranged_ = false;
+
+    static std::string node_label(const Node& n) {
+        switch (n.kind) {
+            case Node::Kind::Term:
+            case Node::Kind::Pattern: return n.term;
+            case Node::Kind::Fuzzy: return n.term + "~" + std::to_string(n.dist);
+            case Node::Kind::And: return "AND";
+            case Node::Kind::Or: return "OR";
+            case Node::Kind::Not: return "NOT";
+            case Node::Kind::Phrase: return "PHRASE";
+            case Node::Kind::Near: return "NEAR/" + std::to_string(n.dist);
+        }
+        return "?";
+    }
+
+    DocList eval_node(const Node& n) {
+        switch (n.kind) {
+            case Node::Kind::Term: return postings_for_term(n.term);
+            case Node::Kind::Not: {
+                auto r = eval(n.kids[0]);
+                return complement(r);
+            }
+            case Node::Kind::Or: {
+                std::vector<DocList> lists;
+                for (const auto& k : n.kids) lists.push_back(eval(k));
+                return run_or_n(lists);
+            }
+            case Node::Kind::Pattern:
+            case Node::Kind::Fuzzy: {
+                std::vector<DocList> lists;
+                for (const auto& k : n.kids) lists.push_back(postings_for_term(k.term));
+                return run_or_n(lists);
+            }
+            case Node::Kind::And: return eval_and(n);
+            case Node::Kind::Phrase:
+            case Node::Kind::Near: return eval_positional(n);
+        }
+        return DocList();
+    }
+
+    // The operators, counted and timed when profiling.
+    DocList run_and(DocList& a, DocList& b) {
+        if (!stats) return op_and(a, b);
+        stats->and_ops++;
+        stats->and_in += a.size() + b.size();
+        StatTimer t(&stats->ops_us);
+        return op_and(a, b);
+    }
+
+    DocList run_or_n(std::vector<DocList>& lists) {
+        if (!stats) return op_or_n(lists);
+        stats->or_ops++;
+        for (const auto& l : lists) stats->or_in += l.size();
+        StatTimer t(&stats->ops_us);
+        return op_or_n(lists);
+    }
+
+    DocList run_andnot(DocList& a, DocList& b) {
+        if (!stats) return op_andnot(a, b);
+        stats->not_ops++;
+        stats->not_in += a.size() + b.size();
+        StatTimer t(&stats->ops_us);
+        return op_andnot(a, b);
+    }
+
+    DocList complement(DocList& a) {
+        if (stats) {
+            stats->not_ops++;
+            stats->not_in += a.size();
+        }
+        StatTimer t(stats ? &stats->ops_us : nullptr);
+        if (!live) return op_not(a, std::max(1u, lo_), std::min(index.maxdoc, hi_));
+        DocList all{ranged_ ? live->slice(lo_, hi_) : Roaring(*live)};
+        return op_andnot(all, a);
+    }
+
+    DocList postings_for_term(const std::string& term) {
+        int64_t id;
+        {
+            StatTimer t(stats ? &stats->lookup_us : nullptr);
+            id = index.find(term);
+        }
+        if (id < 0) return DocList();
+        return postings((uint32_t)id);
+    }
+
+    // The list of term `id`, cut to the evaluator's range unless `whole`.
+    DocList postings(uint32_t id, bool whole = false) {
+        const DictEntry& e = index.entry(id);
+        if (stats) {
+            stats->lists++;
+            stats->bytes += e.len;
+        }
+        StatTimer t(stats ? &stats->postings_us : nullptr);
+        bool cut = ranged_ && !whole;
+        if (cache && cache->enabled() && e.codec == Codec::StreamVByte && e.df > 0) {
+            auto list = cache->get(scope, id, e.df, [&](std::vector<uint32_t>& out) {
+                PostingsView v = index.postings(e);
+                decode_postings(v.codec, v.data, v.len, v.df, out);
+            });
+            if (list) {
+                DocList r(std::move(list));
+                if (cut) {
+                    const uint32_t* b = std::lower_bound(r.begin(), r.end(), lo_);
+                    r.n = (size_t)(std::upper_bound(b, r.end(), hi_) - b);
+                    r.ptr = b;
+                }
+                return r;
+            }
+        }
+        return cut ? read_postings_range(index, e, lo_, hi_) : read_postings(index, e);
+    }
+
+    DocList eval_and(const Node& n) {
+        // only negated operands: NOT a AND NOT b == NOT (a OR b), the one place a complement is needed
+        if (n.kids[0].kind == Node::Kind::Not) {
+            std::vector<DocList> lists;
+            for (const auto& k : n.kids) lists.push_back(eval(k.kids[0]));
+            auto u = run_or_n(lists);
+            return complement(u);
+        }
+
+        auto left = eval(n.kids[0]);
+        for (size_t i = 1; i < n.kids.size() && left.size() > 0; i++) {
+            const Node& k = n.kids[i];
+            if (k.kind == Node::Kind::Not) {
+                auto right = eval(k.kids[0]);
+                left = run_andnot(left, right);
+            } else {
+                auto right = eval(k);
+                left = run_and(left, right);
+            }
+        }
+        return left;
+    }
+
+    // Doc ids first: the terms' lists are intersected, and positions are then
+    // decoded only for the remaining candidates (the rank of a candidate in each
+    // list indexes the positions stream through its block directory).
+    DocList eval_positional(const Node& n) {
+        if (!positions || !positions->loaded()) {
+            throw std::runtime_error("Phrase and NEAR queries need positions.bin (build_index --positions)");
+        }
+        const size_t m = n.kids.size();
+        std::vector<DocList> lists(m);
+        std::vector<PositionsList> pos(m);
+        for (size_t i = 0; i < m; i++) {
+            int64_t id = index.find(n.kids[i].term);
+            if (id < 0) return DocList();
+            lists[i] = postings((uint32_t)id, true); // positions are found by the rank in the whole list
+            lists[i].unpack();
+            pos[i] = positions->list((uint32_t)id);
+        }
+        StatTimer t(stats ? &stats->ops_us : nullptr);
+
+        std::vector<size_t> order(m);
+        for (size_t i = 0; i < m; i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return lists[a].size() < lists[b].size(); });
+        const DocList& first = lists[order[0]];
+        const uint32_t* from = std::lower_bound(first.begin(), first.end(), lo_);
+        std::vector<uint32_t> cand(from, std::upper_bound(from, first.end(), hi_)), next;
+        for (size_t i = 1; i < m && !cand.empty(); i++) {
+            const DocList& l = lists[order[i]];
+            next.clear();
+            intersect_adaptive(cand.data(), cand.size(), l.begin(), l.size(), next);
+            cand.swap(next);
+        }
+
+        std::vector<const uint32_t*> at(m); // monotonic rank cursors
+        for (size_t i = 0; i < m; i++) at[i] = lists[i].begin();
+        std::vector<std::vector<uint32_t>> p(m);
+        std::vector<uint32_t> r;
+        for (uint32_t d : cand) {
+            for (size_t i = 0; i < m; i++) {
+                at[i] = std::lower_bound(at[i], lists[i].end(), d);
+                pos[i].positions((uint32_t)(at[i] - lists[i].begin()), p[i]);
+            }
+            if (n.kind == Node::Kind::Phrase ? phrase_match(p) : near_match(p[0], p[1], n.dist)) r.push_back(d);
+        }
+        return DocList(std::move(r));
+    }
+};
+
+// `name` in the directory of `file`, if it exists (tf.bin, positions.bin next to the index).
+inline std::string sibling_file(const std::string& file, const std::string& name) {
+    size_t slash = file.rfind('/');
+    std::string path = (slash == std::string::npos ? "" : file.substr(0, slash + 1)) + name;
+    return std::ifstream(path).good() ? path : std::string();
+}
+
+// ---- doc-range sharding ----
+
+// One boolean query on several cores (boolean_search --shards): doc ids
+// [1, maxdoc] are cut into `shards` equal ranges, each range is evaluated on its
+// own by the `pool` (lists cut to the range, see Evaluator::restrict_to), and
+// the per-range results, sorted and disjoint, are concatenated without a merge.
+// Queries with less planned work than `min_work` (postings to read plus
+// complement sizes) stay serial: for them the hand-off costs more than it saves.
+struct ShardOptions {
+    unsigned shards = 1;
+    uint64_t min_work = 1 << 16;
+    TaskPool* pool = nullptr;
+};
+
+inline uint64_t planned_work(const Node& n, uint32_t maxdoc) {
+    if (n.kind == Node::Kind::Term) return n.est;
+    uint64_t w = n.kind == Node::Kind::Not ? maxdoc : 0;
+    for (const auto& k : n.kids) w += planned_work(k, maxdoc);
+    return w;
+}
+
+inline DocList eval_sharded(const Node& planned, const Index& index, const Positions* positions,
+                            PostingsCache* cache, const ShardOptions& so, QueryStats* stats) {
+    const unsigned n = so.shards;
+    if (n <= 1 || !so.pool || index.maxdoc < n || planned_work(planned, index.maxdoc) < so.min_work) {
+        Evaluator ev(index, nullptr, positions, cache, 0, stats);
+        return ev.eval(planned);
+    }
+    std::vector<DocList> parts(n);
+    std::vector<QueryStats> part_stats(stats ? n : 0);
+    so.pool->run(n, [&](size_t i) {
+        // the first and last range are open, so no doc can fall outside them
+        uint32_t lo = i == 0 ? 0 : (uint32_t)((uint64_t)index.maxdoc * i / n) + 1;
+        uint32_t hi = i + 1 == n ? UINT32_MAX : (uint32_t)((uint64_t)index.maxdoc * (i + 1) / n);
+        Evaluator ev(index, nullptr, positions, cache, 0, stats ? &part_stats[i] : nullptr);
+        ev.restrict_to(lo, hi);
+        parts[i] = ev.eval(planned);
+    });
+
+    StatTimer t(stats ? &stats->ops_us : nullptr);
+    size_t total = 0;
+    for (auto& p : parts) total += p.size();
+    std::vector<uint32_t> r;
+    r.reserve(total);
+    for (auto& p : parts) {
+        p.unpack();
+        r.insert(r.end(), p.begin(), p.end());
+    }
+    if (stats) {
+        stats->shards = n;
+        for (const auto& ps : part_stats) stats->merge(ps);
+    }
+    return DocList(std::move(r));
+}
+
+// ---- paged evaluation (doc_cursor.hpp) ----
+
+// LIMIT n / OFFSET m at the end of a query (either order, either or both).
+struct Page {
+    uint64_t offset = 0;
+    uint64_t limit = UINT64_MAX; // no limit
+
+    bool paged() const { return offset != 0 || limit != UINT64_MAX; }
+};
+
+// Cursor tree of a planned query. NOT is the complement within 1..maxdoc; a
+// segment filters the root by its live docs (MemberCursor), which makes every
+// complement relative to the live docs, as in the Evaluator.
+inline CursorPtr open_cursor(const Node& n, const Index& index, const Positions* positions, QueryStats* stats) {
+    auto term = [&](const std::string& t) {
+        int64_t id;
+        {
+            StatTimer timer(stats ? &stats->lookup_us : nullptr);
+            id = index.find(t);
+        }
+        if (id < 0) return std::make_unique<PostingsCursor>(PostingsView());
+        const DictEntry& e = index.entry((uint32_t)id);
+        if (stats) {
+            stats->lists++;
+            stats->bytes += e.len;
+        }
+        return std::make_unique<PostingsCursor>(index.postings(e));
+    };
+    std::vector<CursorPtr> kids, excluded;
+    switch (n.kind) {
+        case Node::Kind::Term: return term(n.term);
+        case Node::Kind::Not: return std::make_unique<NotCursor>(open_cursor(n.kids[0], index, positions, stats), 1, index.maxdoc);
+        case Node::Kind::Or:
+            for (const auto& k : n.kids) kids.push_back(open_cursor(k, index, positions, stats));
+            return std::make_unique<OrCursor>(std::move(kids));
+        case Node::Kind::Pattern:
+        case Node::Kind::Fuzzy:
+            for (const auto& k : n.kids) kids.push_back(term(k.term));
+            return std::make_unique<OrCursor>(std::move(kids));
+        case Node::Kind::And:
+            for (const auto& k : n.kids) {
+                if (k.kind == Node::Kind::Not) excluded.push_back(open_cursor(k.kids[0], index, positions, stats));
+                else kids.push_back(open_cursor(k, index, positions, stats));
+            }
+            // only negated operands: NOT a AND NOT b == NOT (a OR b)
+            if (kids.empty()) return std::make_unique<NotCursor>(std::make_unique<OrCursor>(std::move(excluded)), 1, index.maxdoc);
+            return std::make_unique<AndCursor>(std::move(kids), std::move(excluded));
+        case Node::Kind::Phrase:
+        case Node::Kind::Near: {
+            if (!positions || !positions->loaded()) {
+                throw std::runtime_error("Phrase and NEAR queries need positions.bin (build_index --positions)");
+            }
+            std::vector<std::unique_ptr<PostingsCursor>> terms;
+            std::vector<PositionsList> pos;
+            for (const auto& k : n.kids) {
+                int64_t id = index.find(k.term);
+                if (id < 0) return term(k.term); // empty
+                terms.push_back(term(k.term));
+                pos.push_back(positions->list((uint32_t)id));
+            }
+            return std::make_unique<PositionalCursor>(std::move(terms), std::move(pos), n.kind == Node::Kind::Phrase, n.dist);
+        }
+    }
+    return term(std::string());
+}
+
+// Skips page.offset docs of the cursor and collects up to page.limit; returns
+// true when more docs follow the page.
+inline bool collect_page(DocCursor& c, const Page& page, std::vector<uint32_t>& out, QueryStats* stats) {
+    StatTimer t(stats ? &stats->ops_us : nullptr);
+    for (uint64_t i = 0; i < page.offset && c.doc() != DocCursor::END; i++) c.next();
+    for (; out.size() < page.limit && c.doc() != DocCursor::END; c.next()) out.push_back(c.doc());
+    return c.doc() != DocCursor::END;
+}
+
+// Index doc ids -> original ids of a reordered index (docmap.bin), sorted again.
+// Long lists are sorted through a bitmap of the original ids: one pass to set
+// the bits and one over the words beats std::sort once the list is more than a
+// sliver of the collection.
+inline void to_original(std::vector<uint32_t>& docs, const DocMap* map) {
+    if (!map || !map->loaded()) return;
+    const uint64_t words = ((uint64_t)map->max_original() >> 6) + 1;
+    if (docs.size() < 64 || docs.size() * 16 < words) {
+        for (uint32_t& d : docs) d = map->original(d);
+        std::sort(docs.begin(), docs.end());
+        return;
+    }
+    std::vector<uint64_t> bits(words, 0);
+    for (uint32_t d : docs) {
+        uint32_t o = map->original(d);
+        bits[o >> 6] |= 1ull << (o & 63);
+    }
+    docs.clear();
+    for (uint64_t w = 0; w < words; w++) {
+        for (uint64_t b = bits[w]; b; b &= b - 1) docs.push_back((uint32_t)(w << 6 | (uint64_t)__builtin_ctzll(b)));
+    }
+}
+
+// What a result line holds besides the doc id (boolean_search --show).
+enum class Show { Ids, Titles, Snippets };
+
+inline bool parse_show(const std::string& s, Show& out) {
+    if (s == "ids") out = Show::Ids;
+    else if (s == "titles") out = Show::Titles;
+    else if (s == "snippets") out = Show::Snippets;
+    else return false;
+    return true;
+}
+
+// Result lines of one reply: original ids of a reordered index (docmap.bin)
+// and, with --show, the title and url of each doc from store.bin, plus a
+// snippet with the query terms highlighted.
+struct ReplyFormat {
+    const DocMap* map = nullptr;
+    const DocStore* store = nullptr;
+    Show show = Show::Ids;
+    std::vector<std::string> terms; // stems to highlight
+    DocStore::Reader reader;
+
+    // \ttitle\turl[\tsnippet] of an original doc id; empty columns for a doc
+    // missing from the store, nothing at all for Show::Ids.
+    void fields(uint32_t doc, std::ostream& out) {
+        if (show == Show::Ids || !store) return;
+        std::string_view title, url, text;
+        if (!store->meta(doc, reader, title, url)) {
+            out << (show == Show::Snippets ? "\t\t\t" : "\t\t");
+            return;
+        }
+        out << '\t' << title << '\t' << url;
+        if (show != Show::Snippets) return;
+        out << '\t';
+        if (store->text(doc, reader, text)) out << make_snippet(text, terms);
+    }
+};
+
+// One page of a reordered index. Pages follow the original ids, which the
+// index order does not, so the whole result is translated and the page is cut
+// from it; returns true when more docs follow the page.
+inline bool original_page(DocList& res, const DocMap& map, const Page& page, std::vector<uint32_t>& out) {
+    res.unpack();
+    out.assign(res.begin(), res.end());
+    to_original(out, &map);
+    size_t from = (size_t)std::min<uint64_t>(page.offset, out.size());
+    size_t to = from + (size_t)std::min<uint64_t>(page.limit, out.size() - from);
+    bool more = to < out.size();
+    out.erase(out.begin() + (std::ptrdiff_t)to, out.end());
+    out.erase(out.begin(), out.begin() + (std::ptrdiff_t)from);
+    return more;
+}
+
+// RESULTS n, with MORE when the page was cut short of the full result; `docs`
+// are original ids.
+inline void print_page(const std::vector<uint32_t>& docs, bool more, std::ostream& out, ReplyFormat* fmt = nullptr) {
+    out << "RESULTS " << docs.size() << (more ? " MORE" : "") << "\n";
+    for (uint32_t d : docs) {
+        out << d;
+        if (fmt) fmt->fields(d, out);
+        out << "\n";
+    }
+    out << "END\n";
+}
+
+// ---- ranked mode (ranking.hpp) ----
+
+struct RankOptions {
+    size_t k = 0; // 0: boolean results
+    RankAlgo algo = RankAlgo::BlockMaxWand;
+    uint64_t max_results = 0; // 0: no cap on the docs of a reply
+    Show show = Show::Ids;
+    const DocStore* store = nullptr; // for Show::Titles and Show::Snippets
+};
+
+inline ReplyFormat reply_format(const RankOptions& ro, const DocMap* map) {
+    ReplyFormat f;
+    f.map = map;
+    f.store = ro.store;
+    f.show = ro.show;
+    return f;
+}
+
+// A term, a wildcard, a fuzzy term or an OR of those: ranked by top-k pruning
+// over the term cursors.
+inline bool is_disjunction(const Node& n) {
+    auto terms = [](const Node& k) {
+        return k.kind == Node::Kind::Term || k.kind == Node::Kind::Pattern || k.kind == Node::Kind::Fuzzy;
+    };
+    if (terms(n)) return true;
+    if (n.kind != Node::Kind::Or) return false;
+    return std::all_of(n.kids.begin(), n.kids.end(), terms);
+}
+
+// Terms that score a match: everything outside NOT, phrase and NEAR terms and
+// the expansions of wildcards and fuzzy terms (of a planned tree) included.
+inline void scoring_terms(const Node& n, std::vector<std::string>& out) {
+    if (n.kind == Node::Kind::Not) return;
+    if (n.kind == Node::Kind::Term) {
+        if (std::find(out.begin(), out.end(), n.term) == out.end()) out.push_back(n.term);
+        return;
+    }
+    for (const auto& k : n.kids) scoring_terms(k, out);
+}
+
+// Adds the best docs of one index (of a segment: live docs only) to `top`.
+// Disjunctions go straight to top-k evaluation; any other query is evaluated as
+// a boolean filter and only its matches are scored.
+inline void rank_index(const Node& planned, const Index& index, const TfIndex& tf, const Positions* positions,
+                       const Roaring* live, const std::vector<std::string>& terms, const std::vector<uint64_t>& df,
+                       const Bm25& bm, RankAlgo algo, TopK& top, RankStats& st, PostingsCache* cache, uint64_t scope,
+                       QueryStats* stats = nullptr) {
+    if (!tf.loaded()) throw std::runtime_error("Ranked queries need tf.bin (rebuild the index)");
+    std::vector<TermCursor> cur;
+    cur.reserve(terms.size());
+    {
+        StatTimer t(stats ? &stats->postings_us : nullptr);
+        for (size_t i = 0; i < terms.size(); i++) {
+            int64_t id = index.find(terms[i]);
+            if (id < 0) continue;
+            cur.emplace_back(index, tf, (uint32_t)id, bm.idf(df[i]), bm);
+            if (stats) {
+                stats->lists++;
+                stats->bytes += index.entry((uint32_t)id).len;
+            }
+        }
+    }
+    if (is_disjunction(planned)) {
+        StatTimer t(stats ? &stats->rank_us : nullptr);
+        rank_top_k(algo, cur, top, live, st);
+        return;
+    }
+    Evaluator ev(index, live, positions, cache, scope, stats);
+    DocList r = ev.eval(planned);
+    if (live) {
+        DocList all{Roaring(*live)};
+        r = op_and(r, all);
+    }
+    StatTimer t(stats ? &stats->rank_us : nullptr);
+    r.unpack();
+    rank_docs(cur, r.begin(), r.size(), top, st);
+}
+
+// The best docs from the `offset`-th on.
+inline void print_ranked(const TopK& top, std::ostream& out, uint64_t offset = 0, ReplyFormat* fmt = nullptr) {
+    std::vector<ScoredDoc> r = top.sorted();
+    r.erase(r.begin(), r.begin() + (std::ptrdiff_t)std::min<uint64_t>(offset, r.size()));
+    out << "RESULTS " << r.size() << "\n";
+    char buf[64];
+    for (const auto& d : r) {
+        uint32_t doc = fmt && fmt->map ? fmt->map->original(d.doc) : d.doc;
+        std::snprintf(buf, sizeof(buf), "%u\t%.4f", doc, d.score);
+        out << buf;
+        if (fmt) fmt->fields(doc, out);
+        out << "\n";
+    }
+    out << "END\n";
+}
+
+inline void print_results(DocList& res, std::ostream& out, ReplyFormat* fmt = nullptr) {
+    res.unpack();
+    if (fmt && fmt->map && fmt->map->loaded()) {
+        std::vector<uint32_t> docs(res.begin(), res.end());
+        to_original(docs, fmt->map);
+        res = DocList(std::move(docs));
+    }
+    out << "RESULTS " << res.size() << "\n";
+    for (uint32_t d : res) {
+        out << d;
+        if (fmt) fmt->fields(d, out);
+        out << "\n";
+    }
+    out << "END\n";
+}
+
+inline void explain_rank(const Node& planned, const RankOptions& ro, size_t k, std::ostream& out) {
+    out << "TOP k=" << k << " " << (is_disjunction(planned) ? rank_algo_name(ro.algo) : "filter+score") << "\n";
+}
+
+// Result cache key of a parsed query: ranked replies depend on k, not on the algorithm.
+inline std::string result_key(const Node& tree, const RankOptions& ro, const Page& page) {
+    std::string key = (ro.k ? "TOP " + std::to_string(ro.k) + " " : std::string()) + canonical(tree);
+    if (page.paged()) key += " LIMIT " + std::to_string(page.limit) + " OFFSET " + std::to_string(page.offset);
+    return key;
+}
+
+// The page of a boolean reply: the query's, capped by --max-results.
+inline Page boolean_page(Page page, const RankOptions& ro) {
+    if (ro.max_results) page.limit = std::min(page.limit, ro.max_results);
+    return page;
+}
+
+// Top-k size of a ranked query: the docs up to the end of its page, where a
+// LIMIT takes the place of --top K.
+inline size_t ranked_k(const RankOptions& ro, const Page& page) {
+    uint64_t n = page.limit != UINT64_MAX ? page.limit : ro.k;
+    if (ro.max_results) n = std::min(n, ro.max_results);
+    uint64_t end = n > UINT64_MAX - page.offset ? UINT64_MAX : page.offset + n;
+    return (size_t)std::min<uint64_t>(end, SIZE_MAX);
+}
+
+// Runs `body`, which writes one reply block to `out`; errors become an ERROR
+// line. With `stats` the STATS line follows. Returns false on error.
+template <class F>
+inline bool answer_with_stats(QueryStats* stats, std::ostream& out, F&& body) {
+    std::chrono::steady_clock::time_point t0;
+    if (stats) t0 = std::chrono::steady_clock::now();
+    bool ok = true;
+    try {
+        body();
+    } catch (const std::exception& e) {
+        out << "ERROR " << e.what() << "\n";
+        ok = false;
+    }
+    if (stats) {
+        stats->total_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        stats->print(out);
+    }
+    return ok;
+}
+
+// Takes LIMIT n / OFFSET m off the end of the tokens.
+inline Page parse_page(std::vector<std::string>& toks) {
+    Page page;
+    bool has_limit = false, has_offset = false;
+    while (toks.size() >= 2) {
+        std::string op = to_upper_ascii(toks[toks.size() - 2]);
+        if (op != "LIMIT" && op != "OFFSET") break;
+        const std::string& v = toks.back();
+        if (v.empty() || !std::all_of(v.begin(), v.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            throw std::runtime_error("Expected a number after " + op + ", got: " + v);
+        }
+        bool& seen = op == "LIMIT" ? has_limit : has_offset;
+        if (seen) throw std::runtime_error("Duplicate " + op);
+        seen = true;
+        (op == "LIMIT" ? page.limit : page.offset) = parse_number(v, UINT64_MAX, op + " " + v);
+        toks.resize(toks.size() - 2);
+    }
+    return page;
+}
+
+inline Node parse_query(const std::string& query, bool& explain_only, Page& page, QueryStats* stats) {
+    StatTimer t(stats ? &stats->parse_us : nullptr);
+    auto toks = tokenize_query(query);
+    page = parse_page(toks);
+    // EXPLAIN is a prefix only when a query follows it: "explain" alone or as
+    // the left operand of AND/OR/NEAR is the stem "explain"
+    explain_only = toks.size() > 1 && to_upper_ascii(toks[0]) == "EXPLAIN";
+    if (explain_only) {
+        std::string next = to_upper_ascii(toks[1]);
+        uint32_t dist;
+        explain_only = next != "AND" && next != "OR" && !parse_near_op(toks[1], dist);
+    }
+    if (explain_only) toks.erase(toks.begin());
+    Parser p(toks);
+    return p.parse();
+}
+
+inline void explain_page(const Page& page, std::ostream& out) {
+    if (!page.paged()) return;
+    out << "PAGE offset=" << page.offset;
+    if (page.limit != UINT64_MAX) out << " limit=" << page.limit;
+    out << "\n";
+}
+
+inline void plan_query(Node& tree, const Index& index, QueryStats* stats) {
+    StatTimer t(stats ? &stats->plan_us : nullptr);
+    plan(tree, index);
+}
+
+// Segmented index: every query runs on each segment of the current manifest
+// generation (NOT is relative to the segment's live docs, deleted docs are
+// filtered out) and the per-segment results, disjoint by construction, are
+// united. The manifest is checked before each query, so segments added or
+// merged by build_index show up without a restart.
+inline bool answer_segments(const std::string& query, SegmentSet& set, const RankOptions& ro, QueryCaches& caches,
+                            QueryStats* stats, std::ostream& out) {
+    return answer_with_stats(stats, out, [&] {
+        if (set.refresh()) {
+            std::cerr << "Reloaded segments: " << set.snapshot()->segments.size() << " (generation "
+                      << set.snapshot()->generation << ")\n";
+        }
+        auto snap = set.snapshot();
+
+        bool explain_only;
+        Page page;
+        Node tree = parse_query(query, explain_only, page, stats);
+
+        if (explain_only) {
+            out << "PLAN\n";
+            explain_page(page, out);
+            if (ro.k) explain_rank(tree, ro, ranked_k(ro, page), out);
+            for (const auto& seg : snap->segments) {
+                Node t = tree;
+                plan_query(t, seg->index, stats);
+                out << "SEGMENT " << seg->name << " live=" << seg->live.cardinality() << "\n";
+                explain(t, 1, false, out);
+            }
+            out << "END\n";
+            return;
+        }
+
+        // cached replies belong to one manifest generation
+        std::string key;
+        if (caches.results.enabled()) {
+            key = "G" + std::to_string(snap->generation) + " " + result_key(tree, ro, page);
+            std::string hit;
+            if (caches.results.get(key, hit)) {
+                if (stats) stats->cached = true;
+                out << hit;
+                return;
+            }
+        }
+        std::ostringstream reply;
+        Page shown = boolean_page(page, ro);
+        ReplyFormat fmt = reply_format(ro, nullptr);
+
+        if (ro.k) {
+            // one BM25 over all segments: summed doc counts, lengths and df; wildcards
+            // expand per segment, and every expansion scores in all segments
+            std::vector<std::string> terms;
+            scoring_terms(tree, terms);
+            std::vector<Node> planned;
+            for (const auto& seg : snap->segments) {
+                planned.push_back(tree);
+                plan_query(planned.back(), seg->index, stats);
+                scoring_terms(planned.back(), terms);
+            }
+            std::vector<uint64_t> df(terms.size(), 0);
+            uint64_t docs = 0, total_len = 0;
+            for (const auto& seg : snap->segments) {
+                docs += seg->tf.docs();
+                total_len += seg->tf.total_len();
+                StatTimer t(stats ? &stats->lookup_us : nullptr);
+                for (size_t i = 0; i < terms.size(); i++) {
+                    int64_t id = seg->index.find(terms[i]);
+                    if (id >= 0) df[i] += seg->index.entry((uint32_t)id).df;
+                }
+            }
+            Bm25 bm(docs, total_len);
+            TopK top(ranked_k(ro, page));
+            RankStats st;
+            for (size_t s = 0; s < snap->segments.size(); s++) {
+                const auto& seg = snap->segments[s];
+                rank_index(planned[s], seg->index, seg->tf, &seg->positions, &seg->live, terms, df, bm, ro.algo, top, st,
+                           &caches.postings, std::hash<std::string>()(seg->name), stats);
+            }
+            if (stats) stats->scored += st.scored;
+            StatTimer t(stats ? &stats->format_us : nullptr);
+            fmt.terms = terms;
+            print_ranked(top, reply, page.offset, &fmt);
+        } else if (shown.paged()) {
+            // segments hold disjoint docs, so their cursors are merged like the kids of an OR
+            std::vector<CursorPtr> segs;
+            for (const auto& seg : snap->segments) {
+                Node t = tree;
+                plan_query(t, seg->index, stats);
+                if (ro.show == Show::Snippets) scoring_terms(t, fmt.terms);
+                segs.push_back(std::make_unique<MemberCursor>(open_cursor(t, seg->index, &seg->positions, stats), seg->live));
+            }
+            OrCursor all(std::move(segs));
+            std::vector<uint32_t> docs;
+            bool more = collect_page(all, shown, docs, stats);
+            StatTimer t(stats ? &stats->format_us : nullptr);
+            print_page(docs, more, reply, &fmt);
+        } else {
+            DocList res;
+            for (const auto& seg : snap->segments) {
+                Node t = tree;
+                plan_query(t, seg->index, stats);
+                if (ro.show == Show::Snippets) scoring_terms(t, fmt.terms);
+                Evaluator ev(seg->index, &seg->live, &seg->positions, &caches.postings, std::hash<std::string>()(seg->name),
+                             stats);
+                auto r = ev.eval(t);
+                StatTimer timer(stats ? &stats->ops_us : nullptr);
+                DocList live{Roaring(seg->live)};
+                r = op_and(r, live);
+                res = op_or(res, r);
+            }
+            StatTimer t(stats ? &stats->format_us : nullptr);
+            print_results(res, reply, &fmt);
+        }
+        if (!key.empty()) caches.results.put(key, reply.str());
+        out << reply.str();
+    });
+}
+
+// Single index. Everything it touches is read-only (mapped files, const
+// lookups), so one loaded index answers queries from any number of threads.
+// With `so`, heavy boolean queries are split into doc-range shards (eval_sharded).
+inline bool answer_index(const std::string& query, const Index& index, const Positions& positions, const TfIndex& tf,
+                         const RankOptions& ro, QueryCaches& caches, QueryStats* stats, std::ostream& out,
+                         const ShardOptions& so = ShardOptions()) {
+    return answer_with_stats(stats, out, [&] {
+        bool explain_only;
+        Page page;
+        Node tree = parse_query(query, explain_only, page, stats);
+
+        std::string key;
+        if (!explain_only && caches.results.enabled()) {
+            key = result_key(tree, ro, page);
+            std::string hit;
+            if (caches.results.get(key, hit)) {
+                if (stats) stats->cached = true;
+                out << hit;
+                return;
+            }
+        }
+        plan_query(tree, index, stats);
+
+        if (explain_only) {
+            out << "PLAN\n";
+            explain_page(page, out);
+            if (ro.k) explain_rank(tree, ro, ranked_k(ro, page), out);
+            explain(tree, 0, false, out);
+            out << "END\n";
+            return;
+        }
+
+        std::ostringstream reply;
+        Page shown = boolean_page(page, ro);
+        ReplyFormat fmt = reply_format(ro, &index.docmap);
+        if (ro.show == Show::Snippets) scoring_terms(tree, fmt.terms);
+        if (ro.k) {
+            std::vector<std::string> terms;
+            scoring_terms(tree, terms);
+            std::vector<uint64_t> df;
+            {
+                StatTimer t(stats ? &stats->lookup_us : nullptr);
+                for (const auto& term : terms) {
+                    int64_t id = index.find(term);
+                    df.push_back(id < 0 ? 0 : index.entry((uint32_t)id).df);
+                }
+            }
+            Bm25 bm(tf.docs(), tf.total_len());
+            TopK top(ranked_k(ro, page), &index.docmap);
+            RankStats st;
+            rank_index(tree, index, tf, &positions, nullptr, terms, df, bm, ro.algo, top, st, &caches.postings, 0, stats);
+            if (stats) stats->scored += st.scored;
+            StatTimer t(stats ? &stats->format_us : nullptr);
+            print_ranked(top, reply, page.offset, &fmt);
+        } else if (shown.paged() && !index.docmap.loaded()) {
+            CursorPtr c = open_cursor(tree, index, &positions, stats);
+            std::vector<uint32_t> docs;
+            bool more = collect_page(*c, shown, docs, stats);
+            StatTimer t(stats ? &stats->format_us : nullptr);
+            print_page(docs, more, reply, &fmt);
+        } else if (shown.paged()) {
+            auto res = eval_sharded(tree, index, &positions, &caches.postings, so, stats);
+            StatTimer t(stats ? &stats->format_us : nullptr);
+            std::vector<uint32_t> docs;
+            bool more = original_page(res, index.docmap, shown, docs);
+            print_page(docs, more, reply, &fmt);
+        } else {
+            auto res = eval_sharded(tree, index, &positions, &caches.postings, so, stats);
+            StatTimer t(stats ? &stats->format_us : nullptr);
+            print_results(res, reply, &fmt);
+        }
+        if (!key.empty()) caches.results.put(key, reply.str());
+        out << reply.str();
+    });
+}
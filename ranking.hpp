@@ -0,0 +1,495 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "index_format.hpp"
+#include "positions.hpp"
+#include "postings_codec.hpp"
+#include "roaring.hpp"
+
+// Ranked retrieval: term frequencies and document lengths (tf.bin, written by
+// build_index next to the index) and BM25 top-k evaluation over them.
+//
+// tf.bin:
+//   per term, in dictionary order:
+//     uint32_t nblocks                  ceil(df / POSTINGS_BLOCK), the same blocks as the postings
+//     BlockMax blocks[nblocks]
+//     tf stream                         varint tf of every doc, in postings order
+//   uint32_t doclen[maxdoc + 1]         tokens of every doc (0: not indexed)
+//   uint64_t table[nterms][2]           offset and length of every term record (8-byte aligned)
+//   TfFooter
+//
+// A block's bound (its max tf and min doc length) does not depend on collection
+// statistics, so the same file serves any k1/b and the combined statistics of
+// several segments.
+//
+// Top-k evaluation is document-at-a-time over term cursors:
+//   exhaustive  scores every doc of the union;
+//   wand        skips docs whose sum of per-term max scores cannot beat the k-th score;
+//   bmw         block-max WAND: the pivot is checked again against the max scores
+//               of the blocks it falls into, and whole blocks are skipped.
+
+static constexpr char TF_MAGIC[4] = {'I', 'R', 'T', 'F'};
+static constexpr uint32_t TF_VERSION = 1;
+
+struct TfFooter {
+    char magic[4];
+    uint32_t version;
+    uint64_t nterms;
+    uint64_t table_off;
+    uint64_t doclen_off;
+    uint64_t total_len; // sum of doclen
+    uint32_t maxdoc;
+    uint32_t ndocs;     // docs with doclen > 0
+};
+static_assert(sizeof(TfFooter) == 48, "TfFooter is part of the on-disk format");
+
+struct BlockMax {
+    uint32_t last_doc;
+    uint32_t tf_off; // start of the block in the tf stream
+    uint32_t max_tf;
+    uint32_t min_len;
+};
+static_assert(sizeof(BlockMax) == 16, "BlockMax is part of the on-disk format");
+
+// Term record for `docs` with their `tf`; `doclen` is indexed by doc id.
+inline void encode_tf_record(const std::vector<uint32_t>& docs, const std::vector<uint32_t>& tf,
+                             const std::vector<uint32_t>& doclen, std::vector<uint8_t>& out) {
+    uint32_t df = (uint32_t)docs.size();
+    uint32_t nblocks = (df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+    append_u32(out, nblocks);
+    size_t dir = out.size();
+    out.resize(dir + (size_t)nblocks * sizeof(BlockMax));
+    size_t start = out.size();
+    for (uint32_t b = 0; b < nblocks; b++) {
+        uint32_t lo = b * POSTINGS_BLOCK, hi = std::min(df, lo + POSTINGS_BLOCK);
+        BlockMax m{docs[hi - 1], (uint32_t)(out.size() - start), 0, UINT32_MAX};
+        for (uint32_t i = lo; i < hi; i++) {
+            m.max_tf = std::max(m.max_tf, tf[i]);
+            m.min_len = std::min(m.min_len, docs[i] < doclen.size() ? doclen[docs[i]] : 0);
+            append_varint(out, tf[i]);
+        }
+        std::memcpy(&out[dir + (size_t)b * sizeof(BlockMax)], &m, sizeof(m));
+    }
+}
+
+// tf of one term inside the mapped file.
+struct TfList {
+    const uint8_t* record = nullptr;
+
+    uint32_t nblocks() const { return load_u32(record); }
+
+    BlockMax block(uint32_t b) const {
+        BlockMax m;
+        std::memcpy(&m, record + 4 + (size_t)b * sizeof(BlockMax), sizeof(m));
+        return m;
+    }
+
+    const uint8_t* stream() const { return record + 4 + (size_t)nblocks() * sizeof(BlockMax); }
+
+    // tf of every doc of the list, in postings order.
+    void decode(uint32_t df, std::vector<uint32_t>& out) const {
+        out.resize(df);
+        const uint8_t* p = stream();
+        for (uint32_t i = 0; i < df; i++) out[i] = read_varint(p);
+    }
+};
+
+class TfIndex {
+public:
+    bool loaded() const { return table_ != nullptr; }
+
+    void open(const std::string& path) {
+        file_.open(path);
+        if (file_.size() < sizeof(TfFooter)) throw std::runtime_error("Not a tf file: " + path);
+        std::memcpy(&f_, file_.data() + file_.size() - sizeof(f_), sizeof(f_));
+        if (std::memcmp(f_.magic, TF_MAGIC, 4) != 0) throw std::runtime_error("Not a tf file: " + path);
+        if (f_.version != TF_VERSION) throw std::runtime_error("Unsupported tf version " + std::to_string(f_.version) + ": " + path);
+        if (f_.table_off + f_.nterms * 16 + sizeof(f_) > file_.size() ||
+            f_.doclen_off + ((uint64_t)f_.maxdoc + 1) * 4 > f_.table_off) {
+            throw std::runtime_error("Truncated tf file: " + path);
+        }
+        table_ = file_.data() + f_.table_off;
+    }
+
+    // Same ordinal as in the dictionary.
+    TfList list(uint32_t term) const {
+        if (term >= f_.nterms) throw std::runtime_error("tf.bin does not match the dictionary");
+        uint64_t off;
+        std::memcpy(&off, table_ + (size_t)term * 16, 8);
+        TfList l;
+        l.record = file_.data() + off;
+        return l;
+    }
+
+    uint32_t doclen(uint32_t doc) const {
+        return doc <= f_.maxdoc ? load_u32(file_.data() + f_.doclen_off + (size_t)doc * 4) : 0;
+    }
+
+    uint32_t maxdoc() const { return f_.maxdoc; }
+    uint64_t docs() const { return f_.ndocs; }
+    uint64_t total_len() const { return f_.total_len; }
+
+private:
+    MappedFile file_;
+    TfFooter f_{};
+    const uint8_t* table_ = nullptr;
+};
+
+// Sequential writer of tf.bin, fed in dictionary order.
+class TfWriter {
+public:
+    void open(const std::string& path) {
+        out_.open(path, std::ios::binary);
+        if (!out_) throw std::runtime_error("Cannot write tf: " + path);
+    }
+
+    // `record` from encode_tf_record
+    void add(const uint8_t* record, size_t len) {
+        out_.write(reinterpret_cast<const char*>(record), (std::streamsize)len);
+        table_.push_back(pos_);
+        table_.push_back(len);
+        pos_ += len;
+        pad_to(out_, pos_, 4);
+    }
+
+    void finish(std::vector<uint32_t> doclen, uint32_t maxdoc) {
+        doclen.resize((size_t)maxdoc + 1);
+        TfFooter f{};
+        std::memcpy(f.magic, TF_MAGIC, 4);
+        f.version = TF_VERSION;
+        f.nterms = table_.size() / 2;
+        f.maxdoc = maxdoc;
+        for (uint32_t len : doclen) {
+            f.total_len += len;
+            f.ndocs += len > 0;
+        }
+        f.doclen_off = pos_;
+        out_.write(reinterpret_cast<const char*>(doclen.data()), (std::streamsize)(doclen.size() * 4));
+        pos_ += doclen.size() * 4;
+        pad_to(out_, pos_, 8);
+        f.table_off = pos_;
+        out_.write(reinterpret_cast<const char*>(table_.data()), (std::streamsize)(table_.size() * 8));
+        out_.write(reinterpret_cast<const char*>(&f), sizeof(f));
+        out_.close();
+        if (!out_) throw std::runtime_error("Failed writing tf");
+    }
+
+private:
+    std::ofstream out_;
+    uint64_t pos_ = 0;
+    std::vector<uint64_t> table_;
+};
+
+// Okapi BM25 over the statistics of the searched index (or of all its segments).
+struct Bm25 {
+    double k1 = 1.2;
+    double b = 0.75;
+    uint64_t docs = 0;
+    double avgdl = 1;
+
+    Bm25(uint64_t docs, uint64_t total_len) : docs(docs), avgdl(docs ? (double)total_len / (double)docs : 1) {}
+
+    // Always positive; df may exceed docs when deleted docs are still counted.
+    double idf(uint64_t df) const {
+        double rest = docs > df ? (double)(docs - df) : 0.0;
+        return std::log(1.0 + (rest + 0.5) / ((double)df + 0.5));
+    }
+
+    // Grows with tf and falls with len, so (max tf, min len) bounds a block.
+    double weight(double idf, uint32_t tf, uint32_t len) const {
+        return idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * len / avgdl));
+    }
+};
+
+// Cursor over one term's postings: doc ids come from the index, tf from tf.bin,
+// both a block at a time; tf is decoded only for blocks where a doc is scored.
+class TermCursor {
+public:
+    static constexpr uint32_t END = UINT32_MAX;
+
+    TermCursor(const Index& index, const TfIndex& tf, uint32_t term, double idf, const Bm25& bm)
+        : lens_(&tf), bm_(&bm), idf_(idf), tf_(tf.list(term)) {
+        v_ = index.postings(index.entry(term));
+        nblocks_ = tf_.nblocks();
+        if (v_.codec == Codec::Raw) {
+            all_ = v_.raw_docs();
+        } else if (v_.codec == Codec::Roaring) {
+            decode_postings(v_.codec, v_.data, v_.len, v_.df, own_);
+            all_ = own_.data();
+        }
+        ub_.resize(nblocks_);
+        for (uint32_t b = 0; b < nblocks_; b++) {
+            BlockMax m = tf_.block(b);
+            ub_[b] = bm.weight(idf, m.max_tf, m.min_len);
+            max_score_ = std::max(max_score_, ub_[b]);
+        }
+        load(0);
+    }
+    TermCursor(TermCursor&&) = default;
+    TermCursor(const TermCursor&) = delete;
+    TermCursor& operator=(const TermCursor&) = delete;
+
+    uint32_t doc() const { return doc_; }
+    uint32_t df() const { return v_.df; }
+    double max_score() const { return max_score_; }
+
+    void next() {
+        if (++i_ < n_) doc_ = docs()[i_];
+        else load(block_ + 1);
+    }
+
+    // First doc >= target; blocks are skipped by their last doc without decoding.
+    void advance(uint32_t target) {
+        if (doc_ >= target) return;
+        if (target > last_) {
+            uint32_t b = block_ + 1;
+            while (b < nblocks_ && tf_.block(b).last_doc < target) b++;
+            load(b);
+            if (doc_ >= target) return;
+        }
+        // the target is in this block: short hops are the common case
+        const uint32_t* d = docs();
+        uint32_t i = i_ + 1;
+        while (i + 8 <= n_ && d[i + 7] < target) i += 8;
+        while (d[i] < target) i++;
+        i_ = i;
+        doc_ = d[i];
+    }
+
+    double score() {
+        if (tf_block_ != block_) {
+            const uint8_t* p = tf_.stream() + tf_.block(block_).tf_off;
+            for (uint32_t j = 0; j < n_; j++) tfs_[j] = read_varint(p);
+            tf_block_ = block_;
+        }
+        return bm_->weight(idf_, tfs_[i_], lens_->doclen(doc_));
+    }
+
+    // Shallow move to the block that would hold `target`, without decoding it:
+    // returns the block's max score and sets `last` to its last doc (END past the list).
+    double block_max(uint32_t target, uint32_t& last) {
+        if (shallow_ < block_ || target < shallow_target_) shallow_ = block_;
+        shallow_target_ = target;
+        while (shallow_ < nblocks_ && tf_.block(shallow_).last_doc < target) shallow_++;
+        if (shallow_ == nblocks_) {
+            last = END;
+            return 0;
+        }
+        last = tf_.block(shallow_).last_doc;
+        return ub_[shallow_];
+    }
+
+private:
+    const uint32_t* docs() const { return all_ ? all_ + (size_t)block_ * POSTINGS_BLOCK : buf_; }
+
+    void load(uint32_t b) {
+        block_ = b;
+        i_ = 0;
+        if (b >= nblocks_) {
+            n_ = 0;
+            doc_ = last_ = END;
+            return;
+        }
+        n_ = std::min<uint32_t>(POSTINGS_BLOCK, v_.df - b * POSTINGS_BLOCK);
+        if (!all_) svb_decode_block(v_.data, v_.len, v_.df, b, buf_);
+        doc_ = docs()[0];
+        last_ = docs()[n_ - 1];
+    }
+
+    const TfIndex* lens_;
+    const Bm25* bm_;
+    double idf_;
+    TfList tf_;
+    PostingsView v_;
+    uint32_t nblocks_ = 0;
+    const uint32_t* all_ = nullptr; // raw lists in place, roar lists decoded once
+    std::vector<uint32_t> own_;
+    std::vector<double> ub_;        // max score of every block
+    double max_score_ = 0;
+
+    uint32_t block_ = 0, n_ = 0, i_ = 0;
+    uint32_t doc_ = END;
+    uint32_t last_ = END; // last doc of the current block
+    uint32_t buf_[POSTINGS_BLOCK];
+    uint32_t tfs_[POSTINGS_BLOCK];
+    uint32_t tf_block_ = UINT32_MAX;
+    uint32_t shallow_ = 0, shallow_target_ = 0;
+};
+
+struct ScoredDoc {
+    uint32_t doc;
+    double score;
+};
+
+// k best docs: higher score first, lower doc id on ties. With the doc map of a
+// reordered index, ties go by original id, as in the index without reordering.
+class TopK {
+public:
+    explicit TopK(size_t k, const DocMap* map = nullptr) : k_(k), map_(map) {}
+
+    bool full() const { return heap_.size() >= k_; }
+
+    // Whether a doc scoring up to `bound` may still enter. The small slack keeps
+    // rounding differences between a bound and the real score from pruning a doc.
+    bool can_enter(double bound) const { return !full() || bound * (1 + 1e-9) >= heap_.front().score; }
+
+    void push(uint32_t doc, double score) {
+        ScoredDoc d{doc, score};
+        auto better = [this](const ScoredDoc& a, const ScoredDoc& b) { return this->better(a, b); };
+        if (!full()) {
+            heap_.push_back(d);
+            std::push_heap(heap_.begin(), heap_.end(), better);
+        } else if (k_ > 0 && better(d, heap_.front())) {
+            std::pop_heap(heap_.begin(), heap_.end(), better);
+            heap_.back() = d;
+            std::push_heap(heap_.begin(), heap_.end(), better);
+        }
+    }
+
+    std::vector<ScoredDoc> sorted() const {
+        std::vector<ScoredDoc> r = heap_;
+        std::sort(r.begin(), r.end(), [this](const ScoredDoc& a, const ScoredDoc& b) { return better(a, b); });
+        return r;
+    }
+
+private:
+    bool better(const ScoredDoc& a, const ScoredDoc& b) const {
+        if (a.score != b.score) return a.score > b.score;
+        return map_ ? map_->original(a.doc) < map_->original(b.doc) : a.doc < b.doc;
+    }
+
+    size_t k_;
+    const DocMap* map_;
+    std::vector<ScoredDoc> heap_; // worst on top
+};
+
+enum class RankAlgo { Exhaustive, Wand, BlockMaxWand };
+
+inline const char* rank_algo_name(RankAlgo a) {
+    switch (a) {
+        case RankAlgo::Exhaustive: return "exhaustive";
+        case RankAlgo::Wand: return "wand";
+        case RankAlgo::BlockMaxWand: return "bmw";
+    }
+    return "?";
+}
+
+inline bool parse_rank_algo(const std::string& s, RankAlgo& a) {
+    if (s == "exhaustive") { a = RankAlgo::Exhaustive; return true; }
+    if (s == "wand") { a = RankAlgo::Wand; return true; }
+    if (s == "bmw") { a = RankAlgo::BlockMaxWand; return true; }
+    return false;
+}
+
+struct RankStats {
+    uint64_t postings = 0; // df sum of the query terms
+    uint64_t scored = 0;   // docs whose score was computed
+};
+
+// Sum in the order of `cur` (the query order), so every algorithm gets bit-identical scores.
+inline double score_doc(std::vector<TermCursor>& cur, uint32_t d) {
+    double s = 0;
+    for (auto& c : cur) {
+        if (c.doc() == d) s += c.score();
+    }
+    return s;
+}
+
+inline void offer(TopK& top, const Roaring* live, uint32_t d, double s) {
+    if (!live || live->contains(d)) top.push(d, s);
+}
+
+inline void rank_exhaustive(std::vector<TermCursor>& cur, TopK& top, const Roaring* live, RankStats& st) {
+    for (;;) {
+        uint32_t d = TermCursor::END;
+        for (const auto& c : cur) d = std::min(d, c.doc());
+        if (d == TermCursor::END) return;
+        offer(top, live, d, score_doc(cur, d));
+        st.scored++;
+        for (auto& c : cur) {
+            if (c.doc() == d) c.next();
+        }
+    }
+}
+
+// Shared by WAND and BMW: cursors sorted by current doc, pivot = first cursor at
+// which the sum of max scores so far can enter the top-k.
+inline void rank_wand_impl(std::vector<TermCursor>& cur, TopK& top, const Roaring* live, RankStats& st, bool block_max) {
+    std::vector<TermCursor*> c;
+    for (auto& x : cur) c.push_back(&x);
+    auto by_doc = [](const TermCursor* a, const TermCursor* b) { return a->doc() < b->doc(); };
+    std::sort(c.begin(), c.end(), by_doc);
+    const size_t n = c.size();
+
+    for (;;) {
+        double acc = 0;
+        size_t p = n;
+        for (size_t i = 0; i < n && c[i]->doc() != TermCursor::END; i++) {
+            acc += c[i]->max_score();
+            if (top.can_enter(acc)) {
+                p = i;
+                break;
+            }
+        }
+        if (p == n) return;
+        const uint32_t pd = c[p]->doc();
+        while (p + 1 < n && c[p + 1]->doc() == pd) p++;
+
+        bool go = true;
+        uint32_t skip_to = TermCursor::END;
+        if (block_max) {
+            double bound = 0;
+            for (size_t i = 0; i <= p; i++) {
+                uint32_t last;
+                bound += c[i]->block_max(pd, last);
+                skip_to = std::min(skip_to, last);
+            }
+            go = top.can_enter(bound);
+            // no doc before the end of the shortest of these blocks can enter either
+            if (!go) {
+                skip_to = skip_to == TermCursor::END ? TermCursor::END : skip_to + 1;
+                if (p + 1 < n) skip_to = std::min(skip_to, c[p + 1]->doc());
+            }
+        }
+
+        if (!go) {
+            for (size_t i = 0; i <= p; i++) c[i]->advance(skip_to);
+        } else if (c[0]->doc() == pd) {
+            offer(top, live, pd, score_doc(cur, pd));
+            st.scored++;
+            for (size_t i = 0; i <= p; i++) c[i]->next();
+        } else {
+            for (size_t i = 0; i < p && c[i]->doc() < pd; i++) c[i]->advance(pd);
+        }
+        // few cursors moved: insertion sort
+        for (size_t i = 1; i < n; i++) {
+            for (size_t j = i; j > 0 && c[j]->doc() < c[j - 1]->doc(); j--) std::swap(c[j], c[j - 1]);
+        }
+    }
+}
+
+// Top-k of the union of the cursors' lists; `live`, when given, drops other docs.
+inline void rank_top_k(RankAlgo algo, std::vector<TermCursor>& cur, TopK& top, const Roaring* live, RankStats& st) {
+    for (const auto& c : cur) st.postings += c.df();
+    if (algo == RankAlgo::Exhaustive) rank_exhaustive(cur, top, live, st);
+    else rank_wand_impl(cur, top, live, st, algo == RankAlgo::BlockMaxWand);
+}
+
+// Scores given docs (the matches of a boolean query) with the cursors of its terms.
+inline void rank_docs(std::vector<TermCursor>& cur, const uint32_t* docs, size_t n, TopK& top, RankStats& st) {
+    for (const auto& c : cur) st.postings += c.df();
+    for (size_t i = 0; i < n; i++) {
+        uint32_t d = docs[i];
+        for (auto& c : cur) c.advance(d);
+        top.push(d, score_doc(cur, d));
+        st.scored++;
+    }
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "parallel.hpp"
+#include "vocabulary.hpp"
+
+// Doc id reassignment for build_index --reorder. Crawl order says nothing
+// about content, so similar documents get far-apart ids and every posting gap
+// is large. Both orders here only need each document's set of distinct terms
+// (a forward index) and return a permutation of the documents; build_index
+// then indexes them under the ids 1..n in that order and writes docmap.bin
+// (index_format.hpp) to translate results back.
+//
+//   bp       recursive graph bisection (Dhulipala et al., KDD 2016): the docs
+//            are split in halves, and docs are swapped between the halves
+//            while that lowers the estimated cost of encoding the gaps of
+//            every term in both halves; then each half is split again.
+//   minhash  docs sorted by a few minhash values of their term sets, so docs
+//            with similar vocabularies end up next to each other; much faster,
+//            clusters less.
+
+// Distinct terms of every doc, as dense term ids: terms(d) = ids[off[d] .. off[d + 1]).
+struct ForwardIndex {
+    std::vector<uint64_t> off{0};
+    std::vector<uint32_t> ids;
+    uint32_t nterms = 0;
+
+    uint32_t docs() const { return (uint32_t)(off.size() - 1); }
+};
+
+// Builds a forward index from per-doc term hashes (Vocabulary::hash of each
+// term, any order, duplicates allowed). Terms of a single doc cannot make any
+// gap smaller and are dropped.
+inline ForwardIndex forward_index(std::vector<std::vector<uint64_t>>& hashes) {
+    std::vector<uint64_t> all;
+    for (auto& h : hashes) {
+        std::sort(h.begin(), h.end());
+        h.erase(std::unique(h.begin(), h.end()), h.end());
+        all.insert(all.end(), h.begin(), h.end());
+    }
+    std::sort(all.begin(), all.end());
+    std::vector<uint64_t> shared; // hashes of terms in two docs or more
+    for (size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while (j < all.size() && all[j] == all[i]) j++;
+        if (j - i > 1) shared.push_back(all[i]);
+        i = j;
+    }
+    std::vector<uint64_t>().swap(all);
+
+    ForwardIndex f;
+    f.nterms = (uint32_t)shared.size();
+    for (auto& h : hashes) {
+        for (uint64_t x : h) {
+            auto it = std::lower_bound(shared.begin(), shared.end(), x);
+            if (it != shared.end() && *it == x) f.ids.push_back((uint32_t)(it - shared.begin()));
+        }
+        f.off.push_back(f.ids.size());
+        std::vector<uint64_t>().swap(h);
+    }
+    return f;
+}
+
+struct BpOptions {
+    unsigned iterations = 20; // swap rounds per bisection
+    uint32_t leaf = 16;       // partitions this small keep their order
+    unsigned threads = 1;
+};
+
+// Doc order by recursive graph bisection: order[k] is the doc placed k-th.
+//
+// Cost of a term with d docs in a partition of n docs: d * log2(n / (d + 1)),
+// about the bits of its gaps there. Moving a doc to the other half changes the
+// cost of each of its terms, and the gain of a doc is the sum over its terms.
+// Each round sorts both halves by gain and swaps pairs while the two gains add
+// up to an improvement. All partitions of one level are independent and run
+// on the worker threads.
+inline std::vector<uint32_t> bp_order(const ForwardIndex& f, const BpOptions& opt) {
+    std::vector<uint32_t> order(f.docs());
+    for (uint32_t d = 0; d < f.docs(); d++) order[d] = d;
+
+    struct Scratch {
+        std::vector<uint32_t> left, right; // term degree in each half
+        std::vector<double> to_right, to_left; // gain of moving one doc of the term
+        std::vector<uint32_t> touched;
+        std::vector<std::pair<double, uint32_t>> gl, gr;
+    };
+    auto cost = [](double d, double n) { return d * std::log2(n / (d + 1)); };
+
+    auto bisect = [&](Scratch& s, uint32_t* docs, size_t n) {
+        if (s.left.size() < f.nterms) {
+            s.left.assign(f.nterms, 0);
+            s.right.assign(f.nterms, 0);
+            s.to_right.assign(f.nterms, 0);
+            s.to_left.assign(f.nterms, 0);
+        }
+        const size_t half = n / 2;
+        const double n1 = (double)half, n2 = (double)(n - half);
+        for (unsigned it = 0; it < opt.iterations; it++) {
+            s.touched.clear();
+            for (size_t i = 0; i < n; i++) {
+                for (uint64_t k = f.off[docs[i]]; k < f.off[docs[i] + 1]; k++) {
+                    uint32_t t = f.ids[k];
+                    if (s.left[t] == 0 && s.right[t] == 0) s.touched.push_back(t);
+                    (i < half ? s.left[t] : s.right[t])++;
+                }
+            }
+            for (uint32_t t : s.touched) {
+                double l = s.left[t], r = s.right[t];
+                double now = cost(l, n1) + cost(r, n2);
+                s.to_right[t] = l ? now - cost(l - 1, n1) - cost(r + 1, n2) : 0;
+                s.to_left[t] = r ? now - cost(l + 1, n1) - cost(r - 1, n2) : 0;
+            }
+            s.gl.clear();
+            s.gr.clear();
+            for (size_t i = 0; i < n; i++) {
+                double g = 0;
+                const std::vector<double>& move = i < half ? s.to_right : s.to_left;
+                for (uint64_t k = f.off[docs[i]]; k < f.off[docs[i] + 1]; k++) g += move[f.ids[k]];
+                (i < half ? s.gl : s.gr).emplace_back(g, (uint32_t)i);
+            }
+            for (uint32_t t : s.touched) s.left[t] = s.right[t] = 0;
+
+            auto by_gain = [](const std::pair<double, uint32_t>& a, const std::pair<double, uint32_t>& b) {
+                return a.first > b.first || (a.first == b.first && a.second < b.second);
+            };
+            std::sort(s.gl.begin(), s.gl.end(), by_gain);
+            std::sort(s.gr.begin(), s.gr.end(), by_gain);
+            size_t swaps = 0;
+            for (size_t i = 0; i < s.gl.size() && i < s.gr.size() && s.gl[i].first + s.gr[i].first > 0; i++) {
+                std::swap(docs[s.gl[i].second], docs[s.gr[i].second]);
+                swaps++;
+            }
+            if (swaps == 0) break;
+        }
+    };
+
+    // one scratch per running bisection, reused across partitions and levels
+    std::mutex pool_m;
+    std::vector<std::unique_ptr<Scratch>> pool;
+    std::vector<std::pair<size_t, size_t>> level{{0, order.size()}}, next; // (begin, size)
+    while (!level.empty()) {
+        parallel_for_stealing(level.size(), opt.threads, [&](size_t i) {
+            std::unique_ptr<Scratch> s;
+            {
+                std::lock_guard<std::mutex> lk(pool_m);
+                if (!pool.empty()) {
+                    s = std::move(pool.back());
+                    pool.pop_back();
+                }
+            }
+            if (!s) s = std::make_unique<Scratch>();
+            bisect(*s, order.data() + level[i].first, level[i].second);
+            std::lock_guard<std::mutex> lk(pool_m);
+            pool.push_back(std::move(s));
+        });
+        next.clear();
+        for (const auto& [b, n] : level) {
+            if (n / 2 <= opt.leaf) continue;
+            next.emplace_back(b, n / 2);
+            next.emplace_back(b + n / 2, n - n / 2);
+        }
+        level.swap(next);
+    }
+    return order;
+}
+
+// Doc order by minhash: docs sorted by the minimum of `k` hash functions over
+// their term ids, compared in turn.
+inline std::vector<uint32_t> minhash_order(const ForwardIndex& f, unsigned k = 4) {
+    const uint32_t n = f.docs();
+    std::vector<uint32_t> sig((size_t)n * k, UINT32_MAX);
+    for (uint32_t d = 0; d < n; d++) {
+        for (uint64_t i = f.off[d]; i < f.off[d + 1]; i++) {
+            for (unsigned j = 0; j < k; j++) {
+                // splitmix64 finalizer over (term, function)
+                uint64_t x = ((uint64_t)f.ids[i] << 8 | j) + 0x9E3779B97F4A7C15ull;
+                x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+                x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+                uint32_t h = (uint32_t)(x ^ (x >> 31));
+                uint32_t& m = sig[(size_t)d * k + j];
+                m = std::min(m, h);
+            }
+        }
+    }
+    std::vector<uint32_t> order(n);
+    for (uint32_t d = 0; d < n; d++) order[d] = d;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        const uint32_t* x = &sig[(size_t)a * k];
+        const uint32_t* y = &sig[(size_t)b * k];
+        for (unsigned j = 0; j < k; j++) {
+            if (x[j] != y[j]) return x[j] < y[j];
+        }
+        return a < b;
+    });
+    return order;
+}
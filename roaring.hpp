@@ -0,0 +1,330 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include "postings_codec.hpp"
+
+// In-memory Roaring-style doc set: one container per 64K chunk of doc ids, a
+// sorted uint16_t array while the chunk holds at most ROARING_ARRAY_MAX docs and
+// a 1024-word bitmap above that. Set operations work chunk by chunk; whenever a
+// bitmap is involved they run over 64-bit words (AND / OR / ANDNOT + popcount).
+
+struct Container {
+    uint16_t key = 0;
+    uint32_t card = 0;
+    std::vector<uint16_t> array;
+    std::vector<uint64_t> words; // ROARING_WORDS when the container is a bitmap
+
+    bool is_bitmap() const { return !words.empty(); }
+
+    bool contains(uint16_t low) const {
+        if (is_bitmap()) return (words[low >> 6] >> (low & 63)) & 1;
+        return std::binary_search(array.begin(), array.end(), low);
+    }
+
+    void to_bitmap() {
+        if (is_bitmap()) return;
+        words.assign(ROARING_WORDS, 0);
+        for (uint16_t v : array) words[v >> 6] |= uint64_t(1) << (v & 63);
+        array.clear();
+        array.shrink_to_fit();
+    }
+
+    // Picks the smaller representation for the current cardinality.
+    void normalize() {
+        if (is_bitmap() && card <= ROARING_ARRAY_MAX) {
+            array.clear();
+            array.reserve(card);
+            for (uint32_t w = 0; w < ROARING_WORDS; w++) {
+                uint64_t word = words[w];
+                while (word) {
+                    array.push_back(uint16_t(w * 64 + (uint32_t)__builtin_ctzll(word)));
+                    word &= word - 1;
+                }
+            }
+            words.clear();
+            words.shrink_to_fit();
+        } else if (!is_bitmap() && card > ROARING_ARRAY_MAX) {
+            to_bitmap();
+        }
+    }
+
+    void recount() {
+        card = 0;
+        for (uint64_t w : words) card += (uint32_t)__builtin_popcountll(w);
+    }
+};
+
+class Roaring {
+public:
+    std::vector<Container> chunks; // sorted by key, never empty containers
+
+    static Roaring from_sorted(const uint32_t* docs, size_t n) {
+        Roaring r;
+        size_t i = 0;
+        while (i < n) {
+            Container c;
+            c.key = uint16_t(docs[i] >> 16);
+            while (i < n && (docs[i] >> 16) == c.key) c.array.push_back(uint16_t(docs[i++] & 0xFFFF));
+            c.card = (uint32_t)c.array.size();
+            c.normalize();
+            r.chunks.push_back(std::move(c));
+        }
+        return r;
+    }
+
+    // Reads a list stored with Codec::Roaring; with a range, only its docs in
+    // [lo, hi], copying just the containers that overlap it.
+    static Roaring from_packed(const uint8_t* list, uint32_t lo = 0, uint32_t hi = UINT32_MAX) {
+        Roaring r;
+        roaring_for_each_chunk(list, [&](uint32_t key, bool bitmap, uint32_t card, const uint8_t* p) {
+            if (key < (lo >> 16) || key > (hi >> 16)) return;
+            Container c;
+            c.key = uint16_t(key);
+            c.card = card;
+            if (bitmap) {
+                c.words.resize(ROARING_WORDS);
+                std::memcpy(c.words.data(), p, ROARING_WORDS * 8);
+            } else {
+                c.array.resize(card);
+                std::memcpy(c.array.data(), p, (size_t)card * 2);
+            }
+            if (key == (lo >> 16) || key == (hi >> 16)) {
+                trim(c, lo, hi);
+                push(r, std::move(c));
+            } else {
+                r.chunks.push_back(std::move(c));
+            }
+        });
+        return r;
+    }
+
+    // The members in [lo, hi].
+    Roaring slice(uint32_t lo, uint32_t hi) const {
+        Roaring r;
+        for (const auto& c : chunks) {
+            if (c.key < (lo >> 16) || c.key > (hi >> 16)) continue;
+            Container k = c;
+            if (c.key == (lo >> 16) || c.key == (hi >> 16)) {
+                trim(k, lo, hi);
+                push(r, std::move(k));
+            } else {
+                r.chunks.push_back(std::move(k));
+            }
+        }
+        return r;
+    }
+
+    uint64_t cardinality() const {
+        uint64_t n = 0;
+        for (const auto& c : chunks) n += c.card;
+        return n;
+    }
+
+    bool contains(uint32_t d) const {
+        auto it = find(uint16_t(d >> 16));
+        return it != chunks.end() && it->contains(uint16_t(d & 0xFFFF));
+    }
+
+    void to_sorted(std::vector<uint32_t>& out) const {
+        out.clear();
+        out.reserve(cardinality());
+        for (const auto& c : chunks) {
+            uint32_t high = uint32_t(c.key) << 16;
+            if (!c.is_bitmap()) {
+                for (uint16_t v : c.array) out.push_back(high | v);
+                continue;
+            }
+            for (uint32_t w = 0; w < ROARING_WORDS; w++) {
+                uint64_t word = c.words[w];
+                while (word) {
+                    out.push_back(high | (w * 64 + (uint32_t)__builtin_ctzll(word)));
+                    word &= word - 1;
+                }
+            }
+        }
+    }
+
+    // Keeps the elements of a sorted array that are (or are not) in this set:
+    // one bit test per element, cost O(n) regardless of the set size.
+    void filter(const uint32_t* docs, size_t n, bool keep_members, std::vector<uint32_t>& out) const {
+        auto it = chunks.begin();
+        for (size_t i = 0; i < n; i++) {
+            uint16_t key = uint16_t(docs[i] >> 16);
+            while (it != chunks.end() && it->key < key) ++it;
+            bool member = it != chunks.end() && it->key == key && it->contains(uint16_t(docs[i] & 0xFFFF));
+            if (member == keep_members) out.push_back(docs[i]);
+        }
+    }
+
+    static Roaring op_and(const Roaring& a, const Roaring& b) {
+        Roaring r;
+        size_t i = 0, j = 0;
+        while (i < a.chunks.size() && j < b.chunks.size()) {
+            const Container& x = a.chunks[i];
+            const Container& y = b.chunks[j];
+            if (x.key < y.key) { i++; continue; }
+            if (y.key < x.key) { j++; continue; }
+            Container c;
+            c.key = x.key;
+            if (x.is_bitmap() && y.is_bitmap()) {
+                c.words.resize(ROARING_WORDS);
+                for (uint32_t w = 0; w < ROARING_WORDS; w++) c.words[w] = x.words[w] & y.words[w];
+                c.recount();
+            } else if (x.is_bitmap() || y.is_bitmap()) {
+                const Container& arr = x.is_bitmap() ? y : x;
+                const Container& bits = x.is_bitmap() ? x : y;
+                for (uint16_t v : arr.array) if (bits.contains(v)) c.array.push_back(v);
+                c.card = (uint32_t)c.array.size();
+            } else {
+                std::set_intersection(x.array.begin(), x.array.end(), y.array.begin(), y.array.end(),
+                                      std::back_inserter(c.array));
+                c.card = (uint32_t)c.array.size();
+            }
+            push(r, std::move(c));
+            i++;
+            j++;
+        }
+        return r;
+    }
+
+    static Roaring op_or(const Roaring& a, const Roaring& b) {
+        Roaring r;
+        size_t i = 0, j = 0;
+        while (i < a.chunks.size() || j < b.chunks.size()) {
+            if (j == b.chunks.size() || (i < a.chunks.size() && a.chunks[i].key < b.chunks[j].key)) {
+                r.chunks.push_back(a.chunks[i++]);
+                continue;
+            }
+            if (i == a.chunks.size() || b.chunks[j].key < a.chunks[i].key) {
+                r.chunks.push_back(b.chunks[j++]);
+                continue;
+            }
+            const Container& x = a.chunks[i++];
+            const Container& y = b.chunks[j++];
+            Container c;
+            c.key = x.key;
+            if (!x.is_bitmap() && !y.is_bitmap() && x.card + y.card <= ROARING_ARRAY_MAX) {
+                std::set_union(x.array.begin(), x.array.end(), y.array.begin(), y.array.end(),
+                               std::back_inserter(c.array));
+                c.card = (uint32_t)c.array.size();
+            } else {
+                c = x;
+                c.to_bitmap();
+                if (y.is_bitmap()) {
+                    for (uint32_t w = 0; w < ROARING_WORDS; w++) c.words[w] |= y.words[w];
+                } else {
+                    for (uint16_t v : y.array) c.words[v >> 6] |= uint64_t(1) << (v & 63);
+                }
+                c.recount();
+            }
+            push(r, std::move(c));
+        }
+        return r;
+    }
+
+    static Roaring op_andnot(const Roaring& a, const Roaring& b) {
+        Roaring r;
+        size_t j = 0;
+        for (const Container& x : a.chunks) {
+            while (j < b.chunks.size() && b.chunks[j].key < x.key) j++;
+            if (j == b.chunks.size() || b.chunks[j].key != x.key) {
+                r.chunks.push_back(x);
+                continue;
+            }
+            const Container& y = b.chunks[j];
+            Container c;
+            c.key = x.key;
+            if (x.is_bitmap()) {
+                c.words = x.words;
+                if (y.is_bitmap()) {
+                    for (uint32_t w = 0; w < ROARING_WORDS; w++) c.words[w] &= ~y.words[w];
+                } else {
+                    for (uint16_t v : y.array) c.words[v >> 6] &= ~(uint64_t(1) << (v & 63));
+                }
+                c.recount();
+            } else {
+                for (uint16_t v : x.array) if (!y.contains(v)) c.array.push_back(v);
+                c.card = (uint32_t)c.array.size();
+            }
+            push(r, std::move(c));
+        }
+        return r;
+    }
+
+    // Complement of `a` inside [lo, hi]: full bitmaps minus the members, word by word.
+    static Roaring op_not(const Roaring& a, uint32_t lo, uint32_t hi) {
+        Roaring r;
+        if (lo > hi) return r;
+        auto it = a.chunks.begin();
+        for (uint32_t key = lo >> 16; key <= (hi >> 16); key++) {
+            Container c;
+            c.key = uint16_t(key);
+            c.words.assign(ROARING_WORDS, ~uint64_t(0));
+            uint32_t first = key == (lo >> 16) ? (lo & 0xFFFF) : 0;
+            uint32_t last = key == (hi >> 16) ? (hi & 0xFFFF) : 0xFFFF;
+            clear_range(c.words, 0, first);
+            clear_range(c.words, last + 1, 65536);
+
+            while (it != a.chunks.end() && it->key < key) ++it;
+            if (it != a.chunks.end() && it->key == key) {
+                if (it->is_bitmap()) {
+                    for (uint32_t w = 0; w < ROARING_WORDS; w++) c.words[w] &= ~it->words[w];
+                } else {
+                    for (uint16_t v : it->array) c.words[v >> 6] &= ~(uint64_t(1) << (v & 63));
+                }
+            }
+            c.recount();
+            push(r, std::move(c));
+        }
+        return r;
+    }
+
+private:
+    std::vector<Container>::const_iterator find(uint16_t key) const {
+        auto it = std::lower_bound(chunks.begin(), chunks.end(), key,
+                                   [](const Container& c, uint16_t k) { return c.key < k; });
+        if (it != chunks.end() && it->key != key) return chunks.end();
+        return it;
+    }
+
+    static void push(Roaring& r, Container&& c) {
+        if (c.card == 0) return;
+        c.normalize();
+        r.chunks.push_back(std::move(c));
+    }
+
+    // Drops the members of a container outside the doc range [lo, hi].
+    static void trim(Container& c, uint32_t lo, uint32_t hi) {
+        uint32_t first = c.key == (lo >> 16) ? (lo & 0xFFFF) : 0;
+        uint32_t last = c.key == (hi >> 16) ? (hi & 0xFFFF) : 0xFFFF;
+        if (c.is_bitmap()) {
+            clear_range(c.words, 0, first);
+            clear_range(c.words, last + 1, 65536);
+            c.recount();
+            return;
+        }
+        auto b = std::lower_bound(c.array.begin(), c.array.end(), first);
+        auto e = std::upper_bound(b, c.array.end(), last);
+        c.array.erase(e, c.array.end());
+        c.array.erase(c.array.begin(), b);
+        c.card = (uint32_t)c.array.size();
+    }
+
+    // Clears bits [from, to) of a chunk bitmap.
+    static void clear_range(std::vector<uint64_t>& words, uint32_t from, uint32_t to) {
+        for (uint32_t b = from; b < to;) {
+            if ((b & 63) == 0 && b + 64 <= to) {
+                words[b >> 6] = 0;
+                b += 64;
+            } else {
+                words[b >> 6] &= ~(uint64_t(1) << (b & 63));
+                b++;
+            }
+        }
+    }
+};
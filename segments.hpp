@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index_format.hpp"
+#include "positions.hpp"
+#include "ranking.hpp"
+#include "roaring.hpp"
+
+// Segmented index directory, written by build_index --segments and searched by
+// boolean_search --segments:
+//
+//   <dir>/segments.tsv       manifest; replaced atomically (write + rename)
+//   <dir>/seg_<n>/           immutable index as written by build_index (index.bin, tf.bin, ...,
+//                            positions.bin with --positions) plus docs.bin: every doc id of the batch
+//   <dir>/del_<seg>_<gen>.bin deleted docs of a segment; every change writes a new file
+//   <dir>/write.lock         flock'ed by writers; readers never lock
+//
+// A doc id is live in at most one segment: adding a batch deletes its ids from
+// all other segments, so a changed article simply replaces the old version.
+// Doc sets (docs.bin, del_*.bin) use the Roaring postings format.
+//
+// Manifest:
+//   generation <tab> N
+//   next <tab> next segment number
+//   <name> <tab> docs <tab> deleted <tab> del file or "-"     one line per live segment
+
+static constexpr const char* MANIFEST_FILE = "segments.tsv";
+
+struct SegmentInfo {
+    std::string name;
+    uint32_t docs = 0;
+    uint32_t deleted = 0;
+    std::string del_file; // empty: nothing deleted
+
+    uint32_t live() const { return docs - deleted; }
+};
+
+struct Manifest {
+    uint64_t generation = 0;
+    uint32_t next_id = 1;
+    std::vector<SegmentInfo> segments;
+
+    // A missing manifest is an empty index.
+    static Manifest load(const std::string& dir) {
+        Manifest m;
+        std::ifstream in(dir + "/" + MANIFEST_FILE, std::ios::binary);
+        if (!in) return m;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty()) continue;
+            std::istringstream ss(line);
+            std::string key;
+            std::getline(ss, key, '\t');
+            if (key == "generation") {
+                ss >> m.generation;
+            } else if (key == "next") {
+                ss >> m.next_id;
+            } else {
+                SegmentInfo s;
+                s.name = key;
+                std::string del;
+                if (!(ss >> s.docs >> s.deleted >> del)) throw std::runtime_error("Bad manifest line: " + line);
+                if (del != "-") s.del_file = del;
+                m.segments.push_back(s);
+            }
+        }
+        return m;
+    }
+
+    // Bumps the generation and replaces the manifest in one rename, so readers
+    // see either the old or the new segment list.
+    void save(const std::string& dir) {
+        generation++;
+        std::string path = dir + "/" + MANIFEST_FILE;
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out << "generation\t" << generation << "\n";
+            out << "next\t" << next_id << "\n";
+            for (const auto& s : segments) {
+                out << s.name << "\t" << s.docs << "\t" << s.deleted << "\t"
+                    << (s.del_file.empty() ? "-" : s.del_file) << "\n";
+            }
+            if (!out) throw std::runtime_error("Cannot write manifest: " + tmp);
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) throw std::runtime_error("Cannot replace manifest: " + path);
+    }
+};
+
+inline void write_doc_set(const std::string& path, const std::vector<uint32_t>& docs) {
+    std::vector<uint8_t> buf;
+    encode_postings(Codec::Roaring, docs, buf);
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(buf.data()), (std::streamsize)buf.size());
+    if (!out) throw std::runtime_error("Cannot write doc set: " + path);
+}
+
+inline Roaring read_doc_set(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open doc set: " + path);
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (buf.size() < 4) throw std::runtime_error("Bad doc set: " + path);
+    return Roaring::from_packed(buf.data());
+}
+
+// Exclusive writer lock of a segmented index, held for the object's lifetime.
+class WriteLock {
+public:
+    explicit WriteLock(const std::string& dir) {
+        std::string path = dir + "/write.lock";
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0) throw std::runtime_error("Cannot open lock: " + path);
+        if (flock(fd_, LOCK_EX) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("Cannot lock: " + path);
+        }
+    }
+    WriteLock(const WriteLock&) = delete;
+    WriteLock& operator=(const WriteLock&) = delete;
+    ~WriteLock() { ::close(fd_); }
+
+private:
+    int fd_ = -1;
+};
+
+// One opened segment: its mapped index and the docs that are still live in it.
+struct Segment {
+    std::string name;
+    Index index;
+    Positions positions; // not loaded when the segment has no positions.bin
+    TfIndex tf;          // not loaded for segments written before tf.bin existed
+    Roaring live;
+};
+
+// Segments of one manifest generation. Readers keep a snapshot for the whole
+// query; a newer one is opened next to it when the manifest is replaced.
+struct SegmentSnapshot {
+    uint64_t generation = 0;
+    std::vector<std::unique_ptr<Segment>> segments;
+    uint64_t live_docs = 0;
+    uint64_t terms = 0;
+    uint32_t maxdoc = 0;
+
+    static std::shared_ptr<SegmentSnapshot> open(const std::string& dir) {
+        auto snap = std::make_shared<SegmentSnapshot>();
+        Manifest m = Manifest::load(dir);
+        snap->generation = m.generation;
+        for (const auto& info : m.segments) {
+            auto seg = std::make_unique<Segment>();
+            seg->name = info.name;
+            seg->index.open_bin(dir + "/" + info.name + "/index.bin");
+            std::string pos = dir + "/" + info.name + "/positions.bin";
+            if (std::ifstream(pos).good()) seg->positions.open(pos);
+            std::string tf = dir + "/" + info.name + "/tf.bin";
+            if (std::ifstream(tf).good()) seg->tf.open(tf);
+            seg->live = read_doc_set(dir + "/" + info.name + "/docs.bin");
+            if (!info.del_file.empty()) seg->live = Roaring::op_andnot(seg->live, read_doc_set(dir + "/" + info.del_file));
+            snap->live_docs += seg->live.cardinality();
+            snap->terms += seg->index.size();
+            snap->maxdoc = std::max(snap->maxdoc, seg->index.maxdoc);
+            snap->segments.push_back(std::move(seg));
+        }
+        return snap;
+    }
+};
+
+// Reader side: follows the manifest. refresh() is a stat() per call and opens
+// the new generation only when the manifest file was replaced; queries running
+// on the previous snapshot keep it alive (mapped files stay valid after unlink).
+// Safe to share between threads: refresh and snapshot take the same lock.
+class SegmentSet {
+public:
+    explicit SegmentSet(std::string dir) : dir_(std::move(dir)) {}
+
+    // Returns true when a new generation was loaded.
+    bool refresh() {
+        std::lock_guard<std::mutex> lk(m_);
+        struct stat st;
+        std::string path = dir_ + "/" + MANIFEST_FILE;
+        if (stat(path.c_str(), &st) != 0) {
+            if (!snap_) snap_ = std::make_shared<SegmentSnapshot>();
+            return false;
+        }
+        if (snap_ && st.st_ino == ino_ && st.st_mtim.tv_sec == mtime_.tv_sec && st.st_mtim.tv_nsec == mtime_.tv_nsec) {
+            return false;
+        }
+        // a merge may remove old segment files between reading the manifest
+        // and opening them; the next manifest is already in place then
+        for (int attempt = 0;; attempt++) {
+            try {
+                snap_ = SegmentSnapshot::open(dir_);
+                break;
+            } catch (const std::exception&) {
+                if (attempt == 2) {
+                    if (snap_) return false; // keep serving the last good generation
+                    throw;
+                }
+                usleep(10000);
+                stat(path.c_str(), &st);
+            }
+        }
+        ino_ = st.st_ino;
+        mtime_ = st.st_mtim;
+        return true;
+    }
+
+    std::shared_ptr<const SegmentSnapshot> snapshot() const {
+        std::lock_guard<std::mutex> lk(m_);
+        return snap_;
+    }
+
+private:
+    mutable std::mutex m_;
+    std::string dir_;
+    std::shared_ptr<SegmentSnapshot> snap_;
+    ino_t ino_ = 0;
+    struct timespec mtime_ = {};
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Query server: one process, one read-only index shared by all threads.
+//
+//   listener      accepts connections on a TCP port or a Unix socket
+//   connection    one thread per client; reads a query line, queues it, waits
+//                 for the answer and writes it back, so replies keep query order
+//   workers       `workers` threads take queued queries and run the handler;
+//                 this is the concurrency limit of query evaluation
+//
+// The protocol is the REPL's: a query per line, the reply is the same block the
+// REPL prints (RESULTS n ... END, PLAN ... END or ERROR ...). When `queue_depth`
+// queries are already waiting, a new one is answered "ERROR server busy" at once
+// instead of piling up, and a client connecting while `max_connections` are
+// open gets "ERROR server busy" and is closed. A last query line without its
+// newline is answered when the client closes, as the REPL's getline does.
+// SIGINT/SIGTERM stop the listener, drop the clients and let running queries
+// finish.
+
+struct ServerOptions {
+    std::string listen;           // unix:/path, tcp:host:port, host:port or port
+    unsigned workers = 0;         // 0 = hardware threads
+    size_t queue_depth = 64;      // queries waiting for a worker
+    size_t max_connections = 256; // open client connections (one thread each)
+    size_t max_line = 1 << 16;    // longer query lines close the connection
+};
+
+class QueryServer {
+public:
+    // Writes the reply to one query line; called concurrently from the workers.
+    using Handler = std::function<void(const std::string& query, std::ostream& out)>;
+
+    QueryServer(ServerOptions opt, Handler handler) : opt_(std::move(opt)), handler_(std::move(handler)) {
+        if (opt_.workers == 0) opt_.workers = std::max(1u, std::thread::hardware_concurrency());
+        if (opt_.queue_depth == 0) opt_.queue_depth = 1;
+        if (opt_.max_connections == 0) opt_.max_connections = 1;
+    }
+
+    // Serves until SIGINT/SIGTERM; returns the process exit code.
+    int run() {
+        try {
+            listen_fd_ = open_listener();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        stop_flag() = 0;
+        std::signal(SIGINT, on_signal);
+        std::signal(SIGTERM, on_signal);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < opt_.workers; i++) workers.emplace_back([this] { work(); });
+        std::cerr << "Listening on " << opt_.listen << " (workers " << opt_.workers << ", queue " << opt_.queue_depth
+                  << ", connections " << opt_.max_connections << ")\n";
+
+        while (!stop_flag()) {
+            pollfd p{listen_fd_, POLLIN, 0};
+            if (poll(&p, 1, 200) <= 0) continue; // timeout or EINTR: recheck the flag
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) continue;
+            std::lock_guard<std::mutex> lk(conn_m_);
+            reap_connections();
+            if (conns_.size() >= opt_.max_connections) {
+                refused_++;
+                send_all(fd, "ERROR server busy\n");
+                ::close(fd);
+                continue;
+            }
+            conns_.emplace_back();
+            Connection& c = conns_.back();
+            c.fd = fd;
+            c.thread = std::thread([this, &c] { serve(c); });
+        }
+
+        ::close(listen_fd_);
+        if (!unix_path_.empty()) unlink(unix_path_.c_str());
+        {
+            std::lock_guard<std::mutex> lk(conn_m_);
+            for (auto& c : conns_) {
+                if (c.fd >= 0) shutdown(c.fd, SHUT_RDWR);
+            }
+        }
+        for (auto& c : conns_) c.thread.join();
+        {
+            std::lock_guard<std::mutex> lk(queue_m_);
+            closing_ = true;
+        }
+        queue_cv_.notify_all();
+        for (auto& w : workers) w.join();
+        std::cerr << "Served " << served_ << " queries, rejected " << rejected_ << " (queue full), refused " << refused_
+                  << " connections\n";
+        return 0;
+    }
+
+private:
+    struct Job {
+        std::string query;
+        std::promise<std::string> reply;
+    };
+
+    struct Connection {
+        int fd = -1; // -1 once closed, guarded by conn_m_
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    ServerOptions opt_;
+    Handler handler_;
+    int listen_fd_ = -1;
+    std::string unix_path_;
+
+    std::mutex queue_m_;
+    std::condition_variable queue_cv_;
+    std::deque<Job*> queue_;
+    bool closing_ = false;
+
+    std::mutex conn_m_;
+    std::list<Connection> conns_; // stable addresses for the threads
+    std::atomic<uint64_t> served_{0}, rejected_{0}, refused_{0};
+
+    static volatile std::sig_atomic_t& stop_flag() {
+        static volatile std::sig_atomic_t flag = 0;
+        return flag;
+    }
+
+    static void on_signal(int) { stop_flag() = 1; }
+
+    int open_listener() {
+        std::string a = opt_.listen;
+        if (a.compare(0, 5, "unix:") == 0) {
+            unix_path_ = a.substr(5);
+            sockaddr_un sa{};
+            if (unix_path_.empty() || unix_path_.size() >= sizeof(sa.sun_path)) {
+                throw std::runtime_error("Bad unix socket path: " + unix_path_);
+            }
+            sa.sun_family = AF_UNIX;
+            std::memcpy(sa.sun_path, unix_path_.c_str(), unix_path_.size() + 1);
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) throw std::runtime_error("Cannot create socket");
+            unlink(unix_path_.c_str()); // stale socket of a previous run
+            if (bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 || ::listen(fd, 128) != 0) {
+                std::string err = std::strerror(errno);
+                ::close(fd);
+                throw std::runtime_error("Cannot listen on " + a + ": " + err);
+            }
+            return fd;
+        }
+
+        if (a.compare(0, 4, "tcp:") == 0) a = a.substr(4);
+        std::string host = "127.0.0.1", port = a;
+        size_t colon = a.rfind(':');
+        if (colon != std::string::npos) {
+            host = a.substr(0, colon);
+            port = a.substr(colon + 1);
+        }
+        sockaddr_in sa{};
+        sa.sin_family = AF_INET;
+        char* end = nullptr;
+        unsigned long p = std::strtoul(port.c_str(), &end, 10);
+        if (port.empty() || *end || p == 0 || p > 65535 || inet_pton(AF_INET, host.c_str(), &sa.sin_addr) != 1) {
+            throw std::runtime_error("Bad listen address: " + opt_.listen + " (expected unix:/path or [host:]port)");
+        }
+        sa.sin_port = htons((uint16_t)p);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Cannot create socket");
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 || ::listen(fd, 128) != 0) {
+            std::string err = std::strerror(errno);
+            ::close(fd);
+            throw std::runtime_error("Cannot listen on " + opt_.listen + ": " + err);
+        }
+        return fd;
+    }
+
+    // Joins the threads of closed connections; called with conn_m_ held.
+    void reap_connections() {
+        for (auto it = conns_.begin(); it != conns_.end();) {
+            if (it->done) {
+                it->thread.join();
+                it = conns_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    static bool send_all(int fd, const std::string& s) {
+        size_t off = 0;
+        while (off < s.size()) {
+            ssize_t n = send(fd, s.data() + off, s.size() - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            off += (size_t)n;
+        }
+        return true;
+    }
+
+    // Hands a query to the workers; false when the queue is full.
+    bool submit(Job& job) {
+        {
+            std::lock_guard<std::mutex> lk(queue_m_);
+            if (queue_.size() >= opt_.queue_depth) return false;
+            queue_.push_back(&job);
+        }
+        queue_cv_.notify_one();
+        return true;
+    }
+
+    void work() {
+        for (;;) {
+            Job* job;
+            {
+                std::unique_lock<std::mutex> lk(queue_m_);
+                queue_cv_.wait(lk, [this] { return closing_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                job = queue_.front();
+                queue_.pop_front();
+            }
+            // the connection may drop the job as soon as the reply is set
+            std::promise<std::string> reply = std::move(job->reply);
+            std::ostringstream out;
+            try {
+                handler_(job->query, out);
+            } catch (const std::exception& e) {
+                out << "ERROR " << e.what() << "\n";
+            }
+            served_++;
+            reply.set_value(out.str());
+        }
+    }
+
+    // Answers one query line; false once the client cannot be written to.
+    bool answer(int fd, std::string query) {
+        if (!query.empty() && query.back() == '\r') query.pop_back();
+        if (query.empty()) return true;
+        Job job;
+        job.query = std::move(query);
+        std::future<std::string> reply = job.reply.get_future();
+        std::string out;
+        if (submit(job)) {
+            out = reply.get();
+        } else {
+            rejected_++;
+            out = "ERROR server busy\n";
+        }
+        return send_all(fd, out);
+    }
+
+    void serve(Connection& c) {
+        std::string buf;
+        char chunk[4096];
+        bool open = true;
+        while (open) {
+            ssize_t n = recv(c.fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 && !buf.empty()) answer(c.fd, std::move(buf)); // last line without '\n'
+            if (n <= 0) break;
+            buf.append(chunk, (size_t)n);
+            size_t start = 0, nl;
+            while (open && (nl = buf.find('\n', start)) != std::string::npos) {
+                open = answer(c.fd, buf.substr(start, nl - start));
+                start = nl + 1;
+            }
+            buf.erase(0, start);
+            if (buf.size() > opt_.max_line) {
+                send_all(c.fd, "ERROR query line too long\n");
+                break;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lk(conn_m_);
+            ::close(c.fd);
+            c.fd = -1;
+        }
+        c.done = true;
+    }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "postings_codec.hpp"
+
+// Intersection and difference of sorted doc id lists.
+//
+// intersect_adaptive picks the algorithm from the list sizes:
+//   - skewed sizes (ratio >= GALLOP_RATIO): galloping search of the small list in the large one;
+//   - similar sizes: SIMD block compare (AVX2 8x8 or SSE2 4x4), plain merge without SIMD.
+// intersect_packed works on an svb list directly and uses its block directory as skip
+// pointers, so blocks that cannot contain a candidate are never decoded.
+// subtract_* compute a \ b with the same size-based choice (merge or galloping probes).
+
+static constexpr size_t GALLOP_RATIO = 32;
+
+inline void intersect_merge(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, std::vector<uint32_t>& out) {
+    size_t i = 0, j = 0;
+    while (i < na && j < nb) {
+        if (a[i] == b[j]) { out.push_back(a[i]); i++; j++; }
+        else if (a[i] < b[j]) i++;
+        else j++;
+    }
+}
+
+// `a` is the small list.
+inline void intersect_gallop(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, std::vector<uint32_t>& out) {
+    size_t lo = 0;
+    for (size_t i = 0; i < na && lo < nb; i++) {
+        uint32_t x = a[i];
+        size_t step = 1;
+        size_t hi = lo;
+        while (hi < nb && b[hi] < x) {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        hi = std::min(hi + 1, nb);
+        lo = (size_t)(std::lower_bound(b + lo, b + hi, x) - b);
+        if (lo < nb && b[lo] == x) out.push_back(x);
+    }
+}
+
+#ifdef IR_X86
+__attribute__((target("sse2")))
+inline size_t intersect_sse2_blocks(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                                    size_t& i, size_t& j, std::vector<uint32_t>& out) {
+    size_t found = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        __m128i m = _mm_cmpeq_epi32(va, vb);
+        m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+        while (mask) {
+            out.push_back(a[i + __builtin_ctz(mask)]);
+            mask &= mask - 1;
+            found++;
+        }
+        uint32_t amax = a[i + 3], bmax = b[j + 3];
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+    return found;
+}
+
+__attribute__((target("avx2")))
+inline size_t intersect_avx2_blocks(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                                    size_t& i, size_t& j, std::vector<uint32_t>& out) {
+    size_t found = 0;
+    const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+        __m256i m = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; r++) {
+            vb = _mm256_permutevar8x32_epi32(vb, rot);
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb));
+        }
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+        while (mask) {
+            out.push_back(a[i + __builtin_ctz(mask)]);
+            mask &= mask - 1;
+            found++;
+        }
+        uint32_t amax = a[i + 7], bmax = b[j + 7];
+        if (amax <= bmax) i += 8;
+        if (bmax <= amax) j += 8;
+    }
+    return found;
+}
+
+inline bool cpu_has_avx2() {
+    static const bool ok = __builtin_cpu_supports("avx2");
+    return ok;
+}
+#endif
+
+inline void intersect_simd(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, std::vector<uint32_t>& out) {
+    size_t i = 0, j = 0;
+#ifdef IR_X86
+    if (cpu_has_avx2()) intersect_avx2_blocks(a, na, b, nb, i, j, out);
+    intersect_sse2_blocks(a, na, b, nb, i, j, out);
+#endif
+    intersect_merge(a + i, na - i, b + j, nb - j, out);
+}
+
+inline void intersect_adaptive(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, std::vector<uint32_t>& out) {
+    if (na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    out.reserve(out.size() + na);
+    if (na == 0) return;
+    if (nb / na >= GALLOP_RATIO) intersect_gallop(a, na, b, nb, out);
+    else intersect_simd(a, na, b, nb, out);
+}
+
+// `a` is a decoded (small) list, the other side an svb list of `df` docs.
+inline void intersect_packed(const uint32_t* a, size_t na, const uint8_t* list, size_t len, uint32_t df,
+                             std::vector<uint32_t>& out) {
+    uint32_t nblocks = svb_num_blocks(df);
+    uint32_t block[POSTINGS_BLOCK];
+    uint32_t cur = nblocks; // decoded block
+    uint32_t n = 0, pos = 0;
+    uint32_t b = 0;
+
+    for (size_t i = 0; i < na; i++) {
+        uint32_t x = a[i];
+        while (b < nblocks && load_u32(list + (size_t)b * 4) < x) b++; // skip by last doc of each block
+        if (b == nblocks) break;
+        if (b != cur) {
+            n = svb_decode_block(list, len, df, b, block);
+            cur = b;
+            pos = 0;
+        }
+        while (pos < n && block[pos] < x) pos++;
+        if (pos < n && block[pos] == x) out.push_back(x);
+    }
+}
+
+inline void subtract_merge(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, std::vector<uint32_t>& out) {
+    size_t i = 0, j = 0;
+    while (i < na && j < nb) {
+        if (a[i] == b[j]) { i++; j++; }
+        else if (a[i] < b[j]) out.push_back(a[i++]);
+        else j++;
+    }
+    while (i < na) out.push_back(a[i++]);
+}
+
+// Galloping probes of every element of the small `a` into the large `b`.
+inline void subtract_gallop(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, std::vector<uint32_t>& out) {
+    size_t lo = 0;
+    for (size_t i = 0; i < na; i++) {
+        uint32_t x = a[i];
+        size_t step = 1;
+        size_t hi = lo;
+        while (hi < nb && b[hi] < x) {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        hi = std::min(hi + 1, nb);
+        lo = (size_t)(std::lower_bound(b + lo, b + hi, x) - b);
+        if (lo == nb || b[lo] != x) out.push_back(x);
+    }
+}
+
+inline void subtract_adaptive(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, std::vector<uint32_t>& out) {
+    out.reserve(out.size() + na);
+    if (na > 0 && nb / na >= GALLOP_RATIO) subtract_gallop(a, na, b, nb, out);
+    else subtract_merge(a, na, b, nb, out);
+}
+
+// a \ b where b is an svb list; only blocks that can hold an element of `a` are decoded.
+inline void subtract_packed(const uint32_t* a, size_t na, const uint8_t* list, size_t len, uint32_t df,
+                            std::vector<uint32_t>& out) {
+    uint32_t nblocks = svb_num_blocks(df);
+    uint32_t block[POSTINGS_BLOCK];
+    uint32_t cur = nblocks;
+    uint32_t n = 0, pos = 0;
+    uint32_t b = 0;
+
+    for (size_t i = 0; i < na; i++) {
+        uint32_t x = a[i];
+        while (b < nblocks && load_u32(list + (size_t)b * 4) < x) b++;
+        if (b == nblocks) {
+            out.insert(out.end(), a + i, a + na);
+            break;
+        }
+        if (b != cur) {
+            n = svb_decode_block(list, len, df, b, block);
+            cur = b;
+            pos = 0;
+        }
+        while (pos < n && block[pos] < x) pos++;
+        if (pos == n || block[pos] != x) out.push_back(x);
+    }
+}
@@ -1,51 +1,240 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <mutex>
 #include <string>
 #include <vector>
-#include <filesystem>
-#include <fstream>
+
+#include "parallel.hpp"
+#include "stemmer.hpp"
 
 namespace fs = std::filesystem;
 
-static bool ends_with(const std::string& w, const std::string& suf) {
-    return w.size() >= suf.size() &&
-           w.compare(w.size() - suf.size(), suf.size(), suf) == 0;
+static void print_usage() {
+    std::cerr
+        << "Usage:\n"
+        << "  stem < tokens.tok > stems.stm\n"
+        << "  stem --dir <tokens_dir> --out <out_dir> [--threads N]\n"
+        << "  stem --verify (--file <path> | --dir <tokens_dir>)\n"
+        << "\n"
+        << "Modes:\n"
+        << "  (none): stem whitespace-separated tokens from stdin, one stem per line to stdout\n"
+        << "  --dir : stem all .tok files in a directory, write stem lists to out_dir/<same_name>.stm\n"
+        << "          --threads N spreads the files over N worker threads (0 = all cores)\n"
+        << "  --verify: differential check of the table stemmer and its memo against the reference rules\n";
 }
 
-static void replace_suffix(std::string& w, const std::string& suf, const std::string& repl) {
-    w.replace(w.size() - suf.size(), suf.size(), repl);
+// Whitespace-separated tokens of a whole file, as std::cin >> would split them.
+template <class F>
+static void for_each_token(const std::string& text, F&& fn) {
+    size_t i = 0, n = text.size();
+    while (i < n) {
+        while (i < n && std::isspace((unsigned char)text[i])) i++;
+        size_t start = i;
+        while (i < n && !std::isspace((unsigned char)text[i])) i++;
+        if (i > start) fn(std::string_view(text.data() + start, i - start));
+    }
 }
 
-static std::string stem_word(std::string w) {
-    if (w.size() < 3) return w;
+static bool read_file(const fs::path& p, std::string& text) {
+    std::ifstream in(p, std::ios::binary);
+    if (!in) return false;
+    text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
 
-    // plural
-    if (ends_with(w, "sses")) replace_suffix(w, "sses", "ss");
-    else if (ends_with(w, "ies")) replace_suffix(w, "ies", "i");
-    else if (ends_with(w, "s") && !ends_with(w, "ss")) w.pop_back();
+// Differential test: stem_into and StemCache must give the reference stem for
+// every token; the memo is asked twice so hits are checked as well as misses.
+static bool verify_file(const fs::path& p, StemCache& memo) {
+    std::string text;
+    if (!read_file(p, text)) {
+        std::cerr << "Cannot open file: " << p.string() << "\n";
+        return false;
+    }
+    bool ok = true;
+    std::string got;
+    for_each_token(text, [&](std::string_view t) {
+        if (!ok) return;
+        std::string expect = stem_word_reference(std::string(t));
+        stem_into(t, got);
+        if (got != expect || memo.stem(t) != expect || memo.stem(t) != expect) {
+            std::cerr << "MISMATCH " << p.string() << " token '" << t << "': expected '" << expect << "', got '"
+                      << got << "'\n";
+            ok = false;
+        }
+    });
+    return ok;
+}
 
-    // past / gerund
-    if (ends_with(w, "ing") && w.size() > 5) w.erase(w.size() - 3);
-    else if (ends_with(w, "ed") && w.size() > 4) w.erase(w.size() - 2);
+// Outcome of one file in --dir mode.
+struct FileResult {
+    bool done = false;
+    bool ok = false;
+    std::uint64_t tokens = 0;
+    std::uint64_t memo_hits = 0;
+    std::string skip_msg;
+};
 
-    // common suffixes
-    if (ends_with(w, "ational")) replace_suffix(w, "ational", "ate");
-    else if (ends_with(w, "tional")) replace_suffix(w, "tional", "tion");
-    else if (ends_with(w, "izer")) replace_suffix(w, "izer", "ize");
-    else if (ends_with(w, "ness")) w.erase(w.size() - 4);
-    else if (ends_with(w, "ment")) w.erase(w.size() - 4);
-    else if (ends_with(w, "ful")) w.erase(w.size() - 3);
-    else if (ends_with(w, "less")) w.erase(w.size() - 4);
+// Prints progress and skip messages in file order, no matter which worker
+// finishes first, so stderr and the counters match a single-threaded run.
+class ProgressReporter {
+public:
+    explicit ProgressReporter(std::vector<FileResult>& results) : results(results) {}
 
-    return w;
-}
+    void finish(size_t i, FileResult r) {
+        std::lock_guard<std::mutex> lk(m);
+        results[i] = std::move(r);
+        results[i].done = true;
+        while (next < results.size() && results[next].done) {
+            const FileResult& f = results[next++];
+            if (!f.ok) {
+                std::cerr << f.skip_msg << "\n";
+                continue;
+            }
+            files++;
+            total_tokens += f.tokens;
+            memo_hits += f.memo_hits;
+            if (files % 200 == 0) {
+                std::cerr << "Stemmed files: " << files << ", total tokens: " << total_tokens << "\n";
+            }
+        }
+    }
+
+    std::size_t files = 0;
+    std::uint64_t total_tokens = 0;
+    std::uint64_t memo_hits = 0;
+
+private:
+    std::vector<FileResult>& results;
+    std::mutex m;
+    size_t next = 0;
+};
 
 int main(int argc, char** argv) {
-    std::ios::sync_with_stdio(false);
-    std::cin.tie(nullptr);
+    std::string file_path;
+    std::string dir_path;
+    std::string out_dir;
+    unsigned threads = 1;
+    bool verify = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--file" && i + 1 < argc) file_path = argv[++i];
+        else if (a == "--dir" && i + 1 < argc) dir_path = argv[++i];
+        else if (a == "--out" && i + 1 < argc) out_dir = argv[++i];
+        else if (a == "--verify") verify = true;
+        else if (a == "--threads" && i + 1 < argc) threads = static_cast<unsigned>(std::stoul(argv[++i]));
+        else if (a == "--help" || a == "-h") { print_usage(); return 0; }
+        else {
+            std::cerr << "Unknown arg: " << a << "\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (verify) {
+        std::vector<fs::path> paths;
+        if (!file_path.empty()) paths.push_back(file_path);
+        if (!dir_path.empty()) {
+            for (const auto& entry : fs::directory_iterator(dir_path)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".tok") paths.push_back(entry.path());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+        StemCache memo(1 << 12); // small, so the memo also gets flushed and refilled
+        size_t bad = 0;
+        for (const auto& p : paths) if (!verify_file(p, memo)) bad++;
+        std::cerr << "Verified files: " << paths.size() << ", mismatches: " << bad << "\n";
+        return bad == 0 && !paths.empty() ? 0 : 1;
+    }
 
-    std::string token;
-    while (std::cin >> token) {
-        std::cout << stem_word(token) << "\n";
+    if (!file_path.empty()) {
+        std::cerr << "--file is only used with --verify\n";
+        return 2;
     }
+
+    // Mode 1: stdin -> stdout
+    if (dir_path.empty()) {
+        std::ios::sync_with_stdio(false);
+        std::cin.tie(nullptr);
+
+        StemCache memo;
+        std::string token;
+        while (std::cin >> token) {
+            std::string_view s = memo.stem(token);
+            std::cout.write(s.data(), (std::streamsize)s.size());
+            std::cout.put('\n');
+        }
+        return 0;
+    }
+
+    // Mode 2: directory -> out_dir
+    if (out_dir.empty()) {
+        std::cerr << "--out is required for --dir mode\n";
+        return 2;
+    }
+    fs::create_directories(out_dir);
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // sorted, so the work split and the report order do not depend on directory order
+    std::vector<fs::path> paths;
+    for (const auto& entry : fs::directory_iterator(dir_path)) {
+        if (!entry.is_regular_file()) continue;
+        if (entry.path().extension() != ".tok") continue;
+        paths.push_back(entry.path());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<FileResult> results(paths.size());
+    ProgressReporter progress(results);
+
+    parallel_for_stealing(paths.size(), threads, [&](size_t i) {
+        const fs::path& p = paths[i];
+        FileResult r;
+
+        std::string text;
+        if (!read_file(p, text)) {
+            r.skip_msg = "Skip (cannot open): " + p.string();
+            progress.finish(i, std::move(r));
+            return;
+        }
+
+        fs::path out_path = fs::path(out_dir) / (p.stem().string() + ".stm");
+        std::ofstream out(out_path, std::ios::binary);
+        if (!out) {
+            r.skip_msg = "Skip (cannot write): " + out_path.string();
+            progress.finish(i, std::move(r));
+            return;
+        }
+
+        static thread_local StemCache memo; // one per worker, kept across its files
+        uint64_t hits_before = memo.hits();
+
+        std::string stems;
+        stems.reserve(1 << 16);
+        for_each_token(text, [&](std::string_view t) {
+            std::string_view s = memo.stem(t);
+            stems.append(s.data(), s.size());
+            stems.push_back('\n');
+            r.tokens++;
+            if (stems.size() >= (1 << 16)) {
+                out.write(stems.data(), (std::streamsize)stems.size());
+                stems.clear();
+            }
+        });
+        out.write(stems.data(), (std::streamsize)stems.size());
+
+        r.memo_hits = memo.hits() - hits_before;
+        r.ok = true;
+        progress.finish(i, std::move(r));
+    });
+
+    std::cerr << "Done. Files: " << progress.files << ", total tokens: " << progress.total_tokens
+              << ", memo hits: " << progress.memo_hits << "\n";
     return 0;
 }
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "vocabulary.hpp"
+
+// Suffix-stripping stemmer shared by stem and build_index --corpus.
+//
+// stem_word_reference is the original rule chain (std::string suffix compares)
+// and stays as the oracle of stem --verify. stem_into applies the same rules
+// from constexpr tables to a reused buffer: three groups run one after another,
+// and in each group the first rule whose suffix matches and whose length
+// condition holds rewrites the tail in place (no replacement is longer than its
+// suffix). StemCache memoizes token -> stem, since a corpus repeats a small
+// vocabulary over and over.
+
+inline bool ends_with(std::string_view w, std::string_view suf) {
+    return w.size() >= suf.size() && w.compare(w.size() - suf.size(), suf.size(), suf) == 0;
+}
+
+inline void replace_suffix(std::string& w, const std::string& suf, const std::string& repl) {
+    w.replace(w.size() - suf.size(), suf.size(), repl);
+}
+
+inline std::string stem_word_reference(std::string w) {
+    if (w.size() < 3) return w;
+
+    // plural
+    if (ends_with(w, "sses")) replace_suffix(w, "sses", "ss");
+    else if (ends_with(w, "ies")) replace_suffix(w, "ies", "i");
+    else if (ends_with(w, "s") && !ends_with(w, "ss")) w.pop_back();
+
+    // past / gerund
+    if (ends_with(w, "ing") && w.size() > 5) w.erase(w.size() - 3);
+    else if (ends_with(w, "ed") && w.size() > 4) w.erase(w.size() - 2);
+
+    // common suffixes
+    if (ends_with(w, "ational")) replace_suffix(w, "ational", "ate");
+    else if (ends_with(w, "tional")) replace_suffix(w, "tional", "tion");
+    else if (ends_with(w, "izer")) replace_suffix(w, "izer", "ize");
+    else if (ends_with(w, "ness")) w.erase(w.size() - 4);
+    else if (ends_with(w, "ment")) w.erase(w.size() - 4);
+    else if (ends_with(w, "ful")) w.erase(w.size() - 3);
+    else if (ends_with(w, "less")) w.erase(w.size() - 4);
+
+    return w;
+}
+
+struct SuffixRule {
+    std::string_view suffix;
+    std::string_view repl;
+    uint8_t min_len; // word length needed for the rule to fire
+};
+
+// "ss" -> "ss" stops the group, so "class" keeps its s.
+inline constexpr SuffixRule STEM_PLURAL[] = {
+    {"sses", "ss", 0}, {"ies", "i", 0}, {"ss", "ss", 0}, {"s", "", 0}};
+inline constexpr SuffixRule STEM_VERB[] = {{"ing", "", 6}, {"ed", "", 5}};
+inline constexpr SuffixRule STEM_SUFFIX[] = {
+    {"ational", "ate", 0}, {"tional", "tion", 0}, {"izer", "ize", 0}, {"ness", "", 0},
+    {"ment", "", 0},       {"ful", "", 0},        {"less", "", 0}};
+
+template <size_t N>
+inline void apply_suffix_rules(char* w, size_t& len, const SuffixRule (&rules)[N]) {
+    if (len == 0) return;
+    char last = w[len - 1];
+    for (const SuffixRule& r : rules) {
+        size_t n = r.suffix.size();
+        if (r.suffix[n - 1] != last || len < n || len < r.min_len) continue;
+        if (std::memcmp(w + len - n, r.suffix.data(), n) != 0) continue;
+        std::memcpy(w + len - n, r.repl.data(), r.repl.size());
+        len = len - n + r.repl.size();
+        return;
+    }
+}
+
+// out = stem of w; out keeps its capacity between calls.
+inline void stem_into(std::string_view w, std::string& out) {
+    out.assign(w.data(), w.size());
+    if (w.size() < 3) return;
+    size_t len = out.size();
+    apply_suffix_rules(&out[0], len, STEM_PLURAL);
+    apply_suffix_rules(&out[0], len, STEM_VERB);
+    apply_suffix_rules(&out[0], len, STEM_SUFFIX);
+    out.resize(len);
+}
+
+inline std::string stem_word(std::string_view w) {
+    std::string out;
+    stem_into(w, out);
+    return out;
+}
+
+// Token -> stem memo for one thread. Tokens are interned to dense ids, stems
+// are kept in an arena by id; past `max_tokens` distinct tokens everything is
+// dropped and the memo refills with what is still frequent.
+class StemCache {
+public:
+    explicit StemCache(uint32_t max_tokens = 1 << 20) : max_tokens_(max_tokens) {}
+
+    // Valid until the next call.
+    std::string_view stem(std::string_view token) {
+        uint32_t id = tokens_.intern(token);
+        if (id < stems_.size()) {
+            hits_++;
+            return stems_[id];
+        }
+        misses_++;
+        stem_into(token, buf_);
+        std::string_view s = arena_.add(buf_);
+        stems_.push_back(s);
+        if (tokens_.size() >= max_tokens_) {
+            tokens_.clear();
+            arena_.clear();
+            stems_.clear();
+            return buf_;
+        }
+        return s;
+    }
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    uint32_t max_tokens_;
+    Vocabulary tokens_;
+    StringArena arena_;
+    std::vector<std::string_view> stems_; // token id -> stem
+    std::string buf_;
+    uint64_t hits_ = 0, misses_ = 0;
+};
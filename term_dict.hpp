@@ -0,0 +1,401 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "postings_codec.hpp"
+
+// Sorted term dictionary of index.bin, front coded.
+//
+// Terms are cut into blocks of TERM_BLOCK. The first term of a block is stored
+// whole, every other one as the length of the prefix it shares with the term
+// before it plus the remaining bytes:
+//
+//   block    varint len, bytes                                first term
+//            (varint shared, varint len, bytes) * (TERM_BLOCK - 1)
+//   uint32_t block_off[nblocks + 1]                           start of every block
+//
+// A lookup binary-searches the block heads, which are read in place, and then
+// decodes at most one block. Term i is the (i % TERM_BLOCK)-th of block
+// i / TERM_BLOCK, so ordinals need no table of their own.
+//
+// For leading wildcards the term ids are also kept in the order of their
+// reversed text (suffix_order): the terms ending in "craft" are one range of
+// it, found by the same kind of binary search.
+//
+// Fuzzy terms (word~k) run a Levenshtein automaton over the sorted terms:
+// terms that share a prefix share the automaton states of that prefix, and
+// once a prefix can no longer end within distance k, the walk seeks to the
+// next string the automaton can still accept.
+
+static constexpr uint32_t TERM_BLOCK = 16;
+
+// Encoded dictionary, as written to index.bin or kept in memory for the text format.
+struct TermDictData {
+    std::vector<uint8_t> bytes;
+    std::vector<uint32_t> block_off;
+    std::vector<uint32_t> suffix_order;
+};
+
+// `terms` must be sorted.
+inline void encode_term_dict(const std::vector<std::string>& terms, TermDictData& out) {
+    out.bytes.clear();
+    out.block_off.clear();
+    for (size_t i = 0; i < terms.size(); i++) {
+        const std::string& t = terms[i];
+        if (i % TERM_BLOCK == 0) {
+            out.block_off.push_back((uint32_t)out.bytes.size());
+            append_varint(out.bytes, (uint32_t)t.size());
+            out.bytes.insert(out.bytes.end(), t.begin(), t.end());
+            continue;
+        }
+        const std::string& prev = terms[i - 1];
+        size_t shared = 0;
+        while (shared < prev.size() && shared < t.size() && prev[shared] == t[shared]) shared++;
+        append_varint(out.bytes, (uint32_t)shared);
+        append_varint(out.bytes, (uint32_t)(t.size() - shared));
+        out.bytes.insert(out.bytes.end(), t.begin() + (std::ptrdiff_t)shared, t.end());
+    }
+    out.block_off.push_back((uint32_t)out.bytes.size());
+
+    out.suffix_order.resize(terms.size());
+    for (uint32_t i = 0; i < terms.size(); i++) out.suffix_order[i] = i;
+    std::sort(out.suffix_order.begin(), out.suffix_order.end(), [&](uint32_t a, uint32_t b) {
+        return std::lexicographical_compare(terms[a].rbegin(), terms[a].rend(), terms[b].rbegin(), terms[b].rend());
+    });
+}
+
+// Levenshtein automaton of a word q and a distance k over bytes. A state is a
+// row of the edit distance table: after reading a prefix x, row[j] is the
+// distance between x and q[0..j), capped at k + 1 (all larger values behave
+// the same). Only the 2k + 1 cells around the diagonal, |j - |x|| <= k, can be
+// below the cap, so a step computes just those. Rows are width() bytes, kept
+// by the caller and filled with cap() before first use; the states of a whole
+// prefix can be stacked.
+class LevenshteinAutomaton {
+public:
+    LevenshteinAutomaton(std::string_view q, uint32_t k) : q_(q), cap_((uint8_t)std::min<uint32_t>(k + 1, 255)) {}
+
+    size_t width() const { return q_.size() + 1; }
+    uint8_t cap() const { return cap_; }
+
+    void start(uint8_t* row) const {
+        for (size_t j = 0; j < width(); j++) row[j] = (uint8_t)std::min<size_t>(j, cap_);
+    }
+
+    // State after byte c into out, where row is the state after `depth` bytes;
+    // false if it is dead (no continuation matches).
+    bool step(const uint8_t* row, size_t depth, char c, uint8_t* out) const {
+        const size_t m = q_.size(), k = cap_ - 1u;
+        size_t lo = depth + 1 > k ? depth + 1 - k : 0, hi = std::min(m, depth + 1 + k);
+        if (lo > m) return false;
+        uint8_t left = cap_, best = cap_;
+        size_t j = lo;
+        if (j == 0) {
+            left = best = out[0] = (uint8_t)std::min(row[0] + 1, (int)cap_);
+            j = 1;
+        }
+        for (; j <= hi; j++) {
+            int v = std::min(row[j - 1] + (q_[j - 1] != c), std::min(row[j], left) + 1);
+            left = out[j] = (uint8_t)std::min(v, (int)cap_);
+            best = std::min(best, left);
+        }
+        if (hi < m) out[hi + 1] = cap_; // read by the next step
+        return best < cap_;
+    }
+
+    // Smallest byte above c whose step from row (after `depth` bytes) is alive;
+    // false if there is none. If a mismatch keeps some cell below the cap, every
+    // byte does; otherwise only the bytes q[j - 1] whose diagonal row[j - 1] is
+    // below the cap can, and those are read off the row without stepping.
+    bool next_live(const uint8_t* row, size_t depth, unsigned char c, unsigned char& next) const {
+        const size_t m = q_.size(), k = cap_ - 1u;
+        size_t lo = depth + 1 > k ? depth + 1 - k : 0, hi = std::min(m, depth + 1 + k);
+        if (lo > m) return false;
+        for (size_t j = lo ? lo - 1 : 0; j <= hi; j++) {
+            if (row[j] + 1 < cap_) {
+                next = (unsigned char)(c + 1);
+                return c != 255;
+            }
+        }
+        unsigned best = 256;
+        for (size_t j = std::max<size_t>(lo, 1); j <= hi; j++) {
+            unsigned x = (unsigned char)q_[j - 1];
+            if (row[j - 1] < cap_ && x > c) best = std::min(best, x);
+        }
+        next = (unsigned char)best;
+        return best < 256;
+    }
+
+    // Distance of the prefix read so far to q; above k when it does not match.
+    uint32_t distance(const uint8_t* row) const { return row[q_.size()]; }
+    bool accepts(const uint8_t* row) const { return row[q_.size()] < cap_; }
+
+private:
+    std::string_view q_;
+    uint8_t cap_;
+};
+
+// Read-only view of an encoded dictionary (mapped or owned elsewhere). All
+// lookups are const and take their own decode buffer, so one TermDict serves
+// any number of threads.
+class TermDict {
+public:
+    void attach(const uint8_t* bytes, const uint32_t* block_off, const uint32_t* suffix_order, uint32_t nterms,
+                uint32_t block = TERM_BLOCK) {
+        bytes_ = bytes;
+        block_off_ = block_off;
+        suffix_order_ = suffix_order;
+        n_ = nterms;
+        block_ = block;
+        nblocks_ = (nterms + block - 1) / block;
+    }
+
+    void attach(const TermDictData& d, uint32_t nterms) {
+        attach(d.bytes.data(), d.block_off.data(), d.suffix_order.data(), nterms);
+    }
+
+    uint32_t size() const { return n_; }
+
+    // Term i, decoded into buf.
+    std::string_view term(uint32_t i, std::string& buf) const {
+        uint32_t b = i / block_;
+        const uint8_t* p = head(b, buf);
+        for (uint32_t k = b * block_; k < i; k++) next(p, buf);
+        return buf;
+    }
+
+    // Returns the term ordinal or -1.
+    int64_t find(std::string_view t) const {
+        std::string buf;
+        uint32_t i = partition_point([&](std::string_view x) { return x < t; }, buf);
+        if (i < n_ && buf == t) return i;
+        return -1;
+    }
+
+    // Ordinals [first, second) of the terms that start with p.
+    std::pair<uint32_t, uint32_t> prefix_range(std::string_view p) const {
+        std::string buf;
+        uint32_t lo = partition_point([&](std::string_view x) { return x < p; }, buf);
+        uint32_t hi = partition_point([&](std::string_view x) { return x.substr(0, p.size()) <= p; }, buf);
+        return {lo, hi};
+    }
+
+    // Positions [first, second) in suffix order of the terms that end with s.
+    std::pair<uint32_t, uint32_t> suffix_range(std::string_view s) const {
+        auto last = [&](std::string_view x) { return x.substr(x.size() - std::min(x.size(), s.size())); };
+        uint32_t lo = suffix_partition_point([&](std::string_view x) { return rev_less(x, s); });
+        uint32_t hi = suffix_partition_point([&](std::string_view x) { return !rev_less(s, last(x)); });
+        return {lo, hi};
+    }
+
+    uint32_t suffix_id(uint32_t k) const { return suffix_order_[k]; }
+
+    // fn(id, term) for the ordinals lo..hi-1, decoding each block once.
+    template <class F>
+    void for_each(uint32_t lo, uint32_t hi, F&& fn) const {
+        if (lo >= hi) return;
+        std::string buf;
+        uint32_t b = lo / block_;
+        const uint8_t* p = head(b, buf);
+        for (uint32_t k = b * block_; k < lo; k++) next(p, buf);
+        for (uint32_t i = lo; i < hi; i++) {
+            if (i > lo) {
+                if (i % block_ == 0) p = head(i / block_, buf);
+                else next(p, buf);
+            }
+            fn(i, std::string_view(buf));
+        }
+    }
+
+    // Ids of the terms of the form prefix*suffix (either part may be empty) in
+    // ascending order; false when there are more than `limit`. Walks the smaller
+    // of the prefix range and the suffix range and checks the other end.
+    bool match(std::string_view prefix, std::string_view suffix, size_t limit, std::vector<uint32_t>& out) const {
+        out.clear();
+        auto pr = prefix_range(prefix);
+        std::pair<uint32_t, uint32_t> sr{0, n_};
+        if (!suffix.empty()) sr = suffix_range(suffix);
+        size_t min_len = prefix.size() + suffix.size();
+        if (pr.second - pr.first <= sr.second - sr.first) {
+            bool ok = true;
+            for_each(pr.first, pr.second, [&](uint32_t id, std::string_view t) {
+                if (!ok || t.size() < min_len || t.substr(t.size() - suffix.size()) != suffix) return;
+                if (out.size() == limit) ok = false;
+                else out.push_back(id);
+            });
+            return ok;
+        }
+        std::string buf;
+        for (uint32_t k = sr.first; k < sr.second; k++) {
+            uint32_t id = suffix_order_[k];
+            if (id < pr.first || id >= pr.second || term(id, buf).size() < min_len) continue;
+            if (out.size() == limit) return false;
+            out.push_back(id);
+        }
+        std::sort(out.begin(), out.end());
+        return true;
+    }
+
+    // (id, distance) of the terms within edit distance k of q, in ascending id
+    // order: the automaton intersected with the sorted terms. Each term is fed
+    // through it from the end of the prefix it shares with the previous one.
+    // When a prefix dies, the walk seeks to the next string that can still
+    // match, buf[0..level) followed by the next live byte at `level`, found at
+    // the deepest level that has one. The terms before it are passed over on
+    // their shared length and first new byte without being copied, and when
+    // they reach past the block, a binary search of the block heads skips the
+    // blocks in between.
+    void fuzzy(std::string_view q, uint32_t k, std::vector<std::pair<uint32_t, uint32_t>>& out) const {
+        out.clear();
+        const LevenshteinAutomaton a(q, k);
+        const size_t w = a.width();
+        std::vector<uint8_t> rows(w * 32, a.cap()); // row d: state after buf[0..d)
+        a.start(rows.data());
+        std::string buf, target;
+        size_t valid = 0; // rows 0..valid are those of buf
+        // while seeking, the terms buf[0..level) + a byte below upto are skipped
+        size_t level = SIZE_MAX;
+        unsigned char upto = 0;
+        auto skipped = [&](size_t shared, const char* rest, size_t len) {
+            return level != SIZE_MAX && (shared > level || (shared == level && len && (unsigned char)rest[0] < upto));
+        };
+        const uint8_t* p = nullptr;
+        for (uint32_t i = 0; i < n_;) {
+            size_t shared;
+            if (i % block_ == 0) {
+                std::string_view h = head_view(i / block_);
+                size_t n = std::min(h.size(), buf.size());
+                shared = (size_t)(std::mismatch(h.begin(), h.begin() + n, buf.begin()).first - h.begin());
+                if (skipped(shared, h.data() + shared, h.size() - shared)) {
+                    i++;
+                    p = reinterpret_cast<const uint8_t*>(h.data() + h.size());
+                    continue;
+                }
+                p = head(i / block_, buf);
+            } else {
+                const uint8_t* q0 = p;
+                shared = read_varint(p);
+                uint32_t len = read_varint(p);
+                if (skipped(shared, reinterpret_cast<const char*>(p), len)) {
+                    p += len;
+                    i++;
+                    continue;
+                }
+                p = q0;
+                next(p, buf);
+            }
+            level = SIZE_MAX;
+            if (rows.size() < (buf.size() + 1) * w) rows.resize((buf.size() + 1) * w * 2, a.cap());
+            size_t d = std::min(shared, valid);
+            for (; d < buf.size(); d++) {
+                if (!a.step(&rows[d * w], d, buf[d], &rows[(d + 1) * w])) break;
+            }
+            if (d == buf.size()) {
+                valid = d;
+                if (a.accepts(&rows[d * w])) out.emplace_back(i, a.distance(&rows[d * w]));
+                i++;
+                continue;
+            }
+            // buf[0..d] is dead: find the next live string
+            valid = d;
+            for (size_t l = d + 1; l-- > 0;) {
+                if (a.next_live(&rows[l * w], l, (unsigned char)buf[l], upto)) {
+                    level = l;
+                    break;
+                }
+            }
+            if (level == SIZE_MAX) return;
+            target.assign(buf, 0, level);
+            target.push_back((char)upto);
+            // last block whose head is before the target
+            uint32_t lo = i / block_ + 1, hi = nblocks_;
+            if (lo < hi && head_view(lo) >= target) hi = lo;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (head_view(mid) < target) lo = mid + 1;
+                else hi = mid;
+            }
+            i = lo > i / block_ + 1 ? (lo - 1) * block_ : i + 1;
+        }
+    }
+
+private:
+    const uint8_t* bytes_ = nullptr;
+    const uint32_t* block_off_ = nullptr;
+    const uint32_t* suffix_order_ = nullptr;
+    uint32_t n_ = 0;
+    uint32_t block_ = TERM_BLOCK;
+    uint32_t nblocks_ = 0;
+
+    // First term of block b into buf; returns the position of the next term.
+    const uint8_t* head(uint32_t b, std::string& buf) const {
+        const uint8_t* p = bytes_ + block_off_[b];
+        uint32_t len = read_varint(p);
+        buf.assign(reinterpret_cast<const char*>(p), len);
+        return p + len;
+    }
+
+    std::string_view head_view(uint32_t b) const {
+        const uint8_t* p = bytes_ + block_off_[b];
+        uint32_t len = read_varint(p);
+        return std::string_view(reinterpret_cast<const char*>(p), len);
+    }
+
+    // Next term of a block into buf; returns the length it shares with the one before.
+    static uint32_t next(const uint8_t*& p, std::string& buf) {
+        uint32_t shared = read_varint(p);
+        uint32_t len = read_varint(p);
+        buf.resize(shared);
+        buf.append(reinterpret_cast<const char*>(p), len);
+        p += len;
+        return shared;
+    }
+
+    // a < b comparing both strings from their last byte backwards.
+    static bool rev_less(std::string_view a, std::string_view b) {
+        return std::lexicographical_compare(a.rbegin(), a.rend(), b.rbegin(), b.rend());
+    }
+
+    // First ordinal whose term is not `before` (a predicate that holds for a
+    // prefix of the sorted terms); that term is left in buf.
+    template <class P>
+    uint32_t partition_point(P before, std::string& buf) const {
+        uint32_t lo = 0, hi = nblocks_;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (before(head_view(mid))) lo = mid + 1;
+            else hi = mid;
+        }
+        // every term before block lo is `before`, block lo's head is not
+        if (lo == 0) {
+            if (n_) head(0, buf);
+            return 0;
+        }
+        uint32_t b = lo - 1;
+        const uint8_t* p = head(b, buf);
+        uint32_t end = std::min(n_, (b + 1) * block_);
+        for (uint32_t i = b * block_ + 1; i < end; i++) {
+            next(p, buf);
+            if (!before(buf)) return i;
+        }
+        if (end < n_) head(lo, buf);
+        return end;
+    }
+
+    template <class P>
+    uint32_t suffix_partition_point(P before) const {
+        std::string buf;
+        uint32_t lo = 0, hi = n_;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (before(term(suffix_order_[mid], buf))) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+};
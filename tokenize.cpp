@@ -5,72 +5,104 @@
 #include <string>
 #include <vector>
 #include <filesystem>
+#include <algorithm>
+#include <mutex>
 
-namespace fs = std::filesystem;
-
-static inline char to_lower_ascii(char c) {
-    if (c >= 'A' && c <= 'Z') return static_cast<char>(c - 'A' + 'a');
-    return c;
-}
+#include "parallel.hpp"
+#include "tokenizer.hpp"
 
-static inline bool is_alnum_ascii(char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-           (c >= '0' && c <= '9');
-}
-
-std::vector<std::string> tokenize_stream(std::istream& in, std::size_t min_len = 2, bool keep_hyphen = true) {
-    std::vector<std::string> tokens;
-    std::string cur;
-    cur.reserve(64);
-
-    char c;
-    char prev = 0;
-
-    auto flush = [&]() {
-        if (cur.size() >= min_len) tokens.push_back(cur);
-        cur.clear();
-    };
-
-    while (in.get(c)) {
-        if (is_alnum_ascii(c)) {
-            cur.push_back(to_lower_ascii(c));
-        } else if (keep_hyphen && c == '-') {
-            if (!cur.empty()) {
-                char next = static_cast<char>(in.peek());
-                if (is_alnum_ascii(next)) {
-                    cur.push_back('-');
-                } else {
-                    flush();
-                }
-            } else {
-            }
-        } else {
-            if (!cur.empty()) flush();
-        }
-        prev = c;
-    }
-    if (!cur.empty()) flush();
-    return tokens;
-}
+namespace fs = std::filesystem;
 
 static void print_usage() {
     std::cerr
         << "Usage:\n"
         << "  tokenize --file <path> [--min-len N] [--no-hyphen]\n"
-        << "  tokenize --dir  <corpus_dir> --out <out_dir> [--min-len N] [--no-hyphen]\n"
+        << "  tokenize --dir  <corpus_dir> --out <out_dir> [--min-len N] [--no-hyphen] [--threads N]\n"
+        << "  tokenize --verify (--file <path> | --dir <corpus_dir>) [--min-len N] [--no-hyphen]\n"
         << "\n"
         << "Modes:\n"
         << "  --file: tokenize one file, print tokens to stdout (one per line)\n"
-        << "  --dir : tokenize all .txt files in a directory, write token lists to out_dir/<same_name>.tok\n";
+        << "  --dir : tokenize all .txt files in a directory, write token lists to out_dir/<same_name>.tok\n"
+        << "          --threads N spreads the files over N worker threads (0 = all cores)\n"
+        << "  --verify: differential check of the block tokenizer against the reference stream tokenizer\n";
 }
 
+// Differential test: the block tokenizer must produce exactly the tokens of the
+// reference tokenize_stream, including at tiny block sizes where every token
+// and hyphen straddles a read boundary.
+static bool verify_file(const fs::path& p, std::size_t min_len, bool keep_hyphen) {
+    std::ifstream ref_in(p, std::ios::binary);
+    if (!ref_in) {
+        std::cerr << "Cannot open file: " << p.string() << "\n";
+        return false;
+    }
+    auto expect = tokenize_stream(ref_in, min_len, keep_hyphen);
+
+    for (size_t block : {(size_t)1, (size_t)2, (size_t)3, (size_t)63, (size_t)4096, TOKENIZER_BLOCK}) {
+        std::ifstream in(p, std::ios::binary);
+        std::vector<std::string> got;
+        tokenize_blocks(in, min_len, keep_hyphen, [&](std::string_view t) { got.emplace_back(t); }, block);
+        if (got != expect) {
+            size_t k = 0;
+            while (k < got.size() && k < expect.size() && got[k] == expect[k]) k++;
+            std::cerr << "MISMATCH " << p.string() << " block=" << block << " at token " << k << ": expected '"
+                      << (k < expect.size() ? expect[k] : "<end>") << "', got '"
+                      << (k < got.size() ? got[k] : "<end>") << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Outcome of one file in --dir mode.
+struct FileResult {
+    bool done = false;
+    bool ok = false;
+    std::uint64_t tokens = 0;
+    std::string skip_msg;
+};
+
+// Prints progress and skip messages in file order, no matter which worker
+// finishes first, so stderr and the counters match a single-threaded run.
+class ProgressReporter {
+public:
+    explicit ProgressReporter(std::vector<FileResult>& results) : results(results) {}
+
+    void finish(size_t i, FileResult r) {
+        std::lock_guard<std::mutex> lk(m);
+        results[i] = std::move(r);
+        results[i].done = true;
+        while (next < results.size() && results[next].done) {
+            const FileResult& f = results[next++];
+            if (!f.ok) {
+                std::cerr << f.skip_msg << "\n";
+                continue;
+            }
+            files++;
+            total_tokens += f.tokens;
+            if (files % 200 == 0) {
+                std::cerr << "Tokenized files: " << files << ", total tokens: " << total_tokens << "\n";
+            }
+        }
+    }
+
+    std::size_t files = 0;
+    std::uint64_t total_tokens = 0;
+
+private:
+    std::vector<FileResult>& results;
+    std::mutex m;
+    size_t next = 0;
+};
+
 int main(int argc, char** argv) {
     std::string file_path;
     std::string dir_path;
     std::string out_dir;
     std::size_t min_len = 2;
     bool keep_hyphen = true;
+    unsigned threads = 1;
+    bool verify = false;
 
     for (int i = 1; i < argc; i++) {
         std::string a = argv[i];
@@ -79,6 +111,8 @@ int main(int argc, char** argv) {
         else if (a == "--out" && i + 1 < argc) out_dir = argv[++i];
         else if (a == "--min-len" && i + 1 < argc) min_len = static_cast<std::size_t>(std::stoul(argv[++i]));
         else if (a == "--no-hyphen") keep_hyphen = false;
+        else if (a == "--verify") verify = true;
+        else if (a == "--threads" && i + 1 < argc) threads = static_cast<unsigned>(std::stoul(argv[++i]));
         else if (a == "--help" || a == "-h") { print_usage(); return 0; }
         else {
             std::cerr << "Unknown arg: " << a << "\n";
@@ -92,6 +126,21 @@ int main(int argc, char** argv) {
         return 2;
     }
 
+    if (verify) {
+        std::vector<fs::path> paths;
+        if (!file_path.empty()) paths.push_back(file_path);
+        if (!dir_path.empty()) {
+            for (const auto& entry : fs::directory_iterator(dir_path)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".txt") paths.push_back(entry.path());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+        size_t bad = 0;
+        for (const auto& p : paths) if (!verify_file(p, min_len, keep_hyphen)) bad++;
+        std::cerr << "Verified files: " << paths.size() << ", mismatches: " << bad << "\n";
+        return bad == 0 && !paths.empty() ? 0 : 1;
+    }
+
     // Mode 1: one file -> stdout
     if (!file_path.empty()) {
         std::ifstream in(file_path, std::ios::binary);
@@ -99,8 +148,11 @@ int main(int argc, char** argv) {
             std::cerr << "Cannot open file: " << file_path << "\n";
             return 1;
         }
-        auto tokens = tokenize_stream(in, min_len, keep_hyphen);
-        for (const auto& t : tokens) std::cout << t << "\n";
+        std::ios::sync_with_stdio(false);
+        tokenize_blocks(in, min_len, keep_hyphen, [](std::string_view t) {
+            std::cout.write(t.data(), (std::streamsize)t.size());
+            std::cout.put('\n');
+        });
         return 0;
     }
 
@@ -112,37 +164,59 @@ int main(int argc, char** argv) {
         }
         fs::create_directories(out_dir);
 
-        std::size_t files = 0;
-        std::uint64_t total_tokens = 0;
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
 
+        // sorted, so the work split and the report order do not depend on directory order
+        std::vector<fs::path> paths;
         for (const auto& entry : fs::directory_iterator(dir_path)) {
             if (!entry.is_regular_file()) continue;
-            const auto p = entry.path();
-            if (p.extension() != ".txt") continue;
+            if (entry.path().extension() != ".txt") continue;
+            paths.push_back(entry.path());
+        }
+        std::sort(paths.begin(), paths.end());
+
+        std::vector<FileResult> results(paths.size());
+        ProgressReporter progress(results);
+
+        parallel_for_stealing(paths.size(), threads, [&](size_t i) {
+            const fs::path& p = paths[i];
+            FileResult r;
 
             std::ifstream in(p, std::ios::binary);
             if (!in) {
-                std::cerr << "Skip (cannot open): " << p.string() << "\n";
-                continue;
+                r.skip_msg = "Skip (cannot open): " + p.string();
+                progress.finish(i, std::move(r));
+                return;
             }
 
-            auto tokens = tokenize_stream(in, min_len, keep_hyphen);
-
             fs::path out_path = fs::path(out_dir) / (p.stem().string() + ".tok");
             std::ofstream out(out_path, std::ios::binary);
             if (!out) {
-                std::cerr << "Skip (cannot write): " << out_path.string() << "\n";
-                continue;
+                r.skip_msg = "Skip (cannot write): " + out_path.string();
+                progress.finish(i, std::move(r));
+                return;
             }
-            for (const auto& t : tokens) out << t << "\n";
 
-            files++;
-            total_tokens += static_cast<std::uint64_t>(tokens.size());
-            if (files % 200 == 0) {
-                std::cerr << "Tokenized files: " << files << ", total tokens: " << total_tokens << "\n";
-            }
-        }
+            // tokens are written straight from the read block
+            std::string text;
+            text.reserve(1 << 16);
+            tokenize_blocks(in, min_len, keep_hyphen, [&](std::string_view t) {
+                text.append(t.data(), t.size());
+                text.push_back('\n');
+                r.tokens++;
+                if (text.size() >= (1 << 16)) {
+                    out.write(text.data(), (std::streamsize)text.size());
+                    text.clear();
+                }
+            });
+            out.write(text.data(), (std::streamsize)text.size());
+
+            r.ok = true;
+            progress.finish(i, std::move(r));
+        });
 
+        std::size_t files = progress.files;
+        std::uint64_t total_tokens = progress.total_tokens;
         std::cerr << "Done. Files: " << files << ", total tokens: " << total_tokens << "\n";
         return 0;
     }
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define IR_TOKENIZER_X86 1
+#endif
+
+// Tokenizer shared by tokenize and build_index --corpus: lowercased ASCII
+// alphanumeric runs, optionally joined by inner hyphens, at least min_len long.
+//
+// tokenize_stream is the reference implementation (one istream::get per byte).
+// tokenize_blocks produces the same tokens from large read blocks: bytes are
+// classified and lowercased 16/32 at a time, token boundaries are found with bit
+// scans over the alnum mask, and tokens are handed out as string_views into the
+// block, so there is no allocation per token.
+
+inline char to_lower_ascii(char c) {
+    if (c >= 'A' && c <= 'Z') return static_cast<char>(c - 'A' + 'a');
+    return c;
+}
+
+inline bool is_alnum_ascii(char c) {
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9');
+}
+
+inline std::vector<std::string> tokenize_stream(std::istream& in, std::size_t min_len = 2, bool keep_hyphen = true) {
+    std::vector<std::string> tokens;
+    std::string cur;
+    cur.reserve(64);
+
+    char c;
+    char prev = 0;
+
+    auto flush = [&]() {
+        if (cur.size() >= min_len) tokens.push_back(cur);
+        cur.clear();
+    };
+
+    while (in.get(c)) {
+        if (is_alnum_ascii(c)) {
+            cur.push_back(to_lower_ascii(c));
+        } else if (keep_hyphen && c == '-') {
+            if (!cur.empty()) {
+                char next = static_cast<char>(in.peek());
+                if (is_alnum_ascii(next)) {
+                    cur.push_back('-');
+                } else {
+                    flush();
+                }
+            } else {
+            }
+        } else {
+            if (!cur.empty()) flush();
+        }
+        prev = c;
+    }
+    if (!cur.empty()) flush();
+    return tokens;
+}
+
+static constexpr size_t TOKENIZER_BLOCK = 1 << 20;
+
+inline void classify_scalar(char* p, size_t i, size_t n, uint64_t* masks) {
+    for (; i < n; i++) {
+        if (is_alnum_ascii(p[i])) masks[i / 64] |= uint64_t(1) << (i % 64);
+        p[i] = to_lower_ascii(p[i]);
+    }
+}
+
+#ifdef IR_TOKENIZER_X86
+// Unsigned "x - lo < len" per byte, via the signed compare of SSE2.
+inline __m128i in_range_sse2(__m128i x, char lo, char len) {
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i d = _mm_xor_si128(_mm_sub_epi8(x, _mm_set1_epi8(lo)), bias);
+    return _mm_cmplt_epi8(d, _mm_xor_si128(_mm_set1_epi8(len), bias));
+}
+
+inline void classify_sse2(char* p, size_t i, size_t n, uint64_t* masks) {
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i upper = in_range_sse2(x, 'A', 26);
+        __m128i alpha = in_range_sse2(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 26);
+        __m128i digit = in_range_sse2(x, '0', 10);
+        uint64_t m = (uint32_t)_mm_movemask_epi8(_mm_or_si128(alpha, digit));
+        masks[i / 64] |= m << (i % 64);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i),
+                         _mm_add_epi8(x, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+    }
+    classify_scalar(p, i, n, masks);
+}
+
+__attribute__((target("avx2")))
+inline __m256i in_range_avx2(__m256i x, char lo, char len) {
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+    __m256i d = _mm256_xor_si256(_mm256_sub_epi8(x, _mm256_set1_epi8(lo)), bias);
+    return _mm256_cmpgt_epi8(_mm256_xor_si256(_mm256_set1_epi8(len), bias), d);
+}
+
+__attribute__((target("avx2")))
+inline void classify_avx2(char* p, size_t i, size_t n, uint64_t* masks) {
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i upper = in_range_avx2(x, 'A', 26);
+        __m256i alpha = in_range_avx2(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 26);
+        __m256i digit = in_range_avx2(x, '0', 10);
+        uint64_t m = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(alpha, digit));
+        masks[i / 64] |= m << (i % 64);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i),
+                            _mm256_add_epi8(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20))));
+    }
+    classify_sse2(p, i, n, masks);
+}
+#endif
+
+// Lowercases p[0..n) in place and sets bit i of `masks` for every alnum byte p[i].
+inline void classify_bytes(char* p, size_t n, uint64_t* masks) {
+#ifdef IR_TOKENIZER_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) classify_avx2(p, 0, n, masks);
+    else classify_sse2(p, 0, n, masks);
+#else
+    classify_scalar(p, 0, n, masks);
+#endif
+}
+
+// First index >= i with the mask bit equal to `bit`, or n.
+inline size_t next_with_bit(const uint64_t* masks, size_t i, size_t n, bool bit) {
+    while (i < n) {
+        uint64_t w = masks[i / 64];
+        if (!bit) w = ~w;
+        w &= ~uint64_t(0) << (i % 64);
+        if (w) return std::min(n, (i / 64) * 64 + (size_t)__builtin_ctzll(w));
+        i = (i / 64 + 1) * 64;
+    }
+    return n;
+}
+
+// Calls emit(std::string_view) for every token of the stream, in order. A view
+// stays valid only during the call. `block` is the read size (tests use tiny ones).
+template <class F>
+void tokenize_blocks(std::istream& in, std::size_t min_len, bool keep_hyphen, F&& emit,
+                     size_t block = TOKENIZER_BLOCK) {
+    std::vector<char> buf(block);
+    std::vector<uint64_t> masks;
+    size_t keep = 0; // bytes of an unfinished token carried to the front of buf
+    bool eof = false;
+
+    while (!eof) {
+        if (buf.size() - keep < block) buf.resize(keep + block);
+        in.read(buf.data() + keep, (std::streamsize)block);
+        size_t got = (size_t)in.gcount();
+        eof = got == 0 || !in;
+        size_t n = keep + got;
+
+        masks.assign(n / 64 + 1, 0);
+        classify_bytes(buf.data(), n, masks.data());
+        const char* p = buf.data();
+
+        size_t i = 0;
+        keep = 0;
+        while (true) {
+            size_t start = next_with_bit(masks.data(), i, n, true);
+            if (start == n) break;
+            size_t end = next_with_bit(masks.data(), start, n, false);
+            while (keep_hyphen && end + 1 < n && p[end] == '-' && ((masks[(end + 1) / 64] >> ((end + 1) % 64)) & 1)) {
+                end = next_with_bit(masks.data(), end + 1, n, false);
+            }
+            // the token may continue in the next read: alnum up to the end, or a trailing '-' needing lookahead
+            if (!eof && (end == n || (keep_hyphen && end + 1 == n && p[end] == '-'))) {
+                keep = n - start;
+                std::memmove(buf.data(), buf.data() + start, keep);
+                break;
+            }
+            if (end - start >= min_len) emit(std::string_view(p + start, end - start));
+            i = end;
+        }
+    }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Term interning for the indexer: term bytes live in an append-only arena, and
+// an open-addressing hash table maps each distinct term to a dense uint32_t id
+// (0, 1, 2, ... in first-seen order). Postings are then kept per id, and the
+// lexicographic order is computed once, over the ids, when the dictionary is written.
+
+class StringArena {
+public:
+    std::string_view add(std::string_view s) {
+        if (s.size() > CHUNK / 4) {
+            // long strings get their own allocation instead of wasting chunk tails
+            chunks_.emplace_back(new char[s.size()]);
+            footprint_ += s.size();
+            std::memcpy(chunks_.back().get(), s.data(), s.size());
+            return std::string_view(chunks_.back().get(), s.size());
+        }
+        if (!cur_ || used_ + s.size() > CHUNK) {
+            chunks_.emplace_back(new char[CHUNK]);
+            cur_ = chunks_.back().get();
+            footprint_ += CHUNK;
+            used_ = 0;
+        }
+        char* p = cur_ + used_;
+        std::memcpy(p, s.data(), s.size());
+        used_ += s.size();
+        return std::string_view(p, s.size());
+    }
+
+    uint64_t footprint() const { return footprint_; }
+
+    void clear() {
+        chunks_.clear();
+        cur_ = nullptr;
+        used_ = 0;
+        footprint_ = 0;
+    }
+
+private:
+    static constexpr size_t CHUNK = 1 << 16;
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char* cur_ = nullptr; // chunk being filled
+    size_t used_ = 0;
+    uint64_t footprint_ = 0;
+};
+
+class Vocabulary {
+public:
+    Vocabulary() { slots_.assign(INITIAL_SLOTS, EMPTY); }
+
+    // Id of `t`, assigning the next free id on first sight.
+    uint32_t intern(std::string_view t) {
+        uint64_t h = hash(t);
+        size_t mask = slots_.size() - 1;
+        for (size_t i = (size_t)h & mask;; i = (i + 1) & mask) {
+            uint32_t id = slots_[i];
+            if (id == EMPTY) {
+                id = (uint32_t)terms_.size();
+                terms_.push_back(arena_.add(t));
+                hashes_.push_back(h);
+                slots_[i] = id;
+                if (terms_.size() * 4 > slots_.size() * 3) grow();
+                return id;
+            }
+            if (hashes_[id] == h && terms_[id] == t) return id;
+        }
+    }
+
+    uint32_t size() const { return (uint32_t)terms_.size(); }
+    std::string_view term(uint32_t id) const { return terms_[id]; }
+
+    // All ids in lexicographic order of their terms.
+    std::vector<uint32_t> sorted_ids() const {
+        std::vector<uint32_t> ids(terms_.size());
+        for (uint32_t i = 0; i < ids.size(); i++) ids[i] = i;
+        std::sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) { return terms_[a] < terms_[b]; });
+        return ids;
+    }
+
+    // bytes held by the arena, the table and the per-id arrays
+    uint64_t footprint() const {
+        return arena_.footprint() + slots_.capacity() * sizeof(uint32_t) +
+               terms_.capacity() * sizeof(std::string_view) + hashes_.capacity() * sizeof(uint64_t);
+    }
+
+    // FNV-1a
+    static uint64_t hash(std::string_view t) {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : t) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    void clear() {
+        arena_.clear();
+        terms_.clear();
+        hashes_.clear();
+        slots_.assign(INITIAL_SLOTS, EMPTY);
+    }
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    static constexpr size_t INITIAL_SLOTS = 1 << 12;
+
+    void grow() {
+        std::vector<uint32_t> slots(slots_.size() * 2, EMPTY);
+        size_t mask = slots.size() - 1;
+        for (uint32_t id = 0; id < terms_.size(); id++) {
+            size_t i = (size_t)hashes_[id] & mask;
+            while (slots[i] != EMPTY) i = (i + 1) & mask;
+            slots[i] = id;
+        }
+        slots_.swap(slots);
+    }
+
+    StringArena arena_;
+    std::vector<std::string_view> terms_; // id -> term, pointing into the arena
+    std::vector<uint64_t> hashes_;        // id -> hash, to skip most string compares
+    std::vector<uint32_t> slots_;         // open addressing, linear probing, power of two
+};